@@ -0,0 +1,1071 @@
+#include "client_server.h"
+
+#if PLATFORM == PLATFORM_WINDOWS
+#include <io.h>
+#endif
+
+/*
+    Micro benchmarks for the networking layer.
+
+    usage: benchmark [name]
+
+    With no name every benchmark runs. Numbers are only comparable between runs on the same machine.
+*/
+
+double bench_now()
+{
+    return r_clock_seconds(r_clock_now());
+}
+
+// send stdout to the null device while the server prints a line per client, then bring it back
+int bench_quiet_begin()
+{
+    fflush(stdout);
+#if PLATFORM == PLATFORM_WINDOWS
+    const int saved = _dup(_fileno(stdout));
+    FILE* null = fopen("NUL", "w");
+    _dup2(_fileno(null), _fileno(stdout));
+#else
+    const int saved = dup(fileno(stdout));
+    FILE* null = fopen("/dev/null", "w");
+    dup2(fileno(null), fileno(stdout));
+#endif
+    fclose(null);
+    return saved;
+}
+
+void bench_quiet_end(int saved)
+{
+    fflush(stdout);
+#if PLATFORM == PLATFORM_WINDOWS
+    _dup2(saved, _fileno(stdout));
+    _close(saved);
+#else
+    dup2(saved, fileno(stdout));
+    close(saved);
+#endif
+}
+
+/*
+    Loopback socket backends.
+
+    rx: the sender pushes a burst of 64 byte datagrams with one sendmmsg and the receiver drains the burst
+    with ReceivePacketBatch. Both sides run on one thread so the numbers do not depend on scheduling, and
+    the time per datagram covers the send and the receive. tx: the sender flushes full SendQueues at a
+    socket nobody reads.
+
+    Each test runs once on the plain socket backend (recvmmsg/sendmmsg) and once with io_uring attached.
+*/
+
+#define BenchDuration 1.0 // seconds per measurement
+#define BenchPayloadSize 64 // bytes per datagram
+#define BenchBurstSize 64 // datagrams per rx burst. more than this overflows the default socket receive buffer
+#define BenchReceivePort 40000
+#define BenchSendPort 40001
+
+void bench_loopback_rx(const char* name, bool useUring)
+{
+    SocketHandle receiveHandle, sendHandle;
+    if (!r_socket_create(&receiveHandle, BenchReceivePort) || !r_socket_create(&sendHandle, BenchSendPort)) {
+        printf("loopback rx: failed to create sockets\n");
+        return;
+    }
+
+    Socket receiver, sender;
+    r_socket_init(&receiver, receiveHandle, BenchReceivePort);
+    r_socket_init(&sender, sendHandle, BenchSendPort);
+
+#if SOCKET_HAS_IO_URING
+    UringSocket uring;
+    if (useUring && !r_uring_create(&uring, &receiver)) {
+        r_socket_destroy(&receiveHandle);
+        r_socket_destroy(&sendHandle);
+        return;
+    }
+#endif
+
+    static uint8_t buffers[MaxReceiveBatch][MaxDatagramSize];
+    ReceiveSlot slots[MaxReceiveBatch];
+    for (int i = 0; i < MaxReceiveBatch; ++i) {
+        slots[i].data = buffers[i];
+        slots[i].capacity = MaxDatagramSize;
+    }
+
+    static SendQueue queue;
+    SendQueueInit(&queue, &sender);
+
+    Address destination;
+    CreateAddress(&destination, 127, 0, 0, 1, BenchReceivePort);
+
+    uint8_t payload[BenchPayloadSize];
+    memset(payload, 0xAB, sizeof(payload));
+
+    uint64_t numReceived = 0;
+    uint64_t numCalls = 0;
+    uint64_t numLost = 0;
+
+    const double start = bench_now();
+    double elapsed = 0.0;
+
+    while (elapsed < BenchDuration) {
+        for (int i = 0; i < BenchBurstSize; ++i) {
+            memcpy(SendQueueReserve(&queue, destination, sizeof(payload)), payload, sizeof(payload));
+            SendQueueCommit(&queue, sizeof(payload));
+        }
+        SendQueueFlush(&queue);
+
+        int burstReceived = 0;
+        int numEmpty = 0;
+        while (burstReceived < BenchBurstSize && numEmpty < 1000) {
+            int received = ReceivePacketBatch(receiver, slots, MaxReceiveBatch);
+            numCalls++;
+            numEmpty = received ? 0 : numEmpty + 1;
+            burstReceived += received;
+        }
+
+        numReceived += burstReceived;
+        numLost += BenchBurstSize - burstReceived;
+
+        elapsed = bench_now() - start;
+    }
+
+    printf("loopback rx %-9s %10.0f datagrams/sec  %6.1f ns/datagram  %6.2f datagrams/call  (%llu lost)\n",
+        name,
+        numReceived / elapsed,
+        numReceived ? elapsed * 1e9 / numReceived : 0.0,
+        numCalls ? (double)numReceived / numCalls : 0.0,
+        (unsigned long long)numLost);
+
+#if SOCKET_HAS_IO_URING
+    if (useUring)
+        r_uring_destroy(&uring);
+#endif
+
+    r_socket_destroy(&receiveHandle);
+    r_socket_destroy(&sendHandle);
+}
+
+void bench_loopback_tx(const char* name, bool useUring)
+{
+    SocketHandle sinkHandle, sendHandle;
+    if (!r_socket_create(&sinkHandle, BenchReceivePort) || !r_socket_create(&sendHandle, BenchSendPort)) {
+        printf("loopback tx: failed to create sockets\n");
+        return;
+    }
+
+    Socket sender;
+    r_socket_init(&sender, sendHandle, BenchSendPort);
+
+#if SOCKET_HAS_IO_URING
+    UringSocket uring;
+    if (useUring && !r_uring_create(&uring, &sender)) {
+        r_socket_destroy(&sinkHandle);
+        r_socket_destroy(&sendHandle);
+        return;
+    }
+#endif
+
+    static SendQueue queue;
+    SendQueueInit(&queue, &sender);
+
+    Address destination;
+    CreateAddress(&destination, 127, 0, 0, 1, BenchReceivePort);
+
+    uint8_t payload[BenchPayloadSize];
+    memset(payload, 0xCD, sizeof(payload));
+
+    const double start = bench_now();
+    double elapsed = 0.0;
+
+    while (elapsed < BenchDuration) {
+        while (queue.m_numPackets < MaxSendQueuePackets) {
+            memcpy(SendQueueReserve(&queue, destination, sizeof(payload)), payload, sizeof(payload));
+            SendQueueCommit(&queue, sizeof(payload));
+        }
+        SendQueueFlush(&queue);
+        elapsed = bench_now() - start;
+    }
+
+    const SendQueueStats* stats = &queue.m_stats;
+
+    printf("loopback tx %-9s %10.0f datagrams/sec  %6.2f datagrams/syscall\n",
+        name,
+        stats->numDatagramsSent / elapsed,
+        stats->numSyscalls ? (double)stats->numDatagramsSent / stats->numSyscalls : 0.0);
+
+#if SOCKET_HAS_IO_URING
+    if (useUring)
+        r_uring_destroy(&uring);
+#endif
+
+    r_socket_destroy(&sinkHandle);
+    r_socket_destroy(&sendHandle);
+}
+
+void bench_loopback()
+{
+    bench_loopback_rx("socket", false);
+#if SOCKET_HAS_IO_URING
+    bench_loopback_rx("io_uring", true);
+#endif
+
+    bench_loopback_tx("socket", false);
+#if SOCKET_HAS_IO_URING
+    bench_loopback_tx("io_uring", true);
+#endif
+}
+
+/*
+    CRC32 throughput.
+
+    Hashes one buffer of each size over and over with every crc32 implementation the CPU supports, and checks
+    each one against the bytewise reference before timing it.
+*/
+
+#define BenchCrcBufferSize 65536
+
+void bench_crc32_run(const char* name, Crc32Function function, const uint8_t* buffer, int size)
+{
+    if (function(buffer, size, 0) != calculate_crc32_bytewise(buffer, size, 0)) {
+        printf("crc32 %-9s %6d bytes  MISMATCH\n", name, size);
+        return;
+    }
+
+    // enough iterations for about 64MB per measurement
+    const int iterations = (64 * 1024 * 1024) / size;
+
+    uint32_t crc32 = 0;
+
+    const double start = bench_now();
+    for (int i = 0; i < iterations; ++i)
+        crc32 = function(buffer, size, crc32);
+    const double elapsed = bench_now() - start;
+
+    const double bytes = (double)size * iterations;
+
+    printf("crc32 %-9s %6d bytes  %8.2f GB/s  %8.1f ns/call  (%08x)\n",
+        name,
+        size,
+        bytes / elapsed / 1e9,
+        elapsed * 1e9 / iterations,
+        crc32);
+}
+
+void bench_crc32()
+{
+    r_crc32_initialize();
+
+    static uint8_t buffer[BenchCrcBufferSize];
+    for (int i = 0; i < BenchCrcBufferSize; ++i)
+        buffer[i] = (uint8_t)random_int(0, 255);
+
+    printf("crc32 dispatch uses %s\n", crc32_function_name);
+
+    for (int size = 16; size <= BenchCrcBufferSize; size *= 4) {
+        bench_crc32_run("bytewise", calculate_crc32_bytewise, buffer, size);
+        bench_crc32_run("slice8", calculate_crc32_slice8, buffer, size);
+#if HASH_HAS_CLMUL
+        if (r_crc32_cpu_has_clmul())
+            bench_crc32_run("clmul", calculate_crc32_clmul, buffer, size);
+#endif
+    }
+}
+
+/*
+    Challenge table keys.
+
+    string: the old key. the address is formatted with snprintf and run through murmur_hash_64 three times.
+    binary: AddressKeyFromAddress then one keyed hash_words_64 over the 24 byte key and the client salt.
+
+    Both hash the same spread of addresses, ports and salts. The binary numbers include building the key.
+*/
+
+#define BenchKeyCount 4096
+
+uint64_t bench_challenge_key_string(Address address, uint64_t clientSalt, uint64_t serverSeed)
+{
+    char buffer[256];
+    const char* addressString = AddressToString(address, buffer, sizeof(buffer));
+    const int addressLength = (int)strlen(addressString);
+    return murmur_hash_64(&serverSeed, 8, murmur_hash_64(&clientSalt, 8, murmur_hash_64(addressString, addressLength, 0)));
+}
+
+void bench_challenge_key()
+{
+    static Address addresses[BenchKeyCount];
+    static uint64_t salts[BenchKeyCount];
+
+    for (int i = 0; i < BenchKeyCount; ++i) {
+        CreateAddress(&addresses[i], 10, (unsigned char)random_int(0, 255), (unsigned char)random_int(0, 255), (unsigned char)random_int(0, 255), (unsigned short)random_int(1024, 65535));
+        salts[i] = GenerateSalt();
+    }
+
+    const uint64_t serverSeed = GenerateSalt();
+    const int rounds = 1000;
+
+    uint64_t sum = 0;
+
+    double start = bench_now();
+    for (int round = 0; round < rounds; ++round) {
+        for (int i = 0; i < BenchKeyCount; ++i)
+            sum += bench_challenge_key_string(addresses[i], salts[i], serverSeed);
+    }
+    const double stringTime = bench_now() - start;
+
+    start = bench_now();
+    for (int round = 0; round < rounds; ++round) {
+        for (int i = 0; i < BenchKeyCount; ++i) {
+            const AddressKey key = AddressKeyFromAddress(addresses[i]);
+            sum += CalculateAddressHashKey(&key, salts[i], serverSeed);
+        }
+    }
+    const double binaryTime = bench_now() - start;
+
+    // how evenly the binary keys spread over the challenge table
+    static int buckets[ChallengeHashSize];
+    memset(buckets, 0, sizeof(buckets));
+    int maxBucket = 0;
+    for (int i = 0; i < BenchKeyCount; ++i) {
+        const AddressKey key = AddressKeyFromAddress(addresses[i]);
+        const int count = ++buckets[CalculateAddressHashKey(&key, salts[i], serverSeed) % ChallengeHashSize];
+        if (count > maxBucket)
+            maxBucket = count;
+    }
+
+    const double numKeys = (double)BenchKeyCount * rounds;
+
+    printf("challenge key string  %6.1f ns/key\n", stringTime * 1e9 / numKeys);
+    printf("challenge key binary  %6.1f ns/key  (%.1fx)\n", binaryTime * 1e9 / numKeys, stringTime / binaryTime);
+    printf("challenge key binary  %d keys over %d buckets, fullest bucket %d  (%llx)\n", BenchKeyCount, ChallengeHashSize, maxBucket, (unsigned long long)sum);
+}
+
+/*
+    Challenge table under load.
+
+    Fills a default server's challenge table to ChallengeMaxLoad with connection requests from distinct clients,
+    then looks every one of them up again. Reports how many got an entry, how many a direct-mapped table of the
+    same size would have kept (one per home slot, the rest dropped), and the probe lengths.
+*/
+
+#define BenchChallengeRounds 100
+
+void bench_challenge_table()
+{
+    static Socket socket;
+    static Server server;
+    if (!CreateServer(&server, &socket, DefaultMaxClients))
+        return;
+
+    ServerChallengeHash* hash = &server.m_challengeHash;
+    const int numClients = (int)(hash->size * ChallengeMaxLoad);
+
+    Address* addresses = (Address*)calloc(numClients, sizeof(Address));
+    uint64_t* salts = (uint64_t*)calloc(numClients, sizeof(uint64_t));
+    uint8_t* homeUsed = (uint8_t*)calloc(hash->size, 1);
+
+    int numInserted = 0;
+    int numDirectMapped = 0;
+    int numFound = 0;
+
+    const int quiet = bench_quiet_begin();
+
+    const double start = bench_now();
+    for (int i = 0; i < numClients; ++i) {
+        CreateAddress(&addresses[i], 10, (unsigned char)(i >> 16), (unsigned char)(i >> 8), (unsigned char)i, 40000);
+        salts[i] = GenerateSalt();
+        if (ServerFindOrInsertChallenge(&server, addresses[i], salts[i], 0.0))
+            numInserted++;
+
+        const AddressKey key = AddressKeyFromAddress(addresses[i]);
+        const int home = (int)(ServerChallengeKey(&server, &key, salts[i]) & (hash->size - 1));
+        if (!homeUsed[home]) {
+            homeUsed[home] = 1;
+            numDirectMapped++;
+        }
+    }
+    const double insertTime = bench_now() - start;
+
+    const uint64_t probesBefore = hash->stats.numProbes;
+
+    const double findStart = bench_now();
+    for (int round = 0; round < BenchChallengeRounds; ++round) {
+        for (int i = 0; i < numClients; ++i)
+            numFound += ServerFindChallenge(&server, addresses[i], salts[i], 1.0) != NULL;
+    }
+    const double findTime = bench_now() - findStart;
+
+    bench_quiet_end(quiet);
+
+    const double numFinds = (double)numClients * BenchChallengeRounds;
+
+    printf("challenge table %d slots  %d clients  %d inserted  (direct mapped would keep %d)\n", hash->size, numClients, numInserted, numDirectMapped);
+    printf("challenge table insert %6.1f ns  find %6.1f ns  %.2f slots/find  longest probe %d  (%d found)\n",
+        insertTime * 1e9 / numClients,
+        findTime * 1e9 / numFinds,
+        (hash->stats.numProbes - probesBefore) / numFinds,
+        hash->stats.maxProbe,
+        numFound / BenchChallengeRounds);
+
+    free(addresses);
+    free(salts);
+    free(homeUsed);
+
+    CleanServer(&server);
+}
+
+/*
+    Stateless challenge tokens.
+
+    What a connection request and a connection response cost the server when challenges are tokens: one SipHash
+    to make a token and one or two to check it, with nothing stored.
+*/
+
+#define BenchTokenCount 100000
+
+void bench_challenge_token()
+{
+    static Socket socket;
+    static Server server;
+    if (!CreateServer(&server, &socket, DefaultMaxClients))
+        return;
+
+    Address address;
+    CreateAddress(&address, 10, 1, 2, 3, 40000);
+
+    const double time = 1000.0;
+    uint64_t sum = 0;
+    int numValid = 0;
+
+    double start = bench_now();
+    for (int i = 0; i < BenchTokenCount; ++i)
+        sum += ServerGenerateChallengeToken(&server, address, (uint64_t)i, time);
+    const double generateTime = bench_now() - start;
+
+    start = bench_now();
+    for (int i = 0; i < BenchTokenCount; ++i) {
+        const uint64_t token = ServerGenerateChallengeToken(&server, address, (uint64_t)i, time);
+        numValid += ServerVerifyChallengeToken(&server, address, (uint64_t)i, token, time + 1.0);
+    }
+    const double verifyTime = bench_now() - start - generateTime;
+
+    printf("challenge token generate %6.1f ns  verify %6.1f ns  (%d of %d valid, %llx)\n",
+        generateTime * 1e9 / BenchTokenCount,
+        verifyTime * 1e9 / BenchTokenCount,
+        numValid,
+        BenchTokenCount,
+        (unsigned long long)sum);
+
+    CleanServer(&server);
+}
+
+/*
+    Serializer dispatch.
+
+    The same fields through the r_serialize_* functions, which check the stream type on every field, and through a
+    template instantiated for WriteStream and ReadStream. Two shapes: a keep-alive (two small ints, two uint64) and
+    a TestPacketB of BenchSerializeItems ints in [-100, 100]. The keep-alive also goes through the 64 bit word
+    WideWriteStream and WideReadStream. The array also goes through r_serialize_int_array, once with the scalar
+    kernel and once with the best one compiled in (build with -mavx2 for AVX2). Reports nanoseconds and, on x86,
+    TSC cycles per field.
+*/
+
+#define BenchSerializeItems 4096
+#define BenchSerializePackets 200000
+#define BenchSerializeArrays 500
+
+uint64_t bench_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+bool bench_runtime_keep_alive(Stream* stream, ConnectionKeepAlivePacket* packet)
+{
+    r_serialize_int(stream, &packet->packet_type, 0, 3);
+    r_serialize_int(stream, &packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
+    r_serialize_uint64(stream, &packet->client_salt);
+    r_serialize_uint64(stream, &packet->challenge_salt);
+    return true;
+}
+
+// r_serialize_test_packet_b as it was before r_serialize_int_array, one r_serialize_int per item
+bool bench_runtime_test_packet_b(Stream* stream, TestPacketB* packet)
+{
+    r_serialize_int(stream, &packet->numItems, 0, MaxItems);
+    for (int i = 0; i < packet->numItems; ++i)
+        r_serialize_int(stream, &packet->items[i], -100, +100);
+    return true;
+}
+
+template <typename Stream>
+bool bench_template_test_packet_b(Stream& stream, TestPacketB* packet)
+{
+    serialize_int(stream, packet->numItems, 0, MaxItems);
+    for (int i = 0; i < packet->numItems; ++i)
+        serialize_int(stream, packet->items[i], -100, +100);
+    return true;
+}
+
+void bench_serialize_report(const char* name, double seconds, uint64_t cycles, int numFields)
+{
+    printf("serialize %-28s %6.2f ns/field", name, seconds * 1e9 / numFields);
+    if (cycles)
+        printf("  %6.2f cycles/field", (double)cycles / numFields);
+    printf("\n");
+}
+
+void bench_serialize()
+{
+    static uint8_t buffer[BenchSerializeItems * 4 + 64];
+    static TestPacketB packet;
+    static TestPacketB readPacket;
+
+    ConnectionKeepAlivePacket keepAlive;
+    keepAlive.packet_type = 3;
+    keepAlive.client_server_type = 4;
+    keepAlive.client_salt = 0x0123456789abcdefull;
+    keepAlive.challenge_salt = 0xfedcba9876543210ull;
+
+    ConnectionKeepAlivePacket readKeepAlive;
+    uint64_t sum = 0;
+
+    const int numKeepAliveFields = BenchSerializePackets * 4;
+
+    // keep-alive write
+    double start = bench_now();
+    uint64_t cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializePackets; ++i) {
+        Stream stream;
+        r_stream_write_init(&stream, buffer, 32);
+        keepAlive.client_salt += i;
+        bench_runtime_keep_alive(&stream, &keepAlive);
+        FlushBits(&stream);
+        sum += buffer[3];
+    }
+    bench_serialize_report("keep-alive write runtime", bench_now() - start, bench_cycles() - cycles, numKeepAliveFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializePackets; ++i) {
+        Stream stream;
+        r_stream_write_init(&stream, buffer, 32);
+        WriteStream writer(&stream);
+        keepAlive.client_salt += i;
+        SerializeConnectionKeepAlivePacket(writer, &keepAlive);
+        FlushBits(&stream);
+        sum += buffer[3];
+    }
+    bench_serialize_report("keep-alive write template", bench_now() - start, bench_cycles() - cycles, numKeepAliveFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializePackets; ++i) {
+        WideWriteStream writer(buffer, 20);
+        keepAlive.client_salt += i;
+        SerializeConnectionKeepAlivePacket(writer, &keepAlive);
+        writer.Flush();
+        sum += buffer[3];
+    }
+    bench_serialize_report("keep-alive write wide", bench_now() - start, bench_cycles() - cycles, numKeepAliveFields);
+
+    // keep-alive read
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializePackets; ++i) {
+        Stream stream;
+        r_stream_read_init(&stream, buffer, 20);
+        bench_runtime_keep_alive(&stream, &readKeepAlive);
+        sum += readKeepAlive.client_salt;
+    }
+    bench_serialize_report("keep-alive read runtime", bench_now() - start, bench_cycles() - cycles, numKeepAliveFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializePackets; ++i) {
+        Stream stream;
+        r_stream_read_init(&stream, buffer, 20);
+        ReadStream reader(&stream);
+        SerializeConnectionKeepAlivePacket(reader, &readKeepAlive);
+        sum += readKeepAlive.client_salt;
+    }
+    bench_serialize_report("keep-alive read template", bench_now() - start, bench_cycles() - cycles, numKeepAliveFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializePackets; ++i) {
+        WideReadStream reader(buffer, 20);
+        if (reader.HasBits(ControlPacketBits(SerializeConnectionKeepAlivePacket<MeasureStream>)))
+            SerializeConnectionKeepAlivePacket(reader, &readKeepAlive);
+        sum += readKeepAlive.client_salt;
+    }
+    bench_serialize_report("keep-alive read wide", bench_now() - start, bench_cycles() - cycles, numKeepAliveFields);
+
+    // int array
+    packet.numItems = BenchSerializeItems;
+    for (int i = 0; i < BenchSerializeItems; ++i)
+        packet.items[i] = (i * 37) % 201 - 100;
+
+    const int numArrayFields = BenchSerializeArrays * (BenchSerializeItems + 1);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializeArrays; ++i) {
+        Stream stream;
+        r_stream_write_init(&stream, buffer, sizeof(buffer));
+        bench_runtime_test_packet_b(&stream, &packet);
+        FlushBits(&stream);
+        sum += buffer[i % 64];
+    }
+    bench_serialize_report("int array write runtime", bench_now() - start, bench_cycles() - cycles, numArrayFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializeArrays; ++i) {
+        Stream stream;
+        r_stream_write_init(&stream, buffer, sizeof(buffer));
+        WriteStream writer(&stream);
+        bench_template_test_packet_b(writer, &packet);
+        FlushBits(&stream);
+        sum += buffer[i % 64];
+    }
+    bench_serialize_report("int array write template", bench_now() - start, bench_cycles() - cycles, numArrayFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializeArrays; ++i) {
+        Stream stream;
+        r_stream_write_init(&stream, buffer, sizeof(buffer));
+        r_serialize_int(&stream, &packet.numItems, 0, MaxItems);
+        r_bitpack_write_scalar(&stream, packet.items, packet.numItems, -100, bits_required(-100, 100));
+        FlushBits(&stream);
+        sum += buffer[i % 64];
+    }
+    bench_serialize_report("int array write bulk scalar", bench_now() - start, bench_cycles() - cycles, numArrayFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializeArrays; ++i) {
+        Stream stream;
+        r_stream_write_init(&stream, buffer, sizeof(buffer));
+        r_serialize_test_packet_b(&stream, &packet);
+        FlushBits(&stream);
+        sum += buffer[i % 64];
+    }
+    bench_serialize_report(BITPACK_HAS_AVX2 ? "int array write bulk avx2" : BITPACK_HAS_SSE2 ? "int array write bulk sse2" : "int array write bulk", bench_now() - start, bench_cycles() - cycles, numArrayFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializeArrays; ++i) {
+        Stream stream;
+        r_stream_read_init(&stream, buffer, sizeof(buffer));
+        bench_runtime_test_packet_b(&stream, &readPacket);
+        sum += readPacket.items[i % BenchSerializeItems];
+    }
+    bench_serialize_report("int array read runtime", bench_now() - start, bench_cycles() - cycles, numArrayFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializeArrays; ++i) {
+        Stream stream;
+        r_stream_read_init(&stream, buffer, sizeof(buffer));
+        ReadStream reader(&stream);
+        bench_template_test_packet_b(reader, &readPacket);
+        sum += readPacket.items[i % BenchSerializeItems];
+    }
+    bench_serialize_report("int array read template", bench_now() - start, bench_cycles() - cycles, numArrayFields);
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializeArrays; ++i) {
+        Stream stream;
+        r_stream_read_init(&stream, buffer, sizeof(buffer));
+        r_serialize_int(&stream, &readPacket.numItems, 0, MaxItems);
+        r_bitpack_read_scalar(&stream, readPacket.items, readPacket.numItems, -100, +100, bits_required(-100, 100));
+        sum += readPacket.items[i % BenchSerializeItems];
+    }
+    bench_serialize_report("int array read bulk scalar", bench_now() - start, bench_cycles() - cycles, numArrayFields);
+
+    memset(readPacket.items, 0, sizeof(readPacket.items));
+
+    start = bench_now();
+    cycles = bench_cycles();
+    for (int i = 0; i < BenchSerializeArrays; ++i) {
+        Stream stream;
+        r_stream_read_init(&stream, buffer, sizeof(buffer));
+        r_serialize_test_packet_b(&stream, &readPacket);
+        sum += readPacket.items[i % BenchSerializeItems];
+    }
+    bench_serialize_report(BITPACK_HAS_AVX2 ? "int array read bulk avx2" : BITPACK_HAS_SSE2 ? "int array read bulk sse2" : "int array read bulk", bench_now() - start, bench_cycles() - cycles, numArrayFields);
+
+    printf("serialize checksum %llx (array %s)\n", (unsigned long long)sum, memcmp(packet.items, readPacket.items, sizeof(int) * BenchSerializeItems) == 0 ? "matches" : "MISMATCH");
+}
+
+/*
+    Integer encodings.
+
+    Bits per value and write + read time for three kinds of field: small counters (mostly 0-3, now and then up to
+    1000), sequence numbers (mostly +1, sometimes a gap) and 64 bit millisecond timestamps. Each goes through the
+    fixed width it would have without the variable length codes, varint, gamma and, for the values that only go up,
+    relative to the previous value. The relative run starts from a value both sides already have.
+*/
+
+#define BenchEncodingValues 100000
+
+enum BenchEncoding {
+    BENCH_ENCODING_FIXED,
+    BENCH_ENCODING_VARINT,
+    BENCH_ENCODING_GAMMA,
+    BENCH_ENCODING_RELATIVE,
+    BENCH_ENCODING_NUM_VALUES
+};
+
+const char* benchEncodingNames[BENCH_ENCODING_NUM_VALUES] = { "fixed", "varint", "gamma", "relative" };
+
+template <typename Stream>
+bool bench_encode_values(Stream& stream, uint64_t* values, int count, int encoding, int fixedBits, uint64_t base)
+{
+    uint64_t previous = base;
+    for (int i = 0; i < count; ++i) {
+        if (encoding == BENCH_ENCODING_FIXED) {
+            if (fixedBits == 64) {
+                serialize_uint64(stream, values[i]);
+            } else {
+                serialize_bits(stream, values[i], fixedBits);
+            }
+        } else if (encoding == BENCH_ENCODING_VARINT) {
+            serialize_varint64(stream, values[i]);
+        } else if (encoding == BENCH_ENCODING_GAMMA) {
+            serialize_gamma(stream, values[i]);
+        } else {
+            // steps are under 2^32, so the low 32 bits carry them and the reader adds them on to the full value
+            uint32_t current = (uint32_t)values[i];
+            serialize_relative(stream, (uint32_t)previous, current);
+            if (Stream::IsReading) {
+                values[i] = previous + (uint32_t)(current - (uint32_t)previous);
+                if (fixedBits == 32)
+                    values[i] = (uint32_t)values[i];
+            }
+        }
+        previous = values[i];
+    }
+    return true;
+}
+
+void bench_encoding_row(const char* name, uint64_t* values, int fixedBits, uint64_t base, bool increasing, bool small)
+{
+    static uint8_t buffer[BenchEncodingValues * 12];
+    static uint64_t readValues[BenchEncodingValues];
+
+    printf("encoding %-10s", name);
+
+    for (int encoding = 0; encoding < BENCH_ENCODING_NUM_VALUES; ++encoding) {
+        if ((encoding == BENCH_ENCODING_RELATIVE && !increasing) || (encoding == BENCH_ENCODING_GAMMA && !small))
+            continue;
+
+        MeasureStream measure;
+        bench_encode_values(measure, values, BenchEncodingValues, encoding, fixedBits, base);
+
+        const double start = bench_now();
+
+        Stream writeStream;
+        r_stream_write_init(&writeStream, buffer, sizeof(buffer));
+        WriteStream writer(&writeStream);
+        bench_encode_values(writer, values, BenchEncodingValues, encoding, fixedBits, base);
+        FlushBits(&writeStream);
+
+        Stream readStream;
+        r_stream_read_init(&readStream, buffer, sizeof(buffer));
+        ReadStream reader(&readStream);
+        const bool ok = bench_encode_values(reader, readValues, BenchEncodingValues, encoding, fixedBits, base);
+
+        const double elapsed = bench_now() - start;
+
+        printf("  %s %5.1f bits %4.1f ns%s",
+            benchEncodingNames[encoding],
+            (double)measure.GetBitsProcessed() / BenchEncodingValues,
+            elapsed * 1e9 / BenchEncodingValues,
+            ok && memcmp(values, readValues, sizeof(uint64_t) * BenchEncodingValues) == 0 ? "" : " MISMATCH");
+    }
+
+    printf("\n");
+}
+
+void bench_encoding()
+{
+    static uint64_t values[BenchEncodingValues];
+
+    srand(1);
+
+    for (int i = 0; i < BenchEncodingValues; ++i)
+        values[i] = (rand() % 16 == 0) ? rand() % 1000 : rand() % 4;
+    bench_encoding_row("counter", values, 32, 0, false, true);
+
+    const uint64_t firstSequence = 0xFFFF0000u; // wraps during the run
+    uint64_t sequence = firstSequence;
+    for (int i = 0; i < BenchEncodingValues; ++i) {
+        sequence = (uint32_t)(sequence + 1 + ((rand() % 10 == 0) ? rand() % 50 : 0));
+        values[i] = sequence;
+    }
+    bench_encoding_row("sequence", values, 32, firstSequence, true, false);
+
+    const uint64_t startTime = 1700000000000ull; // both sides know when the connection started
+    uint64_t time = startTime;
+    for (int i = 0; i < BenchEncodingValues; ++i) {
+        time += 16 + rand() % 3;
+        values[i] = time;
+    }
+    bench_encoding_row("time ms", values, 64, startTime, true, false);
+}
+
+/*
+    Control packets.
+
+    Building a keep-alive datagram from scratch (serialize, pad, crc32) against copying its cached image, and
+    patching a client salt into the connection denied image.
+*/
+
+#define BenchControlPacketCount 1000000
+
+void bench_control_packet()
+{
+    uint8_t datagram[ControlPacketImageSize];
+    uint64_t sum = 0;
+
+    double start = bench_now();
+    for (int i = 0; i < BenchControlPacketCount; ++i) {
+        WriteConnectionKeepAliveDatagram(datagram, sizeof(datagram), (uint64_t)i, 0x0123456789abcdefull);
+        sum += datagram[0];
+    }
+    const double serializeTime = bench_now() - start;
+
+    ControlPacketImage image;
+    image.size = WriteConnectionKeepAliveDatagram(image.data, sizeof(image.data), 1, 0x0123456789abcdefull);
+
+    start = bench_now();
+    for (int i = 0; i < BenchControlPacketCount; ++i) {
+        image.data[4] ^= (uint8_t)i; // keep the copy in the loop
+        memcpy(datagram, image.data, image.size);
+        sum += datagram[4];
+    }
+    const double copyTime = bench_now() - start;
+
+    ControlPacketImage denied;
+    denied.size = WriteConnectionDeniedDatagram(denied.data, sizeof(denied.data), 0, CONNECTION_DENIED_SERVER_FULL);
+    const int saltBit = ConnectionDeniedSaltBit();
+
+    start = bench_now();
+    for (int i = 0; i < BenchControlPacketCount; ++i) {
+        memcpy(datagram, denied.data, denied.size);
+        OrPacketBits(datagram + 4, saltBit, (uint64_t)i * 0x9E3779B97F4A7C15ull, 64);
+        WriteDatagramCrc32(datagram, denied.size);
+        sum += datagram[0];
+    }
+    const double patchTime = bench_now() - start;
+
+    printf("control packet serialize %5.1f ns  image copy %5.1f ns  denied patch %5.1f ns  (%llx)\n",
+        serializeTime * 1e9 / BenchControlPacketCount,
+        copyTime * 1e9 / BenchControlPacketCount,
+        patchTime * 1e9 / BenchControlPacketCount,
+        (unsigned long long)sum);
+}
+
+/*
+    Rate limiter.
+
+    One source floods a server with BenchFloodPackets datagrams within one second while 100 connected clients send
+    their usual traffic, then a flood comes from as many different (spoofed) sources. Reports what each check costs
+    and how much of each flood gets through to the crc32.
+*/
+
+#define BenchFloodPackets 1000000
+
+void bench_rate_limit()
+{
+    static Socket socket;
+    static Server server;
+    if (!CreateServer(&server, &socket, DefaultMaxClients))
+        return;
+
+    RateLimiter* limiter = &server.m_rateLimiter;
+
+    Address clients[100];
+    for (int i = 0; i < 100; ++i) {
+        CreateAddress(&clients[i], 10, 0, 0, (unsigned char)(i + 1), 40000);
+        r_rate_limiter_connect(limiter, clients[i], 0.0);
+    }
+
+    Address flooder;
+    CreateAddress(&flooder, 192, 168, 0, 1, 40000);
+
+    int floodAllowed = 0;
+    int clientAllowed = 0;
+
+    double start = bench_now();
+    for (int i = 0; i < BenchFloodPackets; ++i) {
+        const double time = 1.0 + (double)i / BenchFloodPackets;
+        floodAllowed += r_rate_limiter_allow(limiter, flooder, time);
+        if (i % 1000 == 0)
+            clientAllowed += r_rate_limiter_allow(limiter, clients[(i / 1000) % 100], time);
+    }
+    const double singleTime = bench_now() - start;
+
+    int spoofedAllowed = 0;
+
+    start = bench_now();
+    for (int i = 0; i < BenchFloodPackets; ++i) {
+        Address spoofed;
+        CreateAddress(&spoofed, (unsigned char)(11 + (i >> 24)), (unsigned char)(i >> 16), (unsigned char)(i >> 8), (unsigned char)i, 40000);
+        spoofedAllowed += r_rate_limiter_allow(limiter, spoofed, 2.0 + (double)i / BenchFloodPackets);
+    }
+    const double spoofedTime = bench_now() - start;
+
+    printf("rate limit one source   %5.1f ns/datagram  %d of %d through  (connected clients: %d of %d through)\n",
+        singleTime * 1e9 / BenchFloodPackets, floodAllowed, BenchFloodPackets, clientAllowed, BenchFloodPackets / 1000);
+    printf("rate limit many sources %5.1f ns/datagram  %d of %d through  (%llu evictions)\n",
+        spoofedTime * 1e9 / BenchFloodPackets, spoofedAllowed, BenchFloodPackets, (unsigned long long)limiter->m_stats.numEvicted);
+
+    CleanServer(&server);
+}
+
+/*
+    Server tick with many connected clients.
+
+    Connects BenchServerClients clients to one Server, spread over the first second so their keep-alives fall due on
+    different ticks, then runs simulated 100ms ticks: every client sends one keep-alive a second (a tenth of them per
+    tick, fed straight to ServerProcessConnectionKeepAlive), then the tick runs ServerSendPacketsAll,
+    ServerCheckForTimeOut and flushes the send queue to a socket nobody reads.
+
+    Reports the average and worst tick and the datagrams the server sent per tick.
+*/
+
+#define BenchServerClients 10000
+#define BenchServerTicks 200
+#define BenchServerTickInterval 0.1 // seconds between ticks. matches the fastest send rate in client_server.h
+
+void bench_server_tick()
+{
+    SocketHandle sinkHandle, serverHandle;
+    if (!r_socket_create(&sinkHandle, BenchReceivePort) || !r_socket_create(&serverHandle, BenchSendPort)) {
+        printf("server tick: failed to create sockets\n");
+        return;
+    }
+
+    Socket serverSocket;
+    r_socket_init(&serverSocket, serverHandle, BenchSendPort);
+
+    static Server server;
+    if (!CreateServer(&server, &serverSocket, BenchServerClients)) {
+        r_socket_destroy(&sinkHandle);
+        r_socket_destroy(&serverHandle);
+        return;
+    }
+
+    // every client gets its own loopback address. 127/8 all lands on the sink socket
+    static Address addresses[BenchServerClients];
+    static uint64_t salts[BenchServerClients];
+
+    const int quiet = bench_quiet_begin();
+    for (int i = 0; i < BenchServerClients; ++i) {
+        CreateAddress(&addresses[i], 127, (unsigned char)(1 + i / 62500), (unsigned char)((i / 250) % 250), (unsigned char)(1 + i % 250), BenchReceivePort);
+        salts[i] = GenerateSalt();
+        ServerConnectClient(&server, ServerFindFreeClientIndex(&server), addresses[i], salts[i], GenerateSalt(), (i % 10) * BenchServerTickInterval);
+        if (server.m_sendQueue.m_numPackets == MaxSendQueuePackets)
+            SendQueueFlush(&server.m_sendQueue);
+    }
+    SendQueueFlush(&server.m_sendQueue);
+    bench_quiet_end(quiet);
+
+    double time = 1.0;
+    double totalTime = 0.0;
+    double worstTick = 0.0;
+    const uint64_t sentBefore = server.m_sendQueue.m_stats.numDatagramsSent + server.m_sendQueue.m_stats.numDropped;
+
+    for (int tick = 0; tick < BenchServerTicks; ++tick) {
+        time += BenchServerTickInterval;
+
+        const double start = bench_now();
+
+        for (int i = tick % 10; i < BenchServerClients; i += 10) {
+            const int clientIndex = ServerFindExistingClientIndex(&server, addresses[i], salts[i], server.m_challengeSalt[i]);
+
+            ConnectionKeepAlivePacket packet;
+            packet.client_salt = salts[i];
+            packet.challenge_salt = server.m_challengeSalt[clientIndex];
+            ServerProcessConnectionKeepAlive(&server, &packet, addresses[i], time);
+        }
+
+        ServerSendPacketsAll(&server, time);
+        ServerCheckForTimeOut(&server, time);
+        SendQueueFlush(&server.m_sendQueue);
+
+        const double elapsed = bench_now() - start;
+
+        totalTime += elapsed;
+        if (elapsed > worstTick)
+            worstTick = elapsed;
+    }
+
+    const uint64_t sent = server.m_sendQueue.m_stats.numDatagramsSent + server.m_sendQueue.m_stats.numDropped - sentBefore;
+
+    printf("server tick %d clients  %8.1f us/tick avg  %8.1f us/tick worst  %7.1f datagrams/tick  (%d connected)\n",
+        BenchServerClients,
+        totalTime * 1e6 / BenchServerTicks,
+        worstTick * 1e6,
+        (double)sent / BenchServerTicks,
+        server.m_numConnectedClients);
+
+    CleanServer(&server);
+
+    r_socket_destroy(&sinkHandle);
+    r_socket_destroy(&serverHandle);
+}
+
+typedef struct Benchmark {
+    const char* name;
+    void (*run)();
+} Benchmark;
+
+Benchmark benchmarks[] = {
+    { "loopback", bench_loopback },
+    { "crc32", bench_crc32 },
+    { "challenge_key", bench_challenge_key },
+    { "challenge_table", bench_challenge_table },
+    { "challenge_token", bench_challenge_token },
+    { "control_packet", bench_control_packet },
+    { "serialize", bench_serialize },
+    { "encoding", bench_encoding },
+    { "rate_limit", bench_rate_limit },
+    { "server_tick", bench_server_tick },
+};
+
+int main(int argc, char** argv)
+{
+    r_sockets_initialize();
+
+    const int numBenchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+    bool found = false;
+
+    for (int i = 0; i < numBenchmarks; ++i) {
+        if (argc > 1 && strcmp(argv[1], benchmarks[i].name) != 0)
+            continue;
+
+        benchmarks[i].run();
+        found = true;
+    }
+
+    if (!found) {
+        printf("usage: benchmark [name]\n");
+        for (int i = 0; i < numBenchmarks; ++i)
+            printf("    %s\n", benchmarks[i].name);
+    }
+
+    r_sockets_shutdown();
+
+    return found ? 0 : 1;
+}
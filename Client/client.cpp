@@ -73,7 +73,7 @@ int main()
 
             int numBytes = (writeStream.m_bitsProcessed + align_bits) / 8;
 
-            SendPacket(socket, address, (void*)buffer, numBytes);
+            SendPacket(&socket, address, (void*)buffer, numBytes);
             continue;
         }
 
@@ -107,13 +107,13 @@ int main()
 
             int numBytes = (writeStream.m_bitsProcessed + align_bits) / 8;
 
-            SendPacket(socket, address, (void*)buffer, numBytes);
+            SendPacket(&socket, address, (void*)buffer, numBytes);
             continue;
         }
 
         // You can do something with the input here, like sending it
         // For demonstration, we'll just print it.
-        SendPacket(socket, address, (void*)input, sizeof(input));
+        SendPacket(&socket, address, (void*)input, sizeof(input));
     }
 
     DestroySocket(socket.m_socket);
@@ -1,5 +1,4 @@
 #include "client_server.h"
-#include <time.h>
 
 int main()
 {
@@ -21,14 +20,12 @@ int main()
     char input[100];
 
     Socket socket;
-    socket.m_port = port;
-    socket.m_socket = socketHandle;
+    r_socket_init(&socket, socketHandle, port);
 
     Client client;
-    CreateClient(&client, socket);
+    CreateClient(&client, &socket);
 
-    time_t currentTime;
-    time(&currentTime);
+    double currentTime = r_clock_seconds(r_clock_now());
 
     uint8_t buffer[MaxPacketSize];
 
@@ -36,10 +33,12 @@ int main()
 
     while (1) {
 
-        time(&currentTime);
+        currentTime = r_clock_seconds(r_clock_now());
 
         ClientSendPackets(&client, currentTime);
 
+        SendQueueFlush(&client.m_sendQueue);
+
         Address sender;
 
         int bytes_read = ReceivePackets(socket, &sender,
@@ -61,19 +60,18 @@ int main()
 
             printf("bytes_read: %d\n", bytes_read);
 
+            if (bytes_read < 4) {
+                printf("datagram too small for a crc32\n");
+                continue;
+            }
+
             Stream readStream;
             r_stream_read_init(&readStream, buffer, bytes_read);
 
             uint32_t read_crc32 = 0;
             r_serialize_bits(&readStream, &read_crc32, 32);
 
-            uint32_t network_protocolId = host_to_network(packetInfo.protocolId);
-            uint32_t crc32 = calculate_crc32((const uint8_t*)&network_protocolId, 4, 0);
-            uint32_t zero = 0;
-
-            crc32 = calculate_crc32((const uint8_t*)&zero, 4, crc32);
-            // important to offset buffer as to not include og crc32
-            crc32 = calculate_crc32(buffer + 4, bytes_read - 4, crc32);
+            uint32_t crc32 = DatagramCrc32(buffer, bytes_read);
 
             if (crc32 != read_crc32) {
                 printf("corrupt packet. expected crc32 %x, got %x\n", crc32, read_crc32);
@@ -89,7 +87,7 @@ int main()
                 int32_t client_server_type = 0;
                 r_serialize_int(&readStream, &client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
 
-                ClientReceivePackets(&client, currentTime, sender, &readStream, client_server_type);
+                ClientReceivePackets(&client, currentTime, sender, buffer + HEADER_SIZE, bytes_read - HEADER_SIZE, client_server_type);
             }
 
             //retir(packet_type, readStream);
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "timer_wheel.h"
+
+// timers due on and either side of the level boundaries, which are the ticks that cascade
+const uint64_t dueTicks[] = { 1, 63, 64, 65, 127, 128, 4095, 4096, 4097, 8192, 262143, 262144, 300000 };
+const int NumTimers = sizeof(dueTicks) / sizeof(dueTicks[0]);
+
+uint64_t firedTick[NumTimers];
+uint64_t currentTick;
+
+void on_timer(void* context, int timer, double time)
+{
+    (void)context;
+    (void)time;
+
+    firedTick[timer] = currentTick;
+}
+
+int main()
+{
+    const double resolution = 0.1;
+
+    TimerWheel wheel;
+    if (!r_timer_wheel_create(&wheel, NumTimers, resolution, on_timer, NULL))
+        return 1;
+
+    for (int i = 0; i < NumTimers; ++i)
+        r_timer_wheel_schedule(&wheel, i, dueTicks[i] * resolution);
+
+    // one tick at a time, so a timer that fires late shows up as the wrong tick
+    int numFired = 0;
+    for (currentTick = 1; currentTick <= 300001; ++currentTick)
+        numFired += r_timer_wheel_advance(&wheel, currentTick * resolution);
+
+    int numFailed = 0;
+    for (int i = 0; i < NumTimers; ++i) {
+        if (firedTick[i] != dueTicks[i]) {
+            printf("timer due at tick %llu fired at tick %llu\n", (unsigned long long)dueTicks[i], (unsigned long long)firedTick[i]);
+            numFailed++;
+        }
+    }
+
+    assert(numFired == NumTimers);
+
+    r_timer_wheel_destroy(&wheel);
+
+    printf("%d of %d timers fired on time\n", NumTimers - numFailed, NumTimers);
+
+    return numFailed == 0 ? 0 : 1;
+}
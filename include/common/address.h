@@ -23,9 +23,15 @@
 #elif PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
 
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
+typedef struct sockaddr SOCKADDR;
+typedef struct sockaddr_in SOCKADDR_IN;
+typedef struct sockaddr_storage SOCKADDR_STORAGE;
+
 #endif
 
 #if PLATFORM == PLATFORM_WINDOWS
@@ -96,4 +102,47 @@ const char* AddressToString(Address adress, char* buffer, int bufferSize)
     return buffer;
 }
 
+bool AddressEquals(Address a, Address b)
+{
+    return a.m_address_ipv4 == b.m_address_ipv4 && a.m_port == b.m_port;
+}
+
+/*
+    Fixed width binary form of an address for hashing and comparing. 24 bytes, no padding:
+
+        [0..15]  IPv6 address. IPv4 is stored mapped as ::ffff:a.b.c.d
+        [16..17] port
+        [18..19] address family (4 or 6)
+        [20..23] zero
+
+    Keys for the same address are bit-identical, so they can be hashed as three words and compared with ==.
+*/
+typedef struct AddressKey {
+    uint64_t m_words[3];
+} AddressKey;
+
+AddressKey AddressKeyFromAddress(Address address)
+{
+    uint8_t bytes[24];
+    memset(bytes, 0, sizeof(bytes));
+
+    bytes[10] = 0xFF;
+    bytes[11] = 0xFF;
+    memcpy(bytes + 12, &address.m_address_ipv4, 4); // already in network byte order
+
+    const uint16_t port = address.m_port;
+    const uint16_t family = 4;
+    memcpy(bytes + 16, &port, 2);
+    memcpy(bytes + 18, &family, 2);
+
+    AddressKey key;
+    memcpy(key.m_words, bytes, sizeof(bytes));
+    return key;
+}
+
+bool AddressKeyEquals(const AddressKey* a, const AddressKey* b)
+{
+    return ((a->m_words[0] ^ b->m_words[0]) | (a->m_words[1] ^ b->m_words[1]) | (a->m_words[2] ^ b->m_words[2])) == 0;
+}
+
 #endif
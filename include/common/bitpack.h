@@ -0,0 +1,407 @@
+#ifndef BITPACK_H
+#define BITPACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "serializer.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BITPACK_HAS_AVX2 1
+#else
+#define BITPACK_HAS_AVX2 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BITPACK_HAS_SSE2 1
+#else
+#define BITPACK_HAS_SSE2 0
+#endif
+
+/*
+    Bulk bit packing for arrays of bounded integers.
+
+    r_serialize_int_array writes count values in [min, max] exactly as count calls to r_serialize_int would: each
+    value - min in bits_required(min, max) bits, LSB first, one after another with no padding. The two can be mixed
+    freely on the same stream, in either direction.
+
+    Per element, r_serialize_int checks the stream type, works out the bit count with log2 and maybe flushes a word.
+    Here that is done once per array, and the fields are packed by a kernel:
+
+        AVX2    8 values per step: subtract min, then pairs and quads of fields are merged with 64 bit shifts, so
+                8 fields go to the stream as one chunk of 8 * bits bits (two of 4 * bits when that is over 64)
+        SSE2    the same 4 values at a time
+        scalar  one field at a time through a local copy of the stream state. also handles what is left over
+
+    The SIMD kernels take fields up to BitpackMaxSimdBits wide, so four of them fit in 64 bits. Wider fields use the
+    scalar loop. The write kernels add each chunk to the stream with one 64 bit store (r_bitpack_put_chunk), so they
+    stop two words short of the end of the buffer and leave the rest to the scalar loop. Which kernel is used is fixed at compile time by the instruction sets the compiler targets (eg.
+    -mavx2 or /arch:AVX2). SSE2 is always there on x64. The kernels assume a little endian host, as x86 is.
+
+    Reading checks the whole array fits in the stream once up front. A value above max fails the read, like
+    r_serialize_int.
+*/
+
+#define BitpackMaxSimdBits 16 // widest field the SIMD kernels pack. wider ones go through the scalar loop
+
+// stream state in locals, so the compiler can keep it in registers while the loop stores to data
+typedef struct BitpackState {
+    uint32_t* data;
+    uint64_t scratch;
+    int scratchBits;
+    int wordIndex;
+} BitpackState;
+
+inline BitpackState r_bitpack_begin(const Stream* stream)
+{
+    BitpackState state;
+    state.data = stream->data;
+    state.scratch = stream->scratch;
+    state.scratchBits = stream->scratch_bits;
+    state.wordIndex = stream->word_index;
+    return state;
+}
+
+inline void r_bitpack_end(Stream* stream, const BitpackState* state, int bitsProcessed)
+{
+    stream->scratch = state->scratch;
+    stream->scratch_bits = state->scratchBits;
+    stream->word_index = state->wordIndex;
+    stream->bits_processed += bitsProcessed;
+}
+
+// append a field of up to 32 bits. the current word is stored every time and the index moves on once it is full,
+// so there is no branch. the word stored always holds at least one bit of the field, so it is inside the buffer
+inline void r_bitpack_put(BitpackState* state, uint32_t value, int bits)
+{
+    state->scratch |= (uint64_t)value << state->scratchBits;
+    state->scratchBits += bits;
+    state->data[state->wordIndex] = host_to_network((uint32_t)state->scratch);
+
+    const int full = state->scratchBits >> 5;
+    state->scratch >>= full * 32;
+    state->scratchBits -= full * 32;
+    state->wordIndex += full;
+}
+
+// append a chunk of up to 64 bits with a single unaligned 64 bit store of the current word and the next. the
+// caller makes sure both are inside the buffer. little endian host only, like the SIMD kernels that use it
+inline void r_bitpack_put_chunk(BitpackState* state, uint64_t value, int bits)
+{
+    const int scratchBits = state->scratchBits;
+    const uint64_t low = state->scratch | (value << scratchBits);
+    const uint64_t high = (value >> 1) >> (63 - scratchBits); // the bits that went past 64. none when scratchBits is 0
+
+    memcpy(state->data + state->wordIndex, &low, 8);
+
+    const int total = scratchBits + bits;
+    const int full = total >> 5; // 0, 1 or 2 words filled
+    state->scratch = full == 2 ? high : low >> (full * 32);
+    state->scratchBits = total - full * 32;
+    state->wordIndex += full;
+}
+
+// take a field of up to 32 bits. same refill as r_stream_read_bits, so the stream ends in the same state
+inline uint32_t r_bitpack_get(BitpackState* state, int bits)
+{
+    if (state->scratchBits < bits) {
+        state->scratch |= (uint64_t)network_to_host(state->data[state->wordIndex]) << state->scratchBits;
+        state->scratchBits += 32;
+        state->wordIndex++;
+    }
+
+    const uint32_t value = (uint32_t)(state->scratch & (((uint64_t)1 << bits) - 1));
+    state->scratch >>= bits;
+    state->scratchBits -= bits;
+    return value;
+}
+
+inline uint64_t r_bitpack_get64(BitpackState* state, int bits)
+{
+    if (bits <= 32)
+        return r_bitpack_get(state, bits);
+
+    const uint64_t low = r_bitpack_get(state, 32);
+    return low | ((uint64_t)r_bitpack_get(state, bits - 32) << 32);
+}
+
+/*
+    Kernels. Each packs or unpacks as many values as it handles (the SIMD ones a multiple of their width) and
+    returns how many. The read kernels return -1 if a value was out of range.
+*/
+
+int r_bitpack_write_scalar(Stream* stream, const int32_t* values, int count, int32_t min, int bits)
+{
+    const uint32_t mask = (uint32_t)(((uint64_t)1 << bits) - 1);
+
+    BitpackState state = r_bitpack_begin(stream);
+
+    for (int i = 0; i < count; ++i)
+        r_bitpack_put(&state, ((uint32_t)values[i] - (uint32_t)min) & mask, bits);
+
+    r_bitpack_end(stream, &state, count * bits);
+
+    return count;
+}
+
+int r_bitpack_read_scalar(Stream* stream, int32_t* values, int count, int32_t min, int32_t max, int bits)
+{
+    const uint32_t range = (uint32_t)max - (uint32_t)min;
+
+    BitpackState state = r_bitpack_begin(stream);
+
+    uint32_t bad = 0;
+    for (int i = 0; i < count; ++i) {
+        const uint32_t value = r_bitpack_get(&state, bits);
+        bad |= value > range;
+        values[i] = (int32_t)(value + (uint32_t)min);
+    }
+
+    r_bitpack_end(stream, &state, count * bits);
+
+    return bad ? -1 : count;
+}
+
+#if BITPACK_HAS_SSE2
+
+int r_bitpack_write_sse2(Stream* stream, const int32_t* values, int count, int32_t min, int bits)
+{
+    assert(bits <= BitpackMaxSimdBits);
+
+    const __m128i minimum = _mm_set1_epi32(min);
+    const __m128i mask = _mm_set1_epi32((int)((1u << bits) - 1));
+    const __m128i low = _mm_set_epi32(0, -1, 0, -1);
+    const __m128i shift = _mm_cvtsi32_si128(bits);
+    const __m128i shift2 = _mm_cvtsi32_si128(bits * 2);
+
+    BitpackState state = r_bitpack_begin(stream);
+
+    // each step stores at most two words past wordIndex, and moves it on by at most two
+    const int lastWord = stream->num_bits / 32 - 2;
+
+    int numPacked = 0;
+
+    for (; numPacked + 4 <= count && state.wordIndex <= lastWord; numPacked += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(values + numPacked));
+        v = _mm_and_si128(_mm_sub_epi32(v, minimum), mask);
+
+        // f0 | f1 << bits, f2 | f3 << bits
+        __m128i t = _mm_or_si128(_mm_and_si128(v, low), _mm_sll_epi64(_mm_srli_epi64(v, 32), shift));
+
+        // f0 | f1 << bits | f2 << 2 bits | f3 << 3 bits
+        t = _mm_or_si128(t, _mm_sll_epi64(_mm_srli_si128(t, 8), shift2));
+
+        uint64_t chunk;
+        _mm_storel_epi64((__m128i*)&chunk, t);
+
+        r_bitpack_put_chunk(&state, chunk, bits * 4);
+    }
+
+    r_bitpack_end(stream, &state, numPacked * bits);
+
+    return numPacked;
+}
+
+int r_bitpack_read_sse2(Stream* stream, int32_t* values, int count, int32_t min, int32_t max, int bits)
+{
+    assert(bits <= BitpackMaxSimdBits);
+
+    const __m128i minimum = _mm_set1_epi32(min);
+    const __m128i range = _mm_set1_epi32(max - min);
+    const __m128i mask = _mm_set1_epi64x((int64_t)((1u << bits) - 1));
+    const __m128i shift = _mm_cvtsi32_si128(bits);
+
+    BitpackState state = r_bitpack_begin(stream);
+
+    __m128i bad = _mm_setzero_si128();
+
+    const int numUnpacked = count & ~3;
+
+    for (int i = 0; i < numUnpacked; i += 4) {
+        const uint64_t chunk = r_bitpack_get64(&state, bits * 4);
+
+        // lanes f0 f1 | f2 f3, then the odd fields shifted down into the high half of each lane
+        const __m128i a = _mm_set_epi64x((int64_t)(chunk >> (bits * 2)), (int64_t)chunk);
+        const __m128i even = _mm_and_si128(a, mask);
+        const __m128i odd = _mm_and_si128(_mm_srl_epi64(a, shift), mask);
+        const __m128i v = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+
+        // fields are at most 16 bits, so the signed compare is safe
+        bad = _mm_or_si128(bad, _mm_cmpgt_epi32(v, range));
+
+        _mm_storeu_si128((__m128i*)(values + i), _mm_add_epi32(v, minimum));
+    }
+
+    r_bitpack_end(stream, &state, numUnpacked * bits);
+
+    return _mm_movemask_epi8(bad) ? -1 : numUnpacked;
+}
+
+#endif // #if BITPACK_HAS_SSE2
+
+#if BITPACK_HAS_AVX2
+
+int r_bitpack_write_avx2(Stream* stream, const int32_t* values, int count, int32_t min, int bits)
+{
+    assert(bits <= BitpackMaxSimdBits);
+
+    const __m256i minimum = _mm256_set1_epi32(min);
+    const __m256i mask = _mm256_set1_epi32((int)((1u << bits) - 1));
+    const __m256i low = _mm256_set1_epi64x(0xFFFFFFFFll);
+    const __m128i shift = _mm_cvtsi32_si128(bits);
+    const __m128i shift2 = _mm_cvtsi32_si128(bits * 2);
+
+    BitpackState state = r_bitpack_begin(stream);
+
+    // two chunks a step for fields over 8 bits, each storing two words and moving on by at most two
+    const int lastWord = stream->num_bits / 32 - 4;
+
+    int numPacked = 0;
+
+    for (; numPacked + 8 <= count && state.wordIndex <= lastWord; numPacked += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(values + numPacked));
+        v = _mm256_and_si256(_mm256_sub_epi32(v, minimum), mask);
+
+        __m256i t = _mm256_or_si256(_mm256_and_si256(v, low), _mm256_sll_epi64(_mm256_srli_epi64(v, 32), shift));
+        t = _mm256_or_si256(t, _mm256_sll_epi64(_mm256_bsrli_epi128(t, 8), shift2));
+
+        // fields 0-3 in the low 64 bits of the low half, 4-7 in the low 64 bits of the high half
+        uint64_t first, second;
+        _mm_storel_epi64((__m128i*)&first, _mm256_castsi256_si128(t));
+        _mm_storel_epi64((__m128i*)&second, _mm256_extracti128_si256(t, 1));
+
+        if (bits <= 8) {
+            r_bitpack_put_chunk(&state, first | (second << (bits * 4)), bits * 8);
+        } else {
+            r_bitpack_put_chunk(&state, first, bits * 4);
+            r_bitpack_put_chunk(&state, second, bits * 4);
+        }
+    }
+
+    r_bitpack_end(stream, &state, numPacked * bits);
+
+    return numPacked;
+}
+
+int r_bitpack_read_avx2(Stream* stream, int32_t* values, int count, int32_t min, int32_t max, int bits)
+{
+    assert(bits <= BitpackMaxSimdBits);
+
+    const __m256i minimum = _mm256_set1_epi32(min);
+    const __m256i range = _mm256_set1_epi32(max - min);
+    const __m256i mask = _mm256_set1_epi64x((int64_t)((1u << bits) - 1));
+    const __m128i shift = _mm_cvtsi32_si128(bits);
+
+    BitpackState state = r_bitpack_begin(stream);
+
+    __m256i bad = _mm256_setzero_si256();
+
+    const int numUnpacked = count & ~7;
+
+    for (int i = 0; i < numUnpacked; i += 8) {
+        uint64_t first, second;
+        if (bits <= 8) {
+            const uint64_t chunk = r_bitpack_get64(&state, bits * 8);
+            first = chunk & (((uint64_t)1 << (bits * 4)) - 1);
+            second = chunk >> (bits * 4);
+        } else {
+            first = r_bitpack_get64(&state, bits * 4);
+            second = r_bitpack_get64(&state, bits * 4);
+        }
+
+        const __m256i a = _mm256_set_epi64x((int64_t)(second >> (bits * 2)), (int64_t)second, (int64_t)(first >> (bits * 2)), (int64_t)first);
+        const __m256i even = _mm256_and_si256(a, mask);
+        const __m256i odd = _mm256_and_si256(_mm256_srl_epi64(a, shift), mask);
+        const __m256i v = _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+
+        bad = _mm256_or_si256(bad, _mm256_cmpgt_epi32(v, range));
+
+        _mm256_storeu_si256((__m256i*)(values + i), _mm256_add_epi32(v, minimum));
+    }
+
+    r_bitpack_end(stream, &state, numUnpacked * bits);
+
+    return _mm256_movemask_epi8(bad) ? -1 : numUnpacked;
+}
+
+#endif // #if BITPACK_HAS_AVX2
+
+// pack count values of bits bits with the best kernel compiled in. the stream must have room
+void r_bitpack_write(Stream* stream, const int32_t* values, int count, int32_t min, int bits)
+{
+    assert(stream->type == WRITE);
+    assert(bits > 0 && bits <= 32);
+    assert(stream->bits_processed + count * bits <= stream->num_bits);
+
+    int i = 0;
+
+#if BITPACK_HAS_AVX2
+    if (bits <= BitpackMaxSimdBits)
+        i = r_bitpack_write_avx2(stream, values, count, min, bits);
+#elif BITPACK_HAS_SSE2
+    if (bits <= BitpackMaxSimdBits)
+        i = r_bitpack_write_sse2(stream, values, count, min, bits);
+#endif
+
+    r_bitpack_write_scalar(stream, values + i, count - i, min, bits);
+}
+
+// unpack count values. the caller checks the stream holds them. false if any is above max
+bool r_bitpack_read(Stream* stream, int32_t* values, int count, int32_t min, int32_t max, int bits)
+{
+    assert(stream->type == READ);
+    assert(bits > 0 && bits <= 32);
+    assert(stream->bits_processed + count * bits <= stream->num_bits);
+
+    int i = 0;
+
+#if BITPACK_HAS_AVX2
+    if (bits <= BitpackMaxSimdBits)
+        i = r_bitpack_read_avx2(stream, values, count, min, max, bits);
+#elif BITPACK_HAS_SSE2
+    if (bits <= BitpackMaxSimdBits)
+        i = r_bitpack_read_sse2(stream, values, count, min, max, bits);
+#endif
+
+    if (i < 0)
+        return false;
+
+    return r_bitpack_read_scalar(stream, values + i, count - i, min, max, bits) >= 0;
+}
+
+bool r_serialize_int_array(Stream* stream, int32_t* values, int count, int32_t min, int32_t max)
+{
+    assert(min < max);
+    assert(count >= 0);
+
+    if (count == 0)
+        return true;
+
+    const int bits = bits_required(min, max);
+
+    if (stream->type == WRITE) {
+
+#ifndef NDEBUG
+        for (int i = 0; i < count; ++i) {
+            assert(values[i] >= min);
+            assert(values[i] <= max);
+        }
+#endif
+
+        r_bitpack_write(stream, values, count, min, bits);
+        return true;
+    }
+
+    if (WouldOverflow(*stream, count * bits)) {
+        printf("Read Error: Would Overflow\n");
+        return false;
+    }
+
+    return r_bitpack_read(stream, values, count, min, max, bits);
+}
+
+#endif
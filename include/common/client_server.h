@@ -3,24 +3,39 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <inttypes.h>
 
 #include "serializer.h"
+#include "stream.hpp"
+#include "wide_stream.hpp"
 #include "address.h"
 #include "hash.h"
 #include "socket.h"
+#include "clock.h"
+#include "timer_wheel.h"
+#include "rate_limit.h"
 
 //const uint32_t ProtocolId = 0x12341651;
 //const int MaxPacketSize = 1200;
-#define MaxClients 32
+#define DefaultMaxClients 32 // client capacity when none is given to CreateServer
 #define ServerPort 50000
 #define ClientPort 60000
 
-#define ChallengeHashSize 1024
+#define ChallengeHashSize 1024 // smallest challenge table. CreateServer grows it with maxClients
+#define ChallengeMaxProbe 32 // furthest a challenge entry may sit from its home slot
+#define ChallengeMaxLoad 0.5 // fraction of challenge slots that may be in use. inserts past it fail
 #define ChallengeSendRate 0.1
 #define ChallengeTimeOut 10.0
 
+#ifndef SERVER_STATELESS_CHALLENGE
+#define SERVER_STATELESS_CHALLENGE 1 // challenge salts are tokens the server checks without keeping state. 0 keeps pending challenges in the challenge hash
+#endif
+
+#define ChallengeTokenResolution 1.0 // seconds per step of the timestamp in a challenge token
+#define ChallengeSecretLifetime ChallengeTimeOut // seconds a secret signs new challenge tokens. it verifies them for one lifetime more
+
 #define ConnectionRequestSendRate 0.1
 #define ConnectionChallengeSendRate 0.1
 #define ConnectionResponseSendRate 0.1
@@ -32,6 +47,8 @@
 #define KeepAliveTimeOut 10.0
 #define ClientSaltTimeout 1.0
 
+#define ServerTimerResolution 0.1 // seconds per timer wheel tick. matches the server loop tick
+
 uint64_t GenerateSalt()
 {
     return (((uint64_t)(rand()) << 0) & 0x000000000000FFFFull) | (((uint64_t)(rand()) << 16) & 0x00000000FFFF0000ull) | (((uint64_t)(rand()) << 32) & 0x0000FFFF00000000ull) | (((uint64_t)(rand()) << 48) & 0xFFFF000000000000ull);
@@ -88,14 +105,13 @@ typedef struct ConnectionRequestPacket {
     uint8_t data[256];
 } ConnectionRequestPacket;
 
-bool SerializeConnectionRequestPacket(Stream* stream, ConnectionRequestPacket* packet)
+template <typename Stream>
+bool SerializeConnectionRequestPacket(Stream& stream, ConnectionRequestPacket* packet)
 {
-    r_serialize_int(stream, &packet->packet_type, 0, 3);
-    r_serialize_int(stream, &packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
+    serialize_int(stream, packet->packet_type, 0, 3);
+    serialize_int(stream, packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
 
-    serialize_uint64(stream, &packet->client_salt);
-    if (stream->type == READ && GetBitsRemaining(stream) < 256 * 8)
-        return false;
+    serialize_uint64(stream, packet->client_salt);
     serialize_bytes(stream, packet->data, 256);
     return true;
 }
@@ -118,12 +134,13 @@ typedef struct ConnectionDeniedPacket {
     ConnectionDeniedReason reason;
 } ConnectionDeniedPacket;
 
-bool SerializeConnectionDeniedPacket(Stream* stream, ConnectionDeniedPacket* packet)
+template <typename Stream>
+bool SerializeConnectionDeniedPacket(Stream& stream, ConnectionDeniedPacket* packet)
 {
-    r_serialize_int(stream, &packet->packet_type, 0, 3);
-    r_serialize_int(stream, &packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
+    serialize_int(stream, packet->packet_type, 0, 3);
+    serialize_int(stream, packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
 
-    serialize_uint64(stream, &packet->client_salt);
+    serialize_uint64(stream, packet->client_salt);
     serialize_enum(stream, packet->reason, ConnectionDeniedReason, CONNECTION_DENIED_NUM_VALUES);
     return true;
 }
@@ -137,13 +154,14 @@ typedef struct ConnectionChallengePacket {
     uint64_t challenge_salt;
 } ConnectionChallengePacket;
 
-bool SerializeConnectionChallengePacket(Stream* stream, ConnectionChallengePacket* packet)
+template <typename Stream>
+bool SerializeConnectionChallengePacket(Stream& stream, ConnectionChallengePacket* packet)
 {
-    r_serialize_int(stream, &packet->packet_type, 0, 3);
-    r_serialize_int(stream, &packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
+    serialize_int(stream, packet->packet_type, 0, 3);
+    serialize_int(stream, packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
 
-    serialize_uint64(stream, &packet->client_salt);
-    serialize_uint64(stream, &packet->challenge_salt);
+    serialize_uint64(stream, packet->client_salt);
+    serialize_uint64(stream, packet->challenge_salt);
     return true;
 }
 
@@ -155,13 +173,14 @@ typedef struct ConnectionResponsePacket {
     uint64_t challenge_salt;
 } ConnectionResponsePacket;
 
-bool SerializeConnectionResponsePacket(Stream* stream, ConnectionResponsePacket* packet)
+template <typename Stream>
+bool SerializeConnectionResponsePacket(Stream& stream, ConnectionResponsePacket* packet)
 {
-    r_serialize_int(stream, &packet->packet_type, 0, 3);
-    r_serialize_int(stream, &packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
+    serialize_int(stream, packet->packet_type, 0, 3);
+    serialize_int(stream, packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
 
-    serialize_uint64(stream, &packet->client_salt);
-    serialize_uint64(stream, &packet->challenge_salt);
+    serialize_uint64(stream, packet->client_salt);
+    serialize_uint64(stream, packet->challenge_salt);
     return true;
 }
 
@@ -174,13 +193,14 @@ typedef struct ConnectionKeepAlivePacket {
 } ConnectionKeepAlivePacket;
 
 
-bool SerializeConnectionKeepAlivePacket(Stream* stream, ConnectionKeepAlivePacket* packet)
+template <typename Stream>
+bool SerializeConnectionKeepAlivePacket(Stream& stream, ConnectionKeepAlivePacket* packet)
 {
-    r_serialize_int(stream, &packet->packet_type, 0, 3);
-    r_serialize_int(stream, &packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
+    serialize_int(stream, packet->packet_type, 0, 3);
+    serialize_int(stream, packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
 
-    serialize_uint64(stream, &packet->client_salt);
-    serialize_uint64(stream, &packet->challenge_salt);
+    serialize_uint64(stream, packet->client_salt);
+    serialize_uint64(stream, packet->challenge_salt);
     return true;
 }
 
@@ -195,43 +215,224 @@ typedef struct ConnectionDisconnectPacket {
     uint64_t challenge_salt;
 } ConnectionDisconnectPacket;
 
-bool SerializeConnectionDisconnectPacket(Stream* stream, ConnectionDisconnectPacket* packet)
+template <typename Stream>
+bool SerializeConnectionDisconnectPacket(Stream& stream, ConnectionDisconnectPacket* packet)
+{
+    serialize_int(stream, packet->packet_type, 0, 3);
+    serialize_int(stream, packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
+
+    serialize_uint64(stream, packet->client_salt);
+    serialize_uint64(stream, packet->challenge_salt);
+    return true;
+}
+
+/*
+    Control packet images.
+
+    The connection request, response, keep-alive and disconnect packets only vary in their salts, and those are
+    fixed for the life of a connection. So each is serialized once, crc32 included, into an image when the salts
+    are known, and sending one is a copy into a send queue slot.
+
+    The denied packet goes to clients nothing is kept for, so the server holds one image per reason with a zero
+    client salt. A send copies it, ORs the salt into its bits and redoes the crc32.
+*/
+
+#define ControlPacketImageSize 32 // bytes. room for the crc32 and any control packet but the connection request
+#define ConnectionRequestImageSize 288 // bytes. the connection request carries 256 bytes of padding
+
+typedef struct ControlPacketImage {
+    int size; // bytes in data. 0 until the image is built
+    uint8_t data[ControlPacketImageSize]; // the whole datagram, crc32 included
+} ControlPacketImage;
+
+/*
+    Serialize a packet into datagram as [crc32][packet padded to 4 bytes] with a WideWriteStream. The packet is
+    measured first, and the datagram has to hold what that says. Returns the bytes in the datagram, or 0 if they do
+    not fit in capacity.
+
+    Pass the serialize function instantiated for both streams, eg. SerializeFooPacket<MeasureStream> and
+    SerializeFooPacket<WideWriteStream>.
+*/
+template <typename Packet>
+int WriteWidePacketDatagram(uint8_t* datagram, int capacity, bool (*measure)(MeasureStream&, Packet*), bool (*write)(WideWriteStream&, Packet*), Packet* packet)
+{
+    const int numBits = MeasureBits(measure, packet);
+    const int numBytes = PacketDatagramSize(numBits);
+    if (numBytes > capacity)
+        return 0;
+
+    *((uint32_t*)datagram) = 0;
+
+    WideWriteStream stream(datagram + HEADER_SIZE, numBytes - HEADER_SIZE);
+    write(stream, packet);
+    stream.Flush();
+
+    assert(stream.GetBitsProcessed() == numBits);
+
+    WriteDatagramCrc32(datagram, numBytes);
+
+    return numBytes;
+}
+
+// the same, straight into a send queue slot reserved at the measured size
+template <typename Packet>
+bool SendQueueWidePacket(SendQueue* queue, Address address, bool (*measure)(MeasureStream&, Packet*), bool (*write)(WideWriteStream&, Packet*), Packet* packet)
 {
-    r_serialize_int(stream, &packet->packet_type, 0, 3);
-    r_serialize_int(stream, &packet->client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
+    const int numBytes = PacketDatagramSize(MeasureBits(measure, packet));
+    assert(numBytes <= HEADER_SIZE + MaxFragmentSize);
+
+    uint8_t* slot = SendQueueReserve(queue, address, numBytes);
+    if (!slot)
+        return false;
+
+    SendQueueCommit(queue, WriteWidePacketDatagram(slot, numBytes, measure, write, packet));
 
-    serialize_uint64(stream, &packet->client_salt);
-    serialize_uint64(stream, &packet->challenge_salt);
     return true;
 }
 
+// bits in a control packet. none has a variable length field, so this is also the most a packet of the type takes
+template <typename Packet>
+int ControlPacketBits(bool (*measure)(MeasureStream&, Packet*))
+{
+    Packet packet = Packet();
+    return MeasureBits(measure, &packet);
+}
 
+int WriteConnectionRequestDatagram(uint8_t* datagram, int capacity, uint64_t clientSalt)
+{
+    ConnectionRequestPacket packet;
+    packet.packet_type = 3;
+    packet.client_server_type = 0;
+    packet.client_salt = clientSalt;
+    memset(packet.data, 0, sizeof(packet.data));
 
+    return WriteWidePacketDatagram(datagram, capacity, SerializeConnectionRequestPacket<MeasureStream>, SerializeConnectionRequestPacket<WideWriteStream>, &packet);
+}
 
+int WriteConnectionResponseDatagram(uint8_t* datagram, int capacity, uint64_t clientSalt, uint64_t challengeSalt)
+{
+    ConnectionResponsePacket packet;
+    packet.packet_type = 3;
+    packet.client_server_type = 3;
+    packet.client_salt = clientSalt;
+    packet.challenge_salt = challengeSalt;
 
+    return WriteWidePacketDatagram(datagram, capacity, SerializeConnectionResponsePacket<MeasureStream>, SerializeConnectionResponsePacket<WideWriteStream>, &packet);
+}
 
+int WriteConnectionKeepAliveDatagram(uint8_t* datagram, int capacity, uint64_t clientSalt, uint64_t challengeSalt)
+{
+    ConnectionKeepAlivePacket packet;
+    packet.packet_type = 3;
+    packet.client_server_type = 4;
+    packet.client_salt = clientSalt;
+    packet.challenge_salt = challengeSalt;
 
+    return WriteWidePacketDatagram(datagram, capacity, SerializeConnectionKeepAlivePacket<MeasureStream>, SerializeConnectionKeepAlivePacket<WideWriteStream>, &packet);
+}
+
+int WriteConnectionDisconnectDatagram(uint8_t* datagram, int capacity, uint64_t clientSalt, uint64_t challengeSalt)
+{
+    ConnectionDisconnectPacket packet;
+    packet.packet_type = 3;
+    packet.client_server_type = 5;
+    packet.client_salt = clientSalt;
+    packet.challenge_salt = challengeSalt;
+
+    return WriteWidePacketDatagram(datagram, capacity, SerializeConnectionDisconnectPacket<MeasureStream>, SerializeConnectionDisconnectPacket<WideWriteStream>, &packet);
+}
+
+int WriteConnectionDeniedDatagram(uint8_t* datagram, int capacity, uint64_t clientSalt, ConnectionDeniedReason reason)
+{
+    ConnectionDeniedPacket packet;
+    packet.packet_type = 3;
+    packet.client_server_type = 1;
+    packet.client_salt = clientSalt;
+    packet.reason = reason;
+
+    return WriteWidePacketDatagram(datagram, capacity, SerializeConnectionDeniedPacket<MeasureStream>, SerializeConnectionDeniedPacket<WideWriteStream>, &packet);
+}
+
+// where the client salt starts in a connection denied packet: after packet_type and client_server_type
+int ConnectionDeniedSaltBit()
+{
+    return bits_required(0, 3) + bits_required(0, CLIENT_SERVER_NUM_PACKETS);
+}
+
+/*
+    OR value into bits [bitOffset, bitOffset + bits) of serialized packet data, where they are zero. The bit packer
+    stores words little endian on the wire on every host, so stream bit n is bit n % 8 of byte n / 8.
+*/
+void OrPacketBits(uint8_t* data, int bitOffset, uint64_t value, int bits)
+{
+    assert(bits > 0 && bits <= 64);
+
+    int i = 0;
+    while (i < bits) {
+        const int bit = bitOffset + i;
+        const int shift = bit & 7;
+        const int count = (8 - shift) < (bits - i) ? (8 - shift) : (bits - i);
+
+        data[bit >> 3] |= (uint8_t)(((value >> i) & ((1u << count) - 1)) << shift);
+        i += count;
+    }
+}
 
 typedef struct {
     uint64_t client_salt; // random number generated by client and sent to server in connection request
     uint64_t challenge_salt; // random number generated by server and sent back to client in challenge packet
-    double create_time; // time this challenge entry was created. used for challenge timeout
     double last_packet_send_time; // the last time we sent a challenge packet to this client
     Address address; // address the connection request came from
+    AddressKey address_key; // binary key for address. compared on lookup so the port counts too
 } ServerChallengeEntry;
 
+/*
+    Challenge hash.
+
+    Pending challenges, keyed by CalculateAddressHashKey of the address and client salt. Open addressing with
+    linear probing, and an entry never sits more than ChallengeMaxProbe slots from its home slot, so a lookup
+    reads at most that many slots.
+
+    What a probe reads (the key and create time) is kept in its own array of 16 byte slots, four to a cache
+    line. The rest of the entry lives in a parallel array and is only read once the key matches.
+
+    Entries are not deleted, they expire ChallengeTimeOut after they were created. A lookup or insert that
+    walks over an expired entry removes it by shifting the rest of the probe run back, the same as the
+    connected client index does, so there are no tombstones and runs stay short. If the table still fills to
+    ChallengeMaxLoad, one pass over it removes every expired entry before an insert is refused. The pass is
+    skipped while nothing can have expired since the last one, so a flood of requests against a full table
+    stays cheap.
+*/
+typedef struct ServerChallengeSlot {
+    uint64_t key; // hash key of the entry. 0 when the slot is empty
+    double create_time; // time the challenge was created. used for challenge timeout
+} ServerChallengeSlot;
+
+typedef struct ServerChallengeStats {
+    uint64_t numLookups; // finds and inserts
+    uint64_t numProbes; // slots read across all lookups
+    uint64_t numInserts; // new entries
+    uint64_t numInsertsFailed; // inserts refused because the table was at ChallengeMaxLoad or no slot was free within ChallengeMaxProbe
+    uint64_t numExpired; // expired entries removed
+    uint64_t numSweeps; // full passes to remove expired entries when the table reached ChallengeMaxLoad
+    int maxProbe; // most slots read by a single lookup
+} ServerChallengeStats;
+
 typedef struct ServerChallengeHash {
-    int num_entries;
-    uint8_t exists[ChallengeHashSize];
-    ServerChallengeEntry entries[ChallengeHashSize];
+    int num_entries; // occupied slots, including expired entries nothing has walked over yet
+    int size; // number of slots. power of two
+    ServerChallengeSlot* slots; // probed on every lookup
+    ServerChallengeEntry* entries; // entry n belongs to slot n
+    double next_expire_time; // no entry expires before this, so a sweep before then would find nothing
+    ServerChallengeStats stats;
 } ServerChallengeHash;
 
-uint64_t CalculateChallengeHashKey(Address address, uint64_t clientSalt, uint64_t serverSeed)
+// keyed hash of the binary address and the client salt. the server salt is the key, so the bucket a client lands
+// in cannot be predicted from outside. used by the challenge table and the connected client index
+uint64_t CalculateAddressHashKey(const AddressKey* addressKey, uint64_t clientSalt, uint64_t serverSeed)
 {
-    char buffer[256];
-    const char* addressString = AddressToString(address, buffer, sizeof(buffer));
-    const int addressLength = (int)strlen(addressString);
-    return murmur_hash_64(&serverSeed, 8, murmur_hash_64(&clientSalt, 8, murmur_hash_64(addressString, addressLength, 0)));
+    const uint64_t words[4] = { addressKey->m_words[0], addressKey->m_words[1], addressKey->m_words[2], clientSalt };
+    return hash_words_64(words, 4, serverSeed);
 }
 
 typedef struct ServerClientData {
@@ -241,6 +442,8 @@ typedef struct ServerClientData {
     double connectTime;
     double lastPacketSendTime;
     double lastPacketReceiveTime;
+    ControlPacketImage keepAliveImage; // keep-alive to this client. built at connect
+    ControlPacketImage disconnectImage; // disconnect to this client. built at connect
 } ServerClientData;
 
 ServerClientData SetServerClientData()
@@ -256,55 +459,194 @@ ServerClientData SetServerClientData()
     return server_client_data;
 }
 
+/*
+    Connected client index.
+
+    Maps (address, port, client salt) to a client index so per-packet lookups do not scan every client slot.
+    Open addressing with linear probing. Removal shifts the following entries back instead of leaving
+    tombstones, so probe lengths stay short however often clients come and go. The table is never more than
+    half full.
+
+    Free client indices are kept on a stack so finding one is O(1).
+*/
+typedef struct ServerClientIndex {
+    int hashSize; // number of buckets. power of two, at least twice the client capacity
+    int* bucketClient; // client index stored in each bucket. -1 when the bucket is empty
+    uint32_t* bucketHash; // low bits of the hash key of the client in each bucket
+
+    int numFree; // number of client indices on the free stack
+    int* freeStack; // free client indices. the top is handed out next
+    int* freePosition; // position of client index n in freeStack, or -1 when it is in use
+} ServerClientIndex;
+
+/*
+    Per-client timers.
+
+    Each client has a keep-alive timer and a timeout timer on the server's timer wheel, numbered
+    clientIndex * SERVER_CLIENT_NUM_TIMERS + kind. They are armed on connect and cancelled on disconnect.
+
+    Packets sent and received only update lastPacketSendTime and lastPacketReceiveTime. When a timer fires it
+    checks them and, if there was activity since it was armed, re-arms itself for the new deadline instead of
+    acting. That keeps the wheel off the per-packet path, and each client costs at most a timer or two per
+    keep-alive interval.
+*/
+typedef enum ServerClientTimer {
+    SERVER_CLIENT_TIMER_KEEP_ALIVE, // send a keep-alive if nothing else went to the client for ConnectionKeepAliveSendRate
+    SERVER_CLIENT_TIMER_TIME_OUT,   // disconnect the client if nothing came from it for KeepAliveTimeOut
+    SERVER_CLIENT_NUM_TIMERS
+} ServerClientTimer;
+
 typedef struct Server {
     Socket* m_socket; // socket for sending and receiving packets.
 
     uint64_t m_serverSalt; // server salt. randomizes hash keys to eliminate challenge/response hash worst case attack.
 
+    int m_maxClients; // client capacity. set by CreateServer, every per-client array below has this many entries
+
     int m_numConnectedClients; // number of connected clients
 
-    bool m_clientConnected[MaxClients]; // true if client n is connected
+    bool* m_clientConnected; // true if client n is connected
+
+    uint64_t* m_clientSalt; // array of client salt values per-client
+
+    uint64_t* m_challengeSalt; // array of challenge salt values per-client
+
+    Address* m_clientAddress; // array of client address values per-client
+
+    ServerClientData* m_clientData; // heavier weight data per-client, eg. not for fast lookup
 
-    uint64_t m_clientSalt[MaxClients]; // array of client salt values per-client
+    AddressKey* m_clientAddressKey; // binary key for m_clientAddress. what the client index compares
 
-    uint64_t m_challengeSalt[MaxClients]; // array of challenge salt values per-client
+    ServerClientIndex m_clientIndex; // lookup from address and client salt to connected client
 
-    Address m_clientAddress[MaxClients]; // array of client address values per-client
+    TimerWheel m_timers; // keep-alive and timeout timers for connected clients
 
-    ServerClientData m_clientData[MaxClients]; // heavier weight data per-client, eg. not for fast lookup
+    RateLimiter m_rateLimiter; // per-source budgets, checked before a datagram is parsed
+
+    ControlPacketImage m_deniedImage[CONNECTION_DENIED_NUM_VALUES]; // connection denied for each reason, client salt zero
+
+    int m_deniedSaltBit; // where the client salt goes in m_deniedImage packet data
 
     ServerChallengeHash m_challengeHash;
+
+    SendQueue m_sendQueue; // outgoing datagrams for this tick. flushed at the end of the server loop
+
+    PacketBuffer m_packetBuffer; // reassembly buffer for fragmented packets received by this server
+
+    uint64_t m_saltState; // state for ServerGenerateSalt. per-server so shards never share the global rand() state
+
+    uint64_t m_challengeSecret[2][2]; // SipHash keys for challenge tokens. [0] signs new tokens, [1] is the one it replaced
+
+    double m_challengeSecretTime; // time m_challengeSecret[0] was made
 } Server;
 
 
-bool CreateServer(Server* server, Socket* socket);
+uint64_t ServerGenerateSalt(Server* server);
+bool CreateServer(Server* server, Socket* socket, int maxClients);
 bool CleanServer(Server* server);
 void ServerSendPacketsAll(Server* server, double time);
-void ServerReceivePackets(Server* server, double time);
+bool ServerReceivePackets(Server* server, double time, Address address, const uint8_t* packetData, int packetBytes, int client_packet_type);
 void ServerCheckForTimeOut(Server* server, double time);
+void ServerTimerFired(void* context, int timer, double time);
 void ServerResetClientState(Server* server, int clientIndex);
 int ServerFindFreeClientIndex(Server* server);
+void ServerClientIndexReset(Server* server);
+int ServerClientIndexFind(Server* server, const AddressKey* addressKey, uint64_t clientSalt);
 int ServerFindExistingClientIndex(Server* server, Address address, uint64_t clientSalt, uint64_t challengeSalt);
 void ServerConnectClient(Server* server, int clientIndex, Address address, uint64_t clientSalt, uint64_t challengeSalt, double time);
 void ServerDisconnectClient(Server* server, int clientIndex, double time);
 bool ServerClientIsConnected(Server* server, Address address, uint64_t clientSalt);
+void ServerChallengeHashRemove(ServerChallengeHash* hash, int slot);
+int ServerChallengeHashLookup(Server* server, uint64_t key, const AddressKey* addressKey, uint64_t clientSalt, double time, int* emptySlot);
+int ServerChallengeHashExpire(Server* server, double time);
+uint64_t ServerChallengeKey(Server* server, const AddressKey* addressKey, uint64_t clientSalt);
 ServerChallengeEntry* ServerFindChallenge(Server* server, Address address, uint64_t clientSalt, double time);
 ServerChallengeEntry* ServerFindOrInsertChallenge(Server* server, Address address, uint64_t clientSalt, double time);
+void ServerGenerateSecret(uint64_t secret[2]);
+void ServerRotateChallengeSecret(Server* server, double time);
+uint64_t ServerChallengeToken(const uint64_t secret[2], const AddressKey* addressKey, uint64_t clientSalt, uint64_t timestamp);
+uint64_t ServerGenerateChallengeToken(Server* server, Address address, uint64_t clientSalt, double time);
+bool ServerVerifyChallengeToken(Server* server, Address address, uint64_t clientSalt, uint64_t token, double time);
 
 void ServerSendPacketToConnectedClient(Server* server, int clientIndex, void* packet, int packetSize, double time);
+bool ServerBeginPacketToConnectedClient(Server* server, int clientIndex, int numBits, Stream* stream, double time);
+bool ServerSendImageToConnectedClient(Server* server, int clientIndex, const ControlPacketImage* image, double time);
+bool ServerSendConnectionDenied(Server* server, Address address, uint64_t clientSalt, ConnectionDeniedReason reason);
 
 void ServerProcessConnectionRequest(Server* server, const ConnectionRequestPacket* packet, Address address, double time);
 void ServerProcessConnectionResponse(Server* server, const ConnectionResponsePacket* packet, Address address, double time);
 void ServerProcessConnectionKeepAlive(Server* server, const ConnectionKeepAlivePacket* packet, Address address, double time);
 void ServerProcessConnectionDisconnect(Server* server, const ConnectionDisconnectPacket* packet, Address address, double time);
 
-bool CreateServer(Server* server, Socket* socket)
+// splitmix64 over the server's own state. only used for salts, not for anything that has to be unpredictable
+uint64_t ServerGenerateSalt(Server* server)
+{
+    uint64_t z = (server->m_saltState += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+    Set up a server for maxClients clients. All per-client storage and the client index are allocated here,
+    once, and nothing on the packet path allocates afterwards. Returns false if the allocation fails.
+*/
+bool CreateServer(Server* server, Socket* socket, int maxClients)
 {
+    assert(maxClients > 0);
+
     server->m_socket = socket;
+    server->m_maxClients = maxClients;
+
+    server->m_clientConnected = (bool*)calloc(maxClients, sizeof(bool));
+    server->m_clientSalt = (uint64_t*)calloc(maxClients, sizeof(uint64_t));
+    server->m_challengeSalt = (uint64_t*)calloc(maxClients, sizeof(uint64_t));
+    server->m_clientAddress = (Address*)calloc(maxClients, sizeof(Address));
+    server->m_clientData = (ServerClientData*)calloc(maxClients, sizeof(ServerClientData));
+    server->m_clientAddressKey = (AddressKey*)calloc(maxClients, sizeof(AddressKey));
+
+    ServerClientIndex* index = &server->m_clientIndex;
+    index->hashSize = 1;
+    while (index->hashSize < maxClients * 2)
+        index->hashSize *= 2;
+    index->bucketClient = (int*)calloc(index->hashSize, sizeof(int));
+    index->bucketHash = (uint32_t*)calloc(index->hashSize, sizeof(uint32_t));
+    index->freeStack = (int*)calloc(maxClients, sizeof(int));
+    index->freePosition = (int*)calloc(maxClients, sizeof(int));
+
+    ServerChallengeHash* challengeHash = &server->m_challengeHash;
+    memset(challengeHash, 0, sizeof(ServerChallengeHash));
+    challengeHash->size = ChallengeHashSize;
+    while (challengeHash->size < maxClients * 2)
+        challengeHash->size *= 2;
+    challengeHash->slots = (ServerChallengeSlot*)calloc(challengeHash->size, sizeof(ServerChallengeSlot));
+    challengeHash->entries = (ServerChallengeEntry*)calloc(challengeHash->size, sizeof(ServerChallengeEntry));
+
+    const bool timersCreated = r_timer_wheel_create(&server->m_timers, maxClients * SERVER_CLIENT_NUM_TIMERS, ServerTimerResolution, ServerTimerFired, server);
+    const bool rateLimiterCreated = r_rate_limiter_create(&server->m_rateLimiter, maxClients * 4, GenerateSalt());
+
+    if (!server->m_clientConnected || !server->m_clientSalt || !server->m_challengeSalt || !server->m_clientAddress || !server->m_clientData || !server->m_clientAddressKey
+        || !index->bucketClient || !index->bucketHash || !index->freeStack || !index->freePosition
+        || !challengeHash->slots || !challengeHash->entries || !timersCreated || !rateLimiterCreated) {
+        printf("failed to allocate server for %d clients\n", maxClients);
+        CleanServer(server);
+        return false;
+    }
+
+    SendQueueInit(&server->m_sendQueue, socket);
+    memset(&server->m_packetBuffer, 0, sizeof(PacketBuffer));
     server->m_serverSalt = GenerateSalt();
+    server->m_saltState = GenerateSalt();
+    ServerGenerateSecret(server->m_challengeSecret[0]);
+    ServerGenerateSecret(server->m_challengeSecret[1]);
+    server->m_challengeSecretTime = 0.0;
+    for (int i = 0; i < CONNECTION_DENIED_NUM_VALUES; ++i)
+        server->m_deniedImage[i].size = WriteConnectionDeniedDatagram(server->m_deniedImage[i].data, ControlPacketImageSize, 0, (ConnectionDeniedReason)i);
+    server->m_deniedSaltBit = ConnectionDeniedSaltBit();
     server->m_numConnectedClients = 0;
-    for (int i = 0; i < MaxClients; ++i)
+    for (int i = 0; i < maxClients; ++i)
         ServerResetClientState(server, i);
+    ServerClientIndexReset(server);
 
     return true;
 }
@@ -314,46 +656,52 @@ bool CleanServer(Server* server)
     assert(server->m_socket);
     server->m_socket = NULL;
 
+    free(server->m_clientConnected);
+    free(server->m_clientSalt);
+    free(server->m_challengeSalt);
+    free(server->m_clientAddress);
+    free(server->m_clientData);
+    free(server->m_clientAddressKey);
+    free(server->m_clientIndex.bucketClient);
+    free(server->m_clientIndex.bucketHash);
+    free(server->m_clientIndex.freeStack);
+    free(server->m_clientIndex.freePosition);
+    free(server->m_challengeHash.slots);
+    free(server->m_challengeHash.entries);
+    r_timer_wheel_destroy(&server->m_timers);
+    r_rate_limiter_destroy(&server->m_rateLimiter);
+
+    server->m_clientConnected = NULL;
+    server->m_clientSalt = NULL;
+    server->m_challengeSalt = NULL;
+    server->m_clientAddress = NULL;
+    server->m_clientData = NULL;
+    server->m_clientAddressKey = NULL;
+    memset(&server->m_clientIndex, 0, sizeof(ServerClientIndex));
+    memset(&server->m_challengeHash, 0, sizeof(ServerChallengeHash));
+    server->m_maxClients = 0;
+
     return true;
 }
 
+// keep-alives go out from the client timers. the server loop calls this and ServerCheckForTimeOut every tick
 void ServerSendPacketsAll(Server* server, double time)
 {
-    for (int i = 0; i < MaxClients; ++i) {
-        if (!server->m_clientConnected[i])
-            continue;
-         
-        if (server->m_clientData[i].lastPacketSendTime + ConnectionKeepAliveSendRate > time)
-            return;
-
-        ConnectionKeepAlivePacket connectionKeepAlivePacket;
-        connectionKeepAlivePacket.packet_type = 3;
-        connectionKeepAlivePacket.client_server_type = 4;
-
-        connectionKeepAlivePacket.client_salt = server->m_clientSalt[i];
-        connectionKeepAlivePacket.challenge_salt = server->m_challengeSalt[i];
-
-        uint8_t packet_buffer[1024];
-
-        Stream writeStream;
-        r_stream_write_init(&writeStream, packet_buffer, 1024);
-
-        SerializeConnectionKeepAlivePacket(&writeStream, &connectionKeepAlivePacket);
-
-        FlushBits(&writeStream);
-
-        size_t bytesProcessed = GetBytesProcessed(&writeStream);
-
-        ServerSendPacketToConnectedClient(server, i, packet_buffer, bytesProcessed, time);
-    }
+    r_timer_wheel_advance(&server->m_timers, time);
 }
 
-
-bool ServerReceivePackets(Server* server, double time, Address address, Stream* stream, int client_packet_type)
+/*
+    Deserialize and process one client/server packet. packetData is the datagram after its crc32, and each packet's
+    serialize function reads it from the start, packet_type and client_server_type included.
+*/
+bool ServerReceivePackets(Server* server, double time, Address address, const uint8_t* packetData, int packetBytes, int client_packet_type)
 {
     printf("Server recieved packet type ");
     printPackType((PacketTypes)client_packet_type);
 
+    // every control packet has a fixed size, so each case checks once that the data holds it and reads unchecked
+    WideReadStream reader(packetData, packetBytes);
+
     switch (client_packet_type) {
 
     case PACKET_CONNECTION_REQUEST: {
@@ -361,25 +709,25 @@ bool ServerReceivePackets(Server* server, double time, Address address, Stream*
         printf("PACKET_CONNECTION_REQUEST\n");
 
         ConnectionRequestPacket packet;
-        serialize_uint64(stream, &packet.client_salt);
-        // serialize_bytes(stream, packet.data, 256);
+        if (!reader.HasBits(ControlPacketBits(SerializeConnectionRequestPacket<MeasureStream>)) || !SerializeConnectionRequestPacket(reader, &packet))
+            return false;
 
         ServerProcessConnectionRequest(server, &packet, address, time);
         
     } break;
 
     case PACKET_CONNECTION_RESPONSE: {
-        ConnectionResponsePacket ConnectionResponsePacket;
-        serialize_uint64(stream, &ConnectionResponsePacket.client_salt);
-        serialize_uint64(stream, &ConnectionResponsePacket.challenge_salt);
+        ConnectionResponsePacket connectionResponsePacket;
+        if (!reader.HasBits(ControlPacketBits(SerializeConnectionResponsePacket<MeasureStream>)) || !SerializeConnectionResponsePacket(reader, &connectionResponsePacket))
+            return false;
 
-        ServerProcessConnectionResponse(server, &ConnectionResponsePacket, address, time);
+        ServerProcessConnectionResponse(server, &connectionResponsePacket, address, time);
     }  break;
 
     case PACKET_CONNECTION_KEEP_ALIVE: {
         ConnectionKeepAlivePacket connectionKeepAlivePacket;
-        serialize_uint64(stream, &connectionKeepAlivePacket.client_salt);
-        serialize_uint64(stream, &connectionKeepAlivePacket.challenge_salt);
+        if (!reader.HasBits(ControlPacketBits(SerializeConnectionKeepAlivePacket<MeasureStream>)) || !SerializeConnectionKeepAlivePacket(reader, &connectionKeepAlivePacket))
+            return false;
 
         ServerProcessConnectionKeepAlive(server, &connectionKeepAlivePacket, address, time);
     }
@@ -387,8 +735,8 @@ bool ServerReceivePackets(Server* server, double time, Address address, Stream*
 
     case PACKET_CONNECTION_DISCONNECT: {
         ConnectionDisconnectPacket connectionDisconnectPacket;
-        serialize_uint64(stream, &connectionDisconnectPacket.client_salt);
-        serialize_uint64(stream, &connectionDisconnectPacket.challenge_salt);
+        if (!reader.HasBits(ControlPacketBits(SerializeConnectionDisconnectPacket<MeasureStream>)) || !SerializeConnectionDisconnectPacket(reader, &connectionDisconnectPacket))
+            return false;
 
         ServerProcessConnectionDisconnect(server, &connectionDisconnectPacket, address, time);
     }
@@ -401,54 +749,176 @@ bool ServerReceivePackets(Server* server, double time, Address address, Stream*
     return true;
 }
 
+// a second advance in the same tick finds nothing left to do
 void ServerCheckForTimeOut(Server* server, double time)
 {
-    for (int i = 0; i < MaxClients; ++i) {
-        if (!server->m_clientConnected[i])
-            continue;
+    r_timer_wheel_advance(&server->m_timers, time);
+}
+
+void ServerTimerFired(void* context, int timer, double time)
+{
+    Server* server = (Server*)context;
+
+    const int clientIndex = timer / SERVER_CLIENT_NUM_TIMERS;
+    const ServerClientData* clientData = &server->m_clientData[clientIndex];
+
+    assert(server->m_clientConnected[clientIndex]);
+
+    if (timer % SERVER_CLIENT_NUM_TIMERS == SERVER_CLIENT_TIMER_KEEP_ALIVE) {
+
+        // something else went out since this was armed
+        if (clientData->lastPacketSendTime + ConnectionKeepAliveSendRate > time) {
+            r_timer_wheel_schedule(&server->m_timers, timer, clientData->lastPacketSendTime + ConnectionKeepAliveSendRate);
+            return;
+        }
+
+        ServerSendImageToConnectedClient(server, clientIndex, &clientData->keepAliveImage, time);
+
+        r_timer_wheel_schedule(&server->m_timers, timer, time + ConnectionKeepAliveSendRate);
+
+    } else {
 
-        if (server->m_clientData[i].lastPacketReceiveTime + KeepAliveTimeOut < time) {
-            char buffer[256];
-            const char* addressString = AddressToString(server->m_clientAddress[i], buffer, sizeof(buffer));
-            printf("client %d timed out (client address = %s, client salt = %" PRIx64 ", challenge salt = %" PRIx64 ")\n", i, addressString, server->m_clientSalt[i], server->m_challengeSalt[i]);
-            ServerDisconnectClient(server, i, time);
+        // heard from the client since this was armed
+        if (clientData->lastPacketReceiveTime + KeepAliveTimeOut >= time) {
+            r_timer_wheel_schedule(&server->m_timers, timer, clientData->lastPacketReceiveTime + KeepAliveTimeOut);
+            return;
         }
+
+        char buffer[256];
+        const char* addressString = AddressToString(server->m_clientAddress[clientIndex], buffer, sizeof(buffer));
+        printf("client %d timed out (client address = %s, client salt = %" PRIx64 ", challenge salt = %" PRIx64 ")\n", clientIndex, addressString, server->m_clientSalt[clientIndex], server->m_challengeSalt[clientIndex]);
+        ServerDisconnectClient(server, clientIndex, time);
     }
 }
 
 void ServerResetClientState(Server* server, int clientIndex)
 {
     assert(clientIndex >= 0);
-    assert(clientIndex < MaxClients);
+    assert(clientIndex < server->m_maxClients);
     server->m_clientConnected[clientIndex] = false;
     server->m_clientSalt[clientIndex] = 0;
     server->m_challengeSalt[clientIndex] = 0;
     server->m_clientAddress[clientIndex] = address_set();
+    memset(&server->m_clientAddressKey[clientIndex], 0, sizeof(AddressKey));
     server->m_clientData[clientIndex] = SetServerClientData();
 }
 
-int ServerFindFreeClientIndex(Server* server)
+void ServerClientIndexReset(Server* server)
 {
-    for (int i = 0; i < MaxClients; ++i) {
-        if (!server->m_clientConnected[i])
-            return i;
+    ServerClientIndex* index = &server->m_clientIndex;
+
+    for (int i = 0; i < index->hashSize; ++i)
+        index->bucketClient[i] = -1;
+
+    // pushed in reverse so client 0 is handed out first
+    index->numFree = 0;
+    for (int i = server->m_maxClients - 1; i >= 0; --i) {
+        index->freePosition[i] = index->numFree;
+        index->freeStack[index->numFree++] = i;
     }
-    return -1;
 }
 
-int ServerFindExistingClientIndex(Server* server, Address address, uint64_t clientSalt, uint64_t challengeSalt)
+int ServerClientIndexFind(Server* server, const AddressKey* addressKey, uint64_t clientSalt)
 {
-    for (int i = 0; i < MaxClients; ++i) {
-        if (server->m_clientConnected[i] && server->m_clientAddress[i].m_address_ipv4 == address.m_address_ipv4 && server->m_clientSalt[i] == clientSalt && server->m_challengeSalt[i] == challengeSalt)
-            return i;
+    const ServerClientIndex* index = &server->m_clientIndex;
+    const int mask = index->hashSize - 1;
+
+    const uint64_t key = CalculateAddressHashKey(addressKey, clientSalt, server->m_serverSalt);
+
+    for (int bucket = (int)(key & mask);; bucket = (bucket + 1) & mask) {
+        const int clientIndex = index->bucketClient[bucket];
+        if (clientIndex == -1)
+            return -1;
+
+        if (index->bucketHash[bucket] == (uint32_t)key && server->m_clientSalt[clientIndex] == clientSalt && AddressKeyEquals(&server->m_clientAddressKey[clientIndex], addressKey))
+            return clientIndex;
     }
-    return -1;
+}
+
+void ServerClientIndexInsert(Server* server, int clientIndex)
+{
+    ServerClientIndex* index = &server->m_clientIndex;
+    const int mask = index->hashSize - 1;
+
+    assert(index->freePosition[clientIndex] != -1);
+
+    // take clientIndex off the free stack by moving the top into its place
+    const int position = index->freePosition[clientIndex];
+    const int top = index->freeStack[--index->numFree];
+    index->freeStack[position] = top;
+    index->freePosition[top] = position;
+    index->freePosition[clientIndex] = -1;
+
+    const uint64_t key = CalculateAddressHashKey(&server->m_clientAddressKey[clientIndex], server->m_clientSalt[clientIndex], server->m_serverSalt);
+
+    int bucket = (int)(key & mask);
+    while (index->bucketClient[bucket] != -1)
+        bucket = (bucket + 1) & mask;
+
+    index->bucketClient[bucket] = clientIndex;
+    index->bucketHash[bucket] = (uint32_t)key;
+}
+
+void ServerClientIndexRemove(Server* server, int clientIndex)
+{
+    ServerClientIndex* index = &server->m_clientIndex;
+    const int mask = index->hashSize - 1;
+
+    const uint64_t key = CalculateAddressHashKey(&server->m_clientAddressKey[clientIndex], server->m_clientSalt[clientIndex], server->m_serverSalt);
+
+    int bucket = (int)(key & mask);
+    while (index->bucketClient[bucket] != clientIndex) {
+        assert(index->bucketClient[bucket] != -1);
+        bucket = (bucket + 1) & mask;
+    }
+
+    // backward shift: pull later entries of the probe run into the hole unless that would move them before their home bucket
+    int hole = bucket;
+    for (int next = (hole + 1) & mask; index->bucketClient[next] != -1; next = (next + 1) & mask) {
+        const int home = (int)(index->bucketHash[next] & mask); // the stored low bits are enough to find the home bucket
+
+        // distance from home to next and from home to the hole, both walking forward around the table
+        const int nextDistance = (next - home) & mask;
+        const int holeDistance = (hole - home) & mask;
+
+        if (holeDistance <= nextDistance) {
+            index->bucketClient[hole] = index->bucketClient[next];
+            index->bucketHash[hole] = index->bucketHash[next];
+            hole = next;
+        }
+    }
+
+    index->bucketClient[hole] = -1;
+
+    index->freePosition[clientIndex] = index->numFree;
+    index->freeStack[index->numFree++] = clientIndex;
+}
+
+int ServerFindFreeClientIndex(Server* server)
+{
+    const ServerClientIndex* index = &server->m_clientIndex;
+
+    if (index->numFree == 0)
+        return -1;
+
+    return index->freeStack[index->numFree - 1];
+}
+
+int ServerFindExistingClientIndex(Server* server, Address address, uint64_t clientSalt, uint64_t challengeSalt)
+{
+    const AddressKey addressKey = AddressKeyFromAddress(address);
+
+    const int clientIndex = ServerClientIndexFind(server, &addressKey, clientSalt);
+    if (clientIndex == -1 || server->m_challengeSalt[clientIndex] != challengeSalt)
+        return -1;
+
+    return clientIndex;
 }
 
 void ServerConnectClient(Server* server, int clientIndex, Address address, uint64_t clientSalt, uint64_t challengeSalt, double time)
 {
     assert(server->m_numConnectedClients >= 0);
-    assert(server->m_numConnectedClients < MaxClients - 1);
+    assert(server->m_numConnectedClients < server->m_maxClients);
     assert(!server->m_clientConnected[clientIndex]);
 
     server->m_numConnectedClients++;
@@ -457,6 +927,9 @@ void ServerConnectClient(Server* server, int clientIndex, Address address, uint6
     server->m_clientSalt[clientIndex] = clientSalt;
     server->m_challengeSalt[clientIndex] = challengeSalt;
     server->m_clientAddress[clientIndex] = address;
+    server->m_clientAddressKey[clientIndex] = AddressKeyFromAddress(address);
+
+    ServerClientIndexInsert(server, clientIndex);
 
     server->m_clientData[clientIndex].address = address;
     server->m_clientData[clientIndex].clientSalt = clientSalt;
@@ -465,35 +938,26 @@ void ServerConnectClient(Server* server, int clientIndex, Address address, uint6
     server->m_clientData[clientIndex].lastPacketSendTime = time;
     server->m_clientData[clientIndex].lastPacketReceiveTime = time;
 
-    char buffer[256];
-    const char* addressString = AddressToString(address, buffer, sizeof(buffer));
-    printf("client %d connected (client address = %s, client salt = %" PRIx64 ", challenge salt = %" PRIx64 ")\n", clientIndex, addressString, clientSalt, challengeSalt);
-
-    ConnectionKeepAlivePacket connectionKeepAlivePacket;
-    connectionKeepAlivePacket.packet_type = 3;
-    connectionKeepAlivePacket.client_server_type = 4;
-
-    connectionKeepAlivePacket.client_salt = server->m_clientSalt[clientIndex];
-    connectionKeepAlivePacket.challenge_salt = server->m_challengeSalt[clientIndex];
+    ServerClientData* clientData = &server->m_clientData[clientIndex];
+    clientData->keepAliveImage.size = WriteConnectionKeepAliveDatagram(clientData->keepAliveImage.data, ControlPacketImageSize, clientSalt, challengeSalt);
+    clientData->disconnectImage.size = WriteConnectionDisconnectDatagram(clientData->disconnectImage.data, ControlPacketImageSize, clientSalt, challengeSalt);
 
-    uint8_t packet_buffer[1024];
+    r_timer_wheel_schedule(&server->m_timers, clientIndex * SERVER_CLIENT_NUM_TIMERS + SERVER_CLIENT_TIMER_KEEP_ALIVE, time + ConnectionKeepAliveSendRate);
+    r_timer_wheel_schedule(&server->m_timers, clientIndex * SERVER_CLIENT_NUM_TIMERS + SERVER_CLIENT_TIMER_TIME_OUT, time + KeepAliveTimeOut);
 
-    Stream writeStream;
-    r_stream_write_init(&writeStream, packet_buffer, 1024);
+    r_rate_limiter_connect(&server->m_rateLimiter, address, time);
 
-    SerializeConnectionKeepAlivePacket(&writeStream, &connectionKeepAlivePacket);
-
-    FlushBits(&writeStream);
-
-    size_t bytesProcessed = GetBytesProcessed(&writeStream);
+    char buffer[256];
+    const char* addressString = AddressToString(address, buffer, sizeof(buffer));
+    printf("client %d connected (client address = %s, client salt = %" PRIx64 ", challenge salt = %" PRIx64 ")\n", clientIndex, addressString, clientSalt, challengeSalt);
 
-    ServerSendPacketToConnectedClient(server, clientIndex, packet_buffer, bytesProcessed, time);
+    ServerSendImageToConnectedClient(server, clientIndex, &clientData->keepAliveImage, time);
 }
 
 void ServerDisconnectClient(Server* server, int clientIndex, double time)
 {
     assert(clientIndex >= 0);
-    assert(clientIndex < MaxClients);
+    assert(clientIndex < server->m_maxClients);
     assert(server->m_numConnectedClients > 0);
     assert(server->m_clientConnected[clientIndex]);
 
@@ -501,25 +965,14 @@ void ServerDisconnectClient(Server* server, int clientIndex, double time)
     const char* addressString = AddressToString(server->m_clientAddress[clientIndex], buffer, sizeof(buffer));
     printf("client %d disconnected: (client address = %s, client salt = %" PRIx64 ", challenge salt = %" PRIx64 ")\n", clientIndex, addressString, server->m_clientSalt[clientIndex], server->m_challengeSalt[clientIndex]);
 
-    ConnectionDisconnectPacket connectionDisconnectPacket;
-    connectionDisconnectPacket.packet_type = 3;
-    connectionDisconnectPacket.client_server_type = 5;
-
-    connectionDisconnectPacket.client_salt = server->m_clientSalt[clientIndex];
-    connectionDisconnectPacket.challenge_salt = server->m_challengeSalt[clientIndex];
-
-    uint8_t packet_buffer[1024];
-
-    Stream writeStream;
-    r_stream_write_init(&writeStream, packet_buffer, 1024);
-
-    SerializeConnectionDisconnectPacket(&writeStream, &connectionDisconnectPacket);
+    ServerSendImageToConnectedClient(server, clientIndex, &server->m_clientData[clientIndex].disconnectImage, time);
 
-    FlushBits(&writeStream);
+    ServerClientIndexRemove(server, clientIndex);
 
-    size_t bytesProcessed = GetBytesProcessed(&writeStream);
+    r_timer_wheel_cancel(&server->m_timers, clientIndex * SERVER_CLIENT_NUM_TIMERS + SERVER_CLIENT_TIMER_KEEP_ALIVE);
+    r_timer_wheel_cancel(&server->m_timers, clientIndex * SERVER_CLIENT_NUM_TIMERS + SERVER_CLIENT_TIMER_TIME_OUT);
 
-    ServerSendPacketToConnectedClient(server, clientIndex, packet_buffer, bytesProcessed, time);
+    r_rate_limiter_disconnect(&server->m_rateLimiter, server->m_clientAddress[clientIndex], time);
 
     ServerResetClientState(server, clientIndex);
 
@@ -528,216 +981,389 @@ void ServerDisconnectClient(Server* server, int clientIndex, double time)
 
 bool ServerClientIsConnected(Server* server, Address address, uint64_t clientSalt)
 {
-    for (int i = 0; i < MaxClients; ++i) {
-        if (!server->m_clientConnected[i])
-            continue;
-        if (server->m_clientAddress[i].m_address_ipv4 == address.m_address_ipv4 && server->m_clientSalt[i] == clientSalt)
-            return true;
-    }
-    return false;
+    const AddressKey addressKey = AddressKeyFromAddress(address);
+    return ServerClientIndexFind(server, &addressKey, clientSalt) != -1;
 }
 
-ServerChallengeEntry* ServerFindChallenge(Server* server, Address address, uint64_t clientSalt, double time)
+// remove the entry in slot, pulling later entries of the probe run back into the hole
+void ServerChallengeHashRemove(ServerChallengeHash* hash, int slot)
 {
-    const uint64_t key = CalculateChallengeHashKey(address, clientSalt, server->m_serverSalt);
+    const int mask = hash->size - 1;
 
-    int index = key % ChallengeHashSize;
-
-    printf("client salt = %" PRIx64 "\n", clientSalt);
-    printf("challenge hash key = %" PRIx64 "\n", key);
-    printf("challenge hash index = %d\n", index);
+    int hole = slot;
+    for (int next = (hole + 1) & mask; hash->slots[next].key != 0; next = (next + 1) & mask) {
+        const int home = (int)(hash->slots[next].key & mask);
 
-    if (server->m_challengeHash.exists[index] && server->m_challengeHash.entries[index].client_salt == clientSalt && server->m_challengeHash.entries[index].address.m_address_ipv4 == address.m_address_ipv4 && server->m_challengeHash.entries[index].create_time + ChallengeTimeOut >= time) {
-        printf("found challenge entry at index %d\n", index);
+        const int nextDistance = (next - home) & mask;
+        const int holeDistance = (hole - home) & mask;
 
-        return &server->m_challengeHash.entries[index];
+        if (holeDistance <= nextDistance) {
+            hash->slots[hole] = hash->slots[next];
+            hash->entries[hole] = hash->entries[next];
+            hole = next;
+        }
     }
 
-    return NULL;
+    hash->slots[hole].key = 0;
+    hash->num_entries--;
 }
 
-ServerChallengeEntry* ServerFindOrInsertChallenge(Server* server, Address address, uint64_t clientSalt, double time)
+/*
+    Walk the probe run for key, removing expired entries on the way. Returns the slot of the live entry for
+    this address and client salt, or -1. When there is none, emptySlot is set to the empty slot that ends the
+    run, or -1 if the run reaches ChallengeMaxProbe first.
+*/
+int ServerChallengeHashLookup(Server* server, uint64_t key, const AddressKey* addressKey, uint64_t clientSalt, double time, int* emptySlot)
 {
-    const uint64_t key = CalculateChallengeHashKey(address, clientSalt, server->m_serverSalt);
+    ServerChallengeHash* hash = &server->m_challengeHash;
+    const int mask = hash->size - 1;
 
-    int index = key % ChallengeHashSize;
+    int slot = (int)(key & mask);
+    int distance = 0;
+    int result = -1;
 
-    printf("client salt = %" PRIx64 "\n", clientSalt);
-    printf("challenge hash key = %" PRIx64 "\n", key);
-    printf("challenge hash index = %d\n", index);
+    *emptySlot = -1;
 
-    if (!server->m_challengeHash.exists[index] || (server->m_challengeHash.exists[index] && server->m_challengeHash.entries[index].create_time + ChallengeTimeOut < time)) {
-        printf("found empty entry in challenge hash at index %d\n", index);
+    while (distance < ChallengeMaxProbe) {
+        const ServerChallengeSlot* s = &hash->slots[slot];
+        hash->stats.numProbes++;
 
-        ServerChallengeEntry* entry = &server->m_challengeHash.entries[index];
+        if (s->key == 0) {
+            *emptySlot = slot;
+            break;
+        }
 
-        entry->client_salt = clientSalt;
-        entry->challenge_salt = GenerateSalt();
-        entry->last_packet_send_time = time - ChallengeSendRate * 2;
-        entry->create_time = time;
-        entry->address = address;
+        // the entry shifted back into this slot is checked next
+        if (s->create_time + ChallengeTimeOut < time) {
+            ServerChallengeHashRemove(hash, slot);
+            hash->stats.numExpired++;
+            continue;
+        }
 
-        server->m_challengeHash.exists[index] = 1;
+        if (s->key == key && hash->entries[slot].client_salt == clientSalt && AddressKeyEquals(&hash->entries[slot].address_key, addressKey)) {
+            result = slot;
+            break;
+        }
 
-        return entry;
+        slot = (slot + 1) & mask;
+        distance++;
     }
 
-    if (server->m_challengeHash.exists[index] && server->m_challengeHash.entries[index].client_salt == clientSalt && server->m_challengeHash.entries[index].address.m_address_ipv4 == address.m_address_ipv4) {
-        printf("found existing challenge hash entry at index %d\n", index);
+    const int numProbed = distance < ChallengeMaxProbe ? distance + 1 : ChallengeMaxProbe;
+
+    hash->stats.numLookups++;
+    if (numProbed > hash->stats.maxProbe)
+        hash->stats.maxProbe = numProbed;
+
+    return result;
+}
+
+// remove every expired entry. returns the number removed
+int ServerChallengeHashExpire(Server* server, double time)
+{
+    ServerChallengeHash* hash = &server->m_challengeHash;
+
+    if (time <= hash->next_expire_time)
+        return 0;
+
+    hash->stats.numSweeps++;
+
+    int numExpired = 0;
+    double oldestCreateTime = time;
+    for (int slot = 0; slot < hash->size; ++slot) {
+        // a removal can shift an expired entry into this slot, so look again before moving on
+        while (hash->slots[slot].key != 0 && hash->slots[slot].create_time + ChallengeTimeOut < time) {
+            ServerChallengeHashRemove(hash, slot);
+            numExpired++;
+        }
 
-        return &server->m_challengeHash.entries[index];
+        if (hash->slots[slot].key != 0 && hash->slots[slot].create_time < oldestCreateTime)
+            oldestCreateTime = hash->slots[slot].create_time;
     }
 
-    return NULL;
+    // entries inserted from here on are newer, so the oldest one left bounds the next expiry
+    hash->next_expire_time = oldestCreateTime + ChallengeTimeOut;
+
+    hash->stats.numExpired += numExpired;
+
+    return numExpired;
 }
 
+// 0 marks an empty slot, so no entry may have it as its key
+uint64_t ServerChallengeKey(Server* server, const AddressKey* addressKey, uint64_t clientSalt)
+{
+    const uint64_t key = CalculateAddressHashKey(addressKey, clientSalt, server->m_serverSalt);
+    return key != 0 ? key : 1;
+}
 
- void ServerSendPacketToConnectedClient(Server* server, int clientIndex, void* packet, int packetSize, double time)
+ServerChallengeEntry* ServerFindChallenge(Server* server, Address address, uint64_t clientSalt, double time)
 {
-    assert(packet);
-    assert(clientIndex >= 0);
-    assert(clientIndex < MaxClients);
-    assert(server->m_clientConnected[clientIndex]);
-    server->m_clientData[clientIndex].lastPacketSendTime = time;
+    const AddressKey addressKey = AddressKeyFromAddress(address);
+    const uint64_t key = ServerChallengeKey(server, &addressKey, clientSalt);
+
+    printf("client salt = %" PRIx64 "\n", clientSalt);
+    printf("challenge hash key = %" PRIx64 "\n", key);
+
+    int emptySlot;
+    const int slot = ServerChallengeHashLookup(server, key, &addressKey, clientSalt, time, &emptySlot);
+    if (slot == -1)
+        return NULL;
 
-    SendPacket(*server->m_socket, server->m_clientAddress[clientIndex], packet, packetSize);
+    printf("found challenge entry at index %d\n", slot);
+
+    return &server->m_challengeHash.entries[slot];
 }
 
-void ServerProcessConnectionRequest(Server* server, const ConnectionRequestPacket* packet, Address address, double time)
+ServerChallengeEntry* ServerFindOrInsertChallenge(Server* server, Address address, uint64_t clientSalt, double time)
 {
-    char buffer[256];
-    const char* addressString = AddressToString(address, buffer, sizeof(buffer));
-    printf("processing connection request packet from: %s\n", addressString);
+    const AddressKey addressKey = AddressKeyFromAddress(address);
+    const uint64_t key = ServerChallengeKey(server, &addressKey, clientSalt);
 
-    if (server->m_numConnectedClients == MaxClients) {
+    printf("client salt = %" PRIx64 "\n", clientSalt);
+    printf("challenge hash key = %" PRIx64 "\n", key);
 
-        printf("connection denied: server is full\n");
-        ConnectionDeniedPacket connectionDeniedPacket;
-        connectionDeniedPacket.packet_type = 3;
-        connectionDeniedPacket.client_server_type = 1;
+    ServerChallengeHash* hash = &server->m_challengeHash;
 
+    int emptySlot;
+    const int slot = ServerChallengeHashLookup(server, key, &addressKey, clientSalt, time, &emptySlot);
 
-        connectionDeniedPacket.client_salt = packet->client_salt;
-        connectionDeniedPacket.reason = CONNECTION_DENIED_SERVER_FULL;
+    if (slot != -1) {
+        printf("found existing challenge hash entry at index %d\n", slot);
 
+        return &hash->entries[slot];
+    }
 
-        uint8_t packet_buffer[1024];
+    if (hash->num_entries >= (int)(hash->size * ChallengeMaxLoad)) {
+        ServerChallengeHashExpire(server, time);
 
-        Stream writeStream;
-        r_stream_write_init(&writeStream, packet_buffer, 1024);
+        if (hash->num_entries >= (int)(hash->size * ChallengeMaxLoad)) {
+            printf("challenge hash is full (%d entries)\n", hash->num_entries);
+            hash->stats.numInsertsFailed++;
+            return NULL;
+        }
 
-        SerializeConnectionDeniedPacket(&writeStream, &connectionDeniedPacket);
+        // the sweep may have moved entries, so find the end of the run again
+        ServerChallengeHashLookup(server, key, &addressKey, clientSalt, time, &emptySlot);
+    }
 
-        FlushBits(&writeStream);
+    if (emptySlot == -1) {
+        printf("challenge hash has no free slot within %d of index %d\n", ChallengeMaxProbe, (int)(key & (hash->size - 1)));
+        hash->stats.numInsertsFailed++;
+        return NULL;
+    }
 
-        size_t bytesProcessed = GetBytesProcessed(&writeStream);
+    printf("found empty entry in challenge hash at index %d\n", emptySlot);
 
-        SendPacket(*server->m_socket, address, packet_buffer, bytesProcessed);
-        return;
-    }
+    hash->slots[emptySlot].key = key;
+    hash->slots[emptySlot].create_time = time;
 
-    if (ServerClientIsConnected(server, address, packet->client_salt)) {
+    ServerChallengeEntry* entry = &hash->entries[emptySlot];
 
-        printf("connection denied: already connected\n");
-        ConnectionDeniedPacket connectionDeniedPacket;
-        connectionDeniedPacket.packet_type = 3;
-        connectionDeniedPacket.client_server_type = 1;
+    entry->client_salt = clientSalt;
+    entry->challenge_salt = ServerGenerateSalt(server);
+    entry->last_packet_send_time = time - ChallengeSendRate * 2;
+    entry->address = address;
+    entry->address_key = addressKey;
 
-        connectionDeniedPacket.client_salt = packet->client_salt;
-        connectionDeniedPacket.reason = CONNECTION_DENIED_ALREADY_CONNECTED;
+    hash->num_entries++;
+    hash->stats.numInserts++;
 
-        uint8_t packet_buffer[1024];
+    return entry;
+}
 
-        Stream writeStream;
-        r_stream_write_init(&writeStream, packet_buffer, 1024);
 
-        SerializeConnectionDeniedPacket(&writeStream, &connectionDeniedPacket);
+/*
+    Stateless challenge tokens.
 
-        FlushBits(&writeStream);
+    With SERVER_STATELESS_CHALLENGE the server keeps nothing for a connection request, the same idea as SYN
+    cookies. The challenge salt it sends back is a token: a 16 bit timestamp in the top bits and, below it, 48
+    bits of SipHash over the address, client salt and timestamp, keyed with a server secret. The client echoes
+    it in its connection response, and the server recomputes the MAC to check it.
 
-        size_t bytesProcessed = GetBytesProcessed(&writeStream);
+    A token is good for ChallengeTimeOut. The secret is replaced every ChallengeSecretLifetime and the previous
+    one is kept for verifying, so a token made just before a rotation still checks out. Handling a request or a
+    response costs one or two SipHash calls and no memory.
+*/
 
-        SendPacket(*server->m_socket, address, packet_buffer, bytesProcessed);
+// key material for challenge tokens. the OS random source where there is one, GenerateSalt otherwise
+void ServerGenerateSecret(uint64_t secret[2])
+{
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+    FILE* file = fopen("/dev/urandom", "rb");
+    if (file) {
+        const size_t numRead = fread(secret, sizeof(uint64_t), 2, file);
+        fclose(file);
+        if (numRead == 2)
+            return;
+    }
+#endif
+    secret[0] = GenerateSalt();
+    secret[1] = GenerateSalt();
+}
 
+void ServerRotateChallengeSecret(Server* server, double time)
+{
+    if (time < server->m_challengeSecretTime + ChallengeSecretLifetime)
         return;
+
+    // after a long gap the old secret has nothing left to verify either
+    if (time < server->m_challengeSecretTime + ChallengeSecretLifetime * 2) {
+        server->m_challengeSecret[1][0] = server->m_challengeSecret[0][0];
+        server->m_challengeSecret[1][1] = server->m_challengeSecret[0][1];
+    } else {
+        ServerGenerateSecret(server->m_challengeSecret[1]);
     }
 
-    ServerChallengeEntry* entry = ServerFindOrInsertChallenge(server, address, packet->client_salt, time);
-    if (!entry)
-        return;
+    ServerGenerateSecret(server->m_challengeSecret[0]);
+    server->m_challengeSecretTime = time;
+}
 
-    assert(entry);
-    assert(entry->address.m_address_ipv4 == address.m_address_ipv4);
-    assert(entry->client_salt == packet->client_salt);
+uint64_t ServerChallengeToken(const uint64_t secret[2], const AddressKey* addressKey, uint64_t clientSalt, uint64_t timestamp)
+{
+    const uint64_t words[5] = { addressKey->m_words[0], addressKey->m_words[1], addressKey->m_words[2], clientSalt, timestamp };
+    const uint64_t mac = siphash_words_64(words, 5, secret[0], secret[1]);
+    return (timestamp << 48) | (mac & 0xFFFFFFFFFFFFull);
+}
 
-    if (entry->last_packet_send_time + ChallengeSendRate < time) {
-        printf("sending connection challenge to %s (challenge salt = %" PRIx64 ")\n", addressString, entry->challenge_salt);
+uint64_t ServerGenerateChallengeToken(Server* server, Address address, uint64_t clientSalt, double time)
+{
+    ServerRotateChallengeSecret(server, time);
 
-        uint8_t buff[1024];
+    const AddressKey addressKey = AddressKeyFromAddress(address);
+    const uint64_t timestamp = (uint64_t)(time / ChallengeTokenResolution) & 0xFFFF;
 
-        ConnectionChallengePacket connectionChallengePacket;
-        connectionChallengePacket.packet_type = 3;
-        connectionChallengePacket.client_server_type = 2;
+    return ServerChallengeToken(server->m_challengeSecret[0], &addressKey, clientSalt, timestamp);
+}
 
-        connectionChallengePacket.client_salt = packet->client_salt;
-        connectionChallengePacket.challenge_salt = entry->challenge_salt;
+bool ServerVerifyChallengeToken(Server* server, Address address, uint64_t clientSalt, uint64_t token, double time)
+{
+    ServerRotateChallengeSecret(server, time);
 
+    // the timestamp wraps, so only the age counts. a token from a wrap ago fails the MAC, the secret is long gone
+    const uint64_t timestamp = token >> 48;
+    const uint64_t now = (uint64_t)(time / ChallengeTokenResolution) & 0xFFFF;
+    const uint64_t age = (now - timestamp) & 0xFFFF;
 
-        Stream writeStream;
-        r_stream_write_init(&writeStream, buff, 1024);
+    if (age * ChallengeTokenResolution > ChallengeTimeOut)
+        return false;
 
-        SerializeConnectionChallengePacket(&writeStream, &connectionChallengePacket);
+    const AddressKey addressKey = AddressKeyFromAddress(address);
 
-        FlushBits(&writeStream);
+    return token == ServerChallengeToken(server->m_challengeSecret[0], &addressKey, clientSalt, timestamp)
+        || token == ServerChallengeToken(server->m_challengeSecret[1], &addressKey, clientSalt, timestamp);
+}
 
+ void ServerSendPacketToConnectedClient(Server* server, int clientIndex, void* packet, int packetSize, double time)
+{
+    assert(packet);
+    assert(clientIndex >= 0);
+    assert(clientIndex < server->m_maxClients);
+    assert(server->m_clientConnected[clientIndex]);
+    server->m_clientData[clientIndex].lastPacketSendTime = time;
 
-        Stream readStrem;
-        r_stream_read_init(&readStrem, buff, 1024);
+    SendQueuePacket(&server->m_sendQueue, server->m_clientAddress[clientIndex], packet, packetSize);
+}
 
-        ConnectionChallengePacket pack;
+// serialize a packet of numBits (see MeasureBits) for a connected client straight into the send queue. finish it with SendQueueFinishPacket
+bool ServerBeginPacketToConnectedClient(Server* server, int clientIndex, int numBits, Stream* stream, double time)
+{
+    assert(clientIndex >= 0);
+    assert(clientIndex < server->m_maxClients);
+    assert(server->m_clientConnected[clientIndex]);
+    server->m_clientData[clientIndex].lastPacketSendTime = time;
 
-        SerializeConnectionChallengePacket(&readStrem, &pack);
+    return SendQueueBeginPacket(&server->m_sendQueue, server->m_clientAddress[clientIndex], numBits, stream);
+}
 
-        printf("pack.client_packet_type: %d\n", pack.client_server_type);
+bool ServerSendImageToConnectedClient(Server* server, int clientIndex, const ControlPacketImage* image, double time)
+{
+    assert(clientIndex >= 0);
+    assert(clientIndex < server->m_maxClients);
+    assert(server->m_clientConnected[clientIndex]);
+    assert(image->size > 0);
+    server->m_clientData[clientIndex].lastPacketSendTime = time;
 
+    return SendQueueDatagram(&server->m_sendQueue, server->m_clientAddress[clientIndex], image->data, image->size);
+}
 
+// copy the denied image for reason into a queue slot, then patch in the client salt and the crc32
+bool ServerSendConnectionDenied(Server* server, Address address, uint64_t clientSalt, ConnectionDeniedReason reason)
+{
+    const ControlPacketImage* image = &server->m_deniedImage[reason];
 
-        size_t bytesProcessed = GetBytesProcessed(&writeStream);
+    uint8_t* slot = SendQueueReserve(&server->m_sendQueue, address, image->size);
+    if (!slot)
+        return false;
 
+    memcpy(slot, image->data, image->size);
+    OrPacketBits(slot + HEADER_SIZE, server->m_deniedSaltBit, clientSalt, 64);
+    WriteDatagramCrc32(slot, image->size);
+    SendQueueCommit(&server->m_sendQueue, image->size);
 
-        SendPacket(*server->m_socket, address, buff, bytesProcessed);
-        entry->last_packet_send_time = time;
-    }
+    return true;
 }
 
- void ServerProcessConnectionResponse(Server* server, const ConnectionResponsePacket* packet, Address address, double time)
+void ServerProcessConnectionRequest(Server* server, const ConnectionRequestPacket* packet, Address address, double time)
 {
-    const int existingClientIndex = ServerFindExistingClientIndex(server, address, packet->client_salt, packet->challenge_salt);
-    if (existingClientIndex != -1) {
-        assert(existingClientIndex >= 0);
-        assert(existingClientIndex < MaxClients);
+    char buffer[256];
+    const char* addressString = AddressToString(address, buffer, sizeof(buffer));
+    printf("processing connection request packet from: %s\n", addressString);
 
-        if (server->m_clientData[existingClientIndex].lastPacketSendTime + ConnectionConfirmSendRate < time) {
-            ConnectionKeepAlivePacket connectionKeepAlivePacket;
-            connectionKeepAlivePacket.packet_type = 3;
-            connectionKeepAlivePacket.client_server_type = 4;
+    if (server->m_numConnectedClients == server->m_maxClients) {
 
-            connectionKeepAlivePacket.client_salt = server->m_clientSalt[existingClientIndex];
-            connectionKeepAlivePacket.challenge_salt = server->m_challengeSalt[existingClientIndex];
+        printf("connection denied: server is full\n");
+        ServerSendConnectionDenied(server, address, packet->client_salt, CONNECTION_DENIED_SERVER_FULL);
+        return;
+    }
 
-            uint8_t packet_buffer[1024];
+    if (ServerClientIsConnected(server, address, packet->client_salt)) {
 
-            Stream writeStream;
-            r_stream_write_init(&writeStream, packet_buffer, 1024);
+        printf("connection denied: already connected\n");
+        ServerSendConnectionDenied(server, address, packet->client_salt, CONNECTION_DENIED_ALREADY_CONNECTED);
+        return;
+    }
 
-            SerializeConnectionKeepAlivePacket(&writeStream, &connectionKeepAlivePacket);
+#if SERVER_STATELESS_CHALLENGE
+    // nothing is kept, so every request gets a challenge. the request is padded to be bigger than the reply
+    const uint64_t challengeSalt = ServerGenerateChallengeToken(server, address, packet->client_salt, time);
+#else
+    ServerChallengeEntry* entry = ServerFindOrInsertChallenge(server, address, packet->client_salt, time);
+    if (!entry)
+        return;
 
-            FlushBits(&writeStream);
+    assert(entry);
+    assert(AddressEquals(entry->address, address));
+    assert(entry->client_salt == packet->client_salt);
 
-            size_t bytesProcessed = GetBytesProcessed(&writeStream);
+    if (entry->last_packet_send_time + ChallengeSendRate >= time)
+        return;
 
-            ServerSendPacketToConnectedClient(server, existingClientIndex, packet_buffer, bytesProcessed, time);
-        }
+    entry->last_packet_send_time = time;
+
+    const uint64_t challengeSalt = entry->challenge_salt;
+#endif
+
+    printf("sending connection challenge to %s (challenge salt = %" PRIx64 ")\n", addressString, challengeSalt);
+
+    ConnectionChallengePacket connectionChallengePacket;
+    connectionChallengePacket.packet_type = 3;
+    connectionChallengePacket.client_server_type = 2;
+
+    connectionChallengePacket.client_salt = packet->client_salt;
+    connectionChallengePacket.challenge_salt = challengeSalt;
+
+    SendQueueWidePacket(&server->m_sendQueue, address, SerializeConnectionChallengePacket<MeasureStream>, SerializeConnectionChallengePacket<WideWriteStream>, &connectionChallengePacket);
+}
+
+ void ServerProcessConnectionResponse(Server* server, const ConnectionResponsePacket* packet, Address address, double time)
+{
+    const int existingClientIndex = ServerFindExistingClientIndex(server, address, packet->client_salt, packet->challenge_salt);
+    if (existingClientIndex != -1) {
+        assert(existingClientIndex >= 0);
+        assert(existingClientIndex < server->m_maxClients);
+
+        if (server->m_clientData[existingClientIndex].lastPacketSendTime + ConnectionConfirmSendRate < time)
+            ServerSendImageToConnectedClient(server, existingClientIndex, &server->m_clientData[existingClientIndex].keepAliveImage, time);
 
         return;
     }
@@ -746,41 +1372,34 @@ void ServerProcessConnectionRequest(Server* server, const ConnectionRequestPacke
     const char* addressString = AddressToString(address, buffer, sizeof(buffer));
     printf("processing connection response from client %s (client salt = %" PRIx64 ", challenge salt = %" PRIx64 ")\n", addressString, packet->client_salt, packet->challenge_salt);
 
+#if SERVER_STATELESS_CHALLENGE
+    if (!ServerVerifyChallengeToken(server, address, packet->client_salt, packet->challenge_salt, time)) {
+        printf("connection challenge token is invalid or expired: %" PRIx64 "\n", packet->challenge_salt);
+        return;
+    }
+#else
     ServerChallengeEntry* entry = ServerFindChallenge(server, address, packet->client_salt, time);
     if (!entry)
         return;
 
     assert(entry);
-    assert(entry->address.m_address_ipv4 == address.m_address_ipv4);
+    assert(AddressEquals(entry->address, address));
     assert(entry->client_salt == packet->client_salt);
 
     if (entry->challenge_salt != packet->challenge_salt) {
         printf("connection challenge mismatch: expected %" PRIx64 ", got %" PRIx64 "\n", entry->challenge_salt, packet->challenge_salt);
         return;
     }
+#endif
 
-    if (server->m_numConnectedClients == MaxClients) {
-        if (entry->last_packet_send_time + ConnectionChallengeSendRate < time) {
-            printf("connection denied: server is full\n");
-            ConnectionDeniedPacket connectionDeniedPacket;
-            connectionDeniedPacket.client_salt = packet->client_salt;
-            connectionDeniedPacket.reason = CONNECTION_DENIED_SERVER_FULL;
-
-
-            uint8_t packet_buffer[1024];
-
-            Stream writeStream;
-            r_stream_write_init(&writeStream, packet_buffer, 1024);
-
-            SerializeConnectionDeniedPacket(&writeStream, &connectionDeniedPacket);
-
-            FlushBits(&writeStream);
-
-            size_t bytesProcessed = GetBytesProcessed(&writeStream);
-
-            SendPacket(*server->m_socket, address, packet_buffer, bytesProcessed);
-            entry->last_packet_send_time = time;
-        }
+    if (server->m_numConnectedClients == server->m_maxClients) {
+#if !SERVER_STATELESS_CHALLENGE
+        if (entry->last_packet_send_time + ConnectionChallengeSendRate >= time)
+            return;
+        entry->last_packet_send_time = time;
+#endif
+        printf("connection denied: server is full\n");
+        ServerSendConnectionDenied(server, address, packet->client_salt, CONNECTION_DENIED_SERVER_FULL);
         return;
     }
 
@@ -800,7 +1419,7 @@ void ServerProcessConnectionRequest(Server* server, const ConnectionRequestPacke
         return;
 
     assert(clientIndex >= 0);
-    assert(clientIndex < MaxClients);
+    assert(clientIndex < server->m_maxClients);
 
     server->m_clientData[clientIndex].lastPacketReceiveTime = time;
 }
@@ -812,7 +1431,7 @@ void ServerProcessConnectionDisconnect(Server* server, const ConnectionDisconnec
         return;
 
     assert(clientIndex >= 0);
-    assert(clientIndex < MaxClients);
+    assert(clientIndex < server->m_maxClients);
 
     ServerDisconnectClient(server, clientIndex, time);
 }
@@ -848,6 +1467,12 @@ typedef struct Client {
     double m_lastPacketReceiveTime; // time we last received a packet from the server (used for timeouts).
 
     double m_clientSaltExpiryTime; // time the client salt expires and we roll another (in case of collision).
+
+    SendQueue m_sendQueue; // outgoing datagrams. flushed once per client loop
+
+    uint8_t m_packetImage[ConnectionRequestImageSize]; // datagram for the packet the current state sends, crc32 included
+
+    int m_packetImageSize; // bytes in m_packetImage. 0 in states that send nothing
 } Client;
 
 bool CreateClient(Client* client, Socket* socket);
@@ -861,7 +1486,9 @@ void ClientSendPackets(Client* client, double time);
 void ClientReceivePackets(Client* client, double time);
 void ClientCheckForTimeOut(Client* client, double time);
 void ClientResetConnectionData(Client* client);
+void ClientUpdatePacketImage(Client* client);
 void ClientSendPacketToServer(Client* client, void* packet, int packetSize, double time);
+bool ClientBeginPacketToServer(Client* client, int numBits, Stream* stream, double time);
 void ClientProcessConnectionDenied(Client* client, const ConnectionDeniedPacket* packet, Address address, double time);
 void ClientProcessConnectionChallenge(Client* client, const ConnectionChallengePacket* packet, Address address, double time);
 void ClientProcessConnectionKeepAlive(Client* client, const ConnectionKeepAlivePacket* packet, Address address, double time);
@@ -871,6 +1498,7 @@ void ClientProcessConnectionDisconnect(Client* client, const ConnectionDisconnec
 bool CreateClient(Client* client, Socket* socket)
 {
     client->m_socket = socket;
+    SendQueueInit(&client->m_sendQueue, socket);
     ClientResetConnectionData(client);
     return true;
 }
@@ -892,6 +1520,7 @@ void ClientConnect(Client* client, Address address, double time)
     client->m_lastPacketSendTime = time - 1.0f;
     client->m_lastPacketReceiveTime = time;
     client->m_clientSaltExpiryTime = time + ClientSaltTimeout;
+    ClientUpdatePacketImage(client);
 }
 
 bool ClientIsConnecting(Client* client)
@@ -920,21 +1549,33 @@ void ClientDisconnect(Client* client, double time)
         connectionDisconnectPacket.client_salt = client->m_clientSalt;
         connectionDisconnectPacket.challenge_salt = client->m_challengeSalt;
 
-        uint8_t packet_buffer[1024];
+        client->m_lastPacketSendTime = time;
+        SendQueueWidePacket(&client->m_sendQueue, client->m_serverAddress, SerializeConnectionDisconnectPacket<MeasureStream>, SerializeConnectionDisconnectPacket<WideWriteStream>, &connectionDisconnectPacket);
+    }
 
-        Stream writeStream;
-        r_stream_write_init(&writeStream, packet_buffer, 1024);
+    ClientResetConnectionData(client);
+}
 
-        SerializeConnectionDisconnectPacket(&writeStream, &connectionDisconnectPacket);
+// rebuild m_packetImage for the current state and salts. called whenever either changes
+void ClientUpdatePacketImage(Client* client)
+{
+    switch (client->m_clientState) {
+    case CLIENT_STATE_SENDING_CONNECTION_REQUEST:
+        client->m_packetImageSize = WriteConnectionRequestDatagram(client->m_packetImage, sizeof(client->m_packetImage), client->m_clientSalt);
+        break;
 
-        FlushBits(&writeStream);
+    case CLIENT_STATE_SENDING_CHALLENGE_RESPONSE:
+        client->m_packetImageSize = WriteConnectionResponseDatagram(client->m_packetImage, sizeof(client->m_packetImage), client->m_clientSalt, client->m_challengeSalt);
+        break;
 
-        size_t bytesProcessed = GetBytesProcessed(&writeStream);
+    case CLIENT_STATE_CONNECTED:
+        client->m_packetImageSize = WriteConnectionKeepAliveDatagram(client->m_packetImage, sizeof(client->m_packetImage), client->m_clientSalt, client->m_challengeSalt);
+        break;
 
-        ClientSendPacketToServer(client, packet_buffer, bytesProcessed, time);
+    default:
+        client->m_packetImageSize = 0;
+        break;
     }
-
-    ClientResetConnectionData(client);
 }
 
 void ClientSendPackets(Client* client, double time)
@@ -948,27 +1589,7 @@ void ClientSendPackets(Client* client, double time)
         const char* addressString = AddressToString(client->m_serverAddress, buffer, sizeof(buffer));
         printf("client sending connection request to server: %s\n", addressString);
 
-
-        uint8_t buff[1024];
-
-        ConnectionRequestPacket packet;
-        packet.packet_type = 3;
-        packet.client_server_type = 0;
-
-        packet.client_salt = client->m_clientSalt;
-
-        Stream writeStream;
-        r_stream_write_init(&writeStream, buff, 1024);
-
-        SerializeConnectionRequestPacket(&writeStream, &packet);
-
-        FlushBits(&writeStream);
-
-        size_t bytesProcessed = GetBytesProcessed(&writeStream);
-
         printf("pk.client_salt: %llu\n", client->m_clientSalt);
-
-        ClientSendPacketToServer(client, buff, bytesProcessed, time);
     } break;
 
     case CLIENT_STATE_SENDING_CHALLENGE_RESPONSE: {
@@ -978,71 +1599,38 @@ void ClientSendPackets(Client* client, double time)
         char buffer[256];
         const char* addressString = AddressToString(client->m_serverAddress, buffer, sizeof(buffer));
         printf("client sending challenge response to server: %s\n", addressString);
-
-        
-
-        ConnectionResponsePacket packet;
-        packet.packet_type = 3;
-        packet.client_server_type = 3;
-
-        packet.client_salt = client->m_clientSalt;
-        packet.challenge_salt = client->m_challengeSalt;
-
-        uint8_t packet_buffer[1024];
-
-        Stream writeStream;
-        r_stream_write_init(&writeStream, packet_buffer, 1024);
-
-        SerializeConnectionResponsePacket(&writeStream, &packet);
-
-        FlushBits(&writeStream);
-
-        size_t bytesProcessed = GetBytesProcessed(&writeStream);
-
-        ClientSendPacketToServer(client, packet_buffer, bytesProcessed, time);
     } break;
 
     case CLIENT_STATE_CONNECTED: {
         if (client->m_lastPacketSendTime + ConnectionKeepAliveSendRate > time)
             return;
-
-        uint8_t packet_buffer[1024];
-
-        ConnectionKeepAlivePacket packet;
-        packet.packet_type = 3;
-        packet.client_server_type = 4;
-
-        packet.client_salt = client->m_clientSalt;
-        packet.challenge_salt = client->m_challengeSalt;
-
-        Stream writeStream;
-        r_stream_write_init(&writeStream, packet_buffer, 1024);
-
-        SerializeConnectionKeepAlivePacket(&writeStream, &packet);
-
-        FlushBits(&writeStream);
-
-        size_t bytesProcessed = GetBytesProcessed(&writeStream);
-
-
-        ClientSendPacketToServer(client, packet_buffer, bytesProcessed, time);
     } break;
 
     default:
-        break;
+        return;
     }
+
+    assert(client->m_packetImageSize > 0);
+
+    client->m_lastPacketSendTime = time;
+
+    SendQueueDatagram(&client->m_sendQueue, client->m_serverAddress, client->m_packetImage, client->m_packetImageSize);
 }
 
-bool ClientReceivePackets(Client* client, double time, Address address, Stream* stream, int client_packet_type)
+// packetData is the datagram after its crc32, as for ServerReceivePackets
+bool ClientReceivePackets(Client* client, double time, Address address, const uint8_t* packetData, int packetBytes, int client_packet_type)
 {
     printf("Client recieved packet type ");
     printPackType((PacketTypes)client_packet_type);
 
+    // every control packet has a fixed size, so each case checks once that the data holds it and reads unchecked
+    WideReadStream reader(packetData, packetBytes);
+
     switch (client_packet_type) {
     case PACKET_CONNECTION_DENIED: {
         ConnectionDeniedPacket connectionDeniedPacket;
-        serialize_uint64(stream, &connectionDeniedPacket.client_salt);
-        serialize_enum(stream, connectionDeniedPacket.reason, ConnectionDeniedReason, CONNECTION_DENIED_NUM_VALUES);
+        if (!reader.HasBits(ControlPacketBits(SerializeConnectionDeniedPacket<MeasureStream>)) || !SerializeConnectionDeniedPacket(reader, &connectionDeniedPacket))
+            return false;
 
         ClientProcessConnectionDenied(client, &connectionDeniedPacket, address, time);
     }
@@ -1051,8 +1639,8 @@ bool ClientReceivePackets(Client* client, double time, Address address, Stream*
 
     case PACKET_CONNECTION_CHALLENGE: {
         ConnectionChallengePacket connectionChallengePacket;
-        serialize_uint64(stream, &connectionChallengePacket.client_salt);
-        serialize_uint64(stream, &connectionChallengePacket.challenge_salt);
+        if (!reader.HasBits(ControlPacketBits(SerializeConnectionChallengePacket<MeasureStream>)) || !SerializeConnectionChallengePacket(reader, &connectionChallengePacket))
+            return false;
 
         ClientProcessConnectionChallenge(client, &connectionChallengePacket, address, time);
     }
@@ -1061,8 +1649,8 @@ bool ClientReceivePackets(Client* client, double time, Address address, Stream*
 
     case PACKET_CONNECTION_KEEP_ALIVE: {
         ConnectionKeepAlivePacket connectionKeepAlivePacket;
-        serialize_uint64(stream, &connectionKeepAlivePacket.client_salt);
-        serialize_uint64(stream, &connectionKeepAlivePacket.challenge_salt);
+        if (!reader.HasBits(ControlPacketBits(SerializeConnectionKeepAlivePacket<MeasureStream>)) || !SerializeConnectionKeepAlivePacket(reader, &connectionKeepAlivePacket))
+            return false;
 
         ClientProcessConnectionKeepAlive(client, &connectionKeepAlivePacket, address, time);
     }
@@ -1071,8 +1659,8 @@ bool ClientReceivePackets(Client* client, double time, Address address, Stream*
 
     case PACKET_CONNECTION_DISCONNECT: {
         ConnectionDisconnectPacket connectionDisconnectPacket;
-        serialize_uint64(stream, &connectionDisconnectPacket.client_salt);
-        serialize_uint64(stream, &connectionDisconnectPacket.challenge_salt);
+        if (!reader.HasBits(ControlPacketBits(SerializeConnectionDisconnectPacket<MeasureStream>)) || !SerializeConnectionDisconnectPacket(reader, &connectionDisconnectPacket))
+            return false;
 
         ClientProcessConnectionDisconnect(client, &connectionDisconnectPacket, address, time);
     }
@@ -1099,6 +1687,7 @@ void ClientCheckForTimeOut(Client* client, double time)
         if (client->m_clientSaltExpiryTime < time) {
             client->m_clientSalt = GenerateSalt();
             client->m_clientSaltExpiryTime = time + ClientSaltTimeout;
+            ClientUpdatePacketImage(client);
             printf("client salt timed out. new client salt is %" PRIx64 "\n", client->m_clientSalt);
         }
     } break;
@@ -1133,6 +1722,7 @@ void ClientCheckForTimeOut(Client* client, double time)
     client->m_challengeSalt = 0;
     client->m_lastPacketSendTime = -1000.0;
     client->m_lastPacketReceiveTime = -1000.0;
+    client->m_packetImageSize = 0;
 }
 
 void ClientSendPacketToServer(Client* client, void* packet, int packetSize, double time)
@@ -1140,9 +1730,19 @@ void ClientSendPacketToServer(Client* client, void* packet, int packetSize, doub
     assert(client->m_clientState != CLIENT_STATE_DISCONNECTED);
     //assert(client->m_serverAddress.IsValid());
 
-    SendPacket(*client->m_socket, client->m_serverAddress, packet, packetSize);
+    SendQueuePacket(&client->m_sendQueue, client->m_serverAddress, packet, packetSize);
+
+    client->m_lastPacketSendTime = time;
+}
+
+// serialize a packet of numBits (see MeasureBits) for the server straight into the send queue. finish it with SendQueueFinishPacket
+bool ClientBeginPacketToServer(Client* client, int numBits, Stream* stream, double time)
+{
+    assert(client->m_clientState != CLIENT_STATE_DISCONNECTED);
 
     client->m_lastPacketSendTime = time;
+
+    return SendQueueBeginPacket(&client->m_sendQueue, client->m_serverAddress, numBits, stream);
 }
 
 void ClientProcessConnectionDenied(Client* client, const ConnectionDeniedPacket* packet, Address address, double time)
@@ -1186,6 +1786,8 @@ void ClientProcessConnectionChallenge(Client* client, const ConnectionChallengeP
 
     client->m_clientState = CLIENT_STATE_SENDING_CHALLENGE_RESPONSE;
 
+    ClientUpdatePacketImage(client);
+
     client->m_lastPacketReceiveTime = time;
 }
 
@@ -1208,6 +1810,7 @@ void ClientProcessConnectionKeepAlive(Client* client, const ConnectionKeepAliveP
         const char* addressString = AddressToString(address, buffer, sizeof(buffer));
         printf("client is now connected to server: %s\n", addressString);
         client->m_clientState = CLIENT_STATE_CONNECTED;
+        ClientUpdatePacketImage(client);
     }
 
     client->m_lastPacketReceiveTime = time;
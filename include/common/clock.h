@@ -0,0 +1,104 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#include "address.h"
+
+#if PLATFORM == PLATFORM_WINDOWS
+#include <windows.h>
+#endif
+
+/*
+    Timebase for protocol timing.
+
+    r_clock_now reads a monotonic clock in nanoseconds: it never jumps when the wall clock is set, and it resolves
+    far finer than the 0.1 second send rates in client_server.h need. Only differences between readings mean
+    anything.
+
+    The Server and Client functions take time as double seconds on this clock, from r_clock_seconds. A double holds
+    it to well under a microsecond for years of uptime.
+
+    r_clock_sleep_until sleeps to an absolute reading, with clock_nanosleep where there is one.
+
+    Wall-clock time is only for people reading logs. r_clock_wall_string formats it, so call it when a line is
+    actually printed, not every loop.
+*/
+
+typedef int64_t ClockTime; // nanoseconds on the monotonic clock
+
+#define ClockNanosecondsPerSecond 1000000000ll
+
+ClockTime r_clock_now()
+{
+#if PLATFORM == PLATFORM_WINDOWS
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    // whole seconds and the remainder separately, so counter * 1e9 cannot overflow
+    const int64_t seconds = counter.QuadPart / frequency.QuadPart;
+    const int64_t remainder = counter.QuadPart % frequency.QuadPart;
+    return seconds * ClockNanosecondsPerSecond + remainder * ClockNanosecondsPerSecond / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ClockTime)now.tv_sec * ClockNanosecondsPerSecond + now.tv_nsec;
+#endif
+}
+
+// sleep until the monotonic clock reaches deadline. returns at once if it already has
+void r_clock_sleep_until(ClockTime deadline)
+{
+#if PLATFORM == PLATFORM_UNIX
+    struct timespec wake;
+    wake.tv_sec = (time_t)(deadline / ClockNanosecondsPerSecond);
+    wake.tv_nsec = (long)(deadline % ClockNanosecondsPerSecond);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+    }
+#elif PLATFORM == PLATFORM_MAC
+    ClockTime remaining;
+    while ((remaining = deadline - r_clock_now()) > 0) {
+        struct timespec sleep;
+        sleep.tv_sec = (time_t)(remaining / ClockNanosecondsPerSecond);
+        sleep.tv_nsec = (long)(remaining % ClockNanosecondsPerSecond);
+        nanosleep(&sleep, NULL);
+    }
+#else
+    // Sleep only has scheduler quantum resolution. sleep most of the way, then yield until the deadline
+    ClockTime remaining;
+    while ((remaining = deadline - r_clock_now()) > 0) {
+        if (remaining > 2000000)
+            Sleep((DWORD)((remaining - 2000000) / 1000000));
+        else
+            SwitchToThread();
+    }
+#endif
+}
+
+double r_clock_seconds(ClockTime time)
+{
+    return (double)(time / ClockNanosecondsPerSecond) + (double)(time % ClockNanosecondsPerSecond) * 1e-9;
+}
+
+// local wall-clock time as HH:MM:SS into buffer. for log lines only
+const char* r_clock_wall_string(char* buffer, int size)
+{
+    time_t now;
+    time(&now);
+
+    struct tm* timeInfo = localtime(&now);
+    if (!timeInfo || strftime(buffer, size, "%H:%M:%S", timeInfo) == 0)
+        snprintf(buffer, size, "??:??:??");
+
+    return buffer;
+}
+
+#endif
@@ -38,8 +38,6 @@ typedef struct PacketBuffer {
     PacketBufferEntry entries[PacketBufferSize]; // buffered packets in range [ current_sequence - PacketBufferSize + 1, current_sequence ] (modulo 65536)
 } PacketBuffer;
 
-static PacketBuffer packetBuffer;
-
 /*
     Advance the current sequence for the packet buffer forward.
     This function removes old packet entries and frees their fragments.z
@@ -243,91 +241,77 @@ void packet_buffer_recieve_packets(PacketBuffer* p_buffer, int* numPackets, Pack
 
 
 
-bool SplitPacketIntoFragments(uint16_t sequence, const uint8_t* packetData, int packetSize, int* numFragments, PacketData fragmentPackets[])
-{
-    numFragments = 0;
-
-    assert(*packetData);
-    assert(packetSize > 0);
-    assert(packetSize < MaxPacketSize);
-
-    *numFragments = (packetSize / MaxFragmentSize) + ((packetSize % MaxFragmentSize) != 0 ? 1 : 0);
-
-    assert(*numFragments > 0);
-    assert(*numFragments <= MaxFragmentsPerPacket);
-
-    const uint8_t* src = packetData;
-
-    printf("splitting packet into %d fragments\n", *numFragments);
-
-    for (int i = 0; i < *numFragments; ++i) 
-    {
-        const int fragmentSize = (i == *numFragments - 1) ? ((int)((intptr_t)(*packetData + packetSize) - (intptr_t)(src))) : MaxFragmentSize;
-
-        static const int MaxFragmentPacketSize = MaxFragmentSize + PacketFragmentHeaderBytes;
+#define MaxFragmentDatagramSize (MaxFragmentSize + PacketFragmentHeaderBytes)
 
-        fragmentPackets[i].data = (uint8_t*)malloc(MaxFragmentPacketSize);
+/*
+    Write one fragment of a packet into buffer as a datagram, with the same layout as r_serialize_fragment:
+    [crc32][sequence][packet type = 0][fragment id][num fragments][align]<fragment data>
 
+    The fragment data is copied straight from the packet into buffer and the crc32 is patched in place,
+    so buffer can be a send queue slot. buffer must hold FragmentDatagramSize(fragmentSize) bytes (socket.h).
 
-        printf("fragmentSize: %d\n", fragmentSize);
+    Returns the number of bytes in the datagram.
+*/
+int WriteFragmentDatagram(uint8_t* buffer, uint16_t sequence, int fragmentId, int numFragments, const uint8_t* fragmentData, int fragmentSize)
+{
+    assert(fragmentData);
+    assert(fragmentSize > 0);
+    assert(fragmentSize <= MaxFragmentSize);
+    assert(fragmentId >= 0 && fragmentId < numFragments);
+    assert(numFragments <= MaxFragmentsPerPacket);
 
+    Stream writer;
+    r_stream_write_init(&writer, buffer, MaxFragmentDatagramSize);
 
-        Stream writer;
+    r_stream_write_bits(&writer, 0, 32); // crc32, patched below
+    r_stream_write_bits(&writer, sequence, 16);
+    r_stream_write_bits(&writer, PACKET_FRAGMENT, bits_required(0, TEST_PACKET_NUM_TYPES - 1));
+    r_stream_write_bits(&writer, (uint32_t)fragmentId, 8);
+    r_stream_write_bits(&writer, (uint32_t)numFragments, 8);
 
-        if (!r_stream_write_init(&writer, fragmentPackets[i].data, MaxFragmentPacketSize)) {
-            printf("Failed to init read stream\n");
-        }
+    WriteAlign(&writer);
+    WriteBytes(&writer, fragmentData, fragmentSize);
+    FlushBits(&writer);
 
-        // uint32_t protocolId = host_to_network(packetInfo.protocolId);
-        // uint32_t crc32 = calculate_crc32((uint8_t*)&protocolId, 4, 0);
+    const int numBytes = GetBytesProcessed(&writer);
 
-        FragmentPacket fragmentPacket;
-       
-        fragmentPacket.fragmentSize = fragmentSize;
-        fragmentPacket.crc32 = 0;
-        //fragmentPacket.crc32 = crc32;
+    WriteDatagramCrc32(buffer, numBytes);
 
-        fragmentPacket.sequence = sequence;
-        fragmentPacket.fragmentId = (uint8_t)i;
-        fragmentPacket.numFragments = (uint8_t)numFragments;
-        memcpy(fragmentPacket.fragmentData, src, fragmentSize);
+    return numBytes;
+}
 
+// split a packet into fragment datagrams allocated with malloc. the caller frees fragmentPackets[n].data.
+// the send path writes fragments straight into send queue slots with WriteFragmentDatagram instead
+bool SplitPacketIntoFragments(uint16_t sequence, const uint8_t* packetData, int packetSize, int* numFragments, PacketData fragmentPackets[])
+{
+    *numFragments = 0;
 
-        if (!r_serialize_fragment(&writer, &fragmentPacket)) {
-            numFragments = 0;
-            for (int j = 0; j < i; ++j) {
-                free(fragmentPackets[i].data);
-                fragmentPackets[i].data = NULL;
-                fragmentPackets[i].size = 0;
-            }
-            return false;
-        }
+    assert(packetData);
+    assert(packetSize > 0);
+    assert(packetSize < MaxPacketSize);
 
-        FlushBits(&writer);
+    *numFragments = (packetSize / MaxFragmentSize) + ((packetSize % MaxFragmentSize) != 0 ? 1 : 0);
 
-        
-        uint32_t protocolId = host_to_network(packetInfo.protocolId);
-        uint32_t crc32 = calculate_crc32((uint8_t*)&protocolId, 4, 0);
-        crc32 = calculate_crc32(fragmentPackets[i].data, GetBytesProcessed(&writer), crc32);
-        *((uint32_t*)fragmentPackets[i].data) = host_to_network(crc32);
-        
-        
+    assert(*numFragments > 0);
+    assert(*numFragments <= MaxFragmentsPerPacket);
 
-        printf("fragment packet %d: %d bytes\n", i, GetBytesProcessed(&writer));
+    printf("splitting packet into %d fragments\n", *numFragments);
 
-        fragmentPackets[i].size = GetBytesProcessed(&writer);
+    for (int i = 0; i < *numFragments; ++i) {
+        const int offset = i * MaxFragmentSize;
+        const int fragmentSize = (i == *numFragments - 1) ? packetSize - offset : MaxFragmentSize;
 
-        src += fragmentSize;
+        fragmentPackets[i].data = (uint8_t*)malloc(MaxFragmentDatagramSize);
+        fragmentPackets[i].size = WriteFragmentDatagram(fragmentPackets[i].data, sequence, i, *numFragments, packetData + offset, fragmentSize);
     }
 
-    assert(src == packetData + packetSize);
-
     return true;
 }
 
 
 
-bool ProcessFragmentPacket(Stream* stream) {
+// reassemble a fragment into p_buffer. each server (or shard) owns its own packet buffer
+bool ProcessFragmentPacket(PacketBuffer* p_buffer, Stream* stream) {
 
     FragmentPacket fragmentPacket;
     
@@ -341,7 +325,7 @@ bool ProcessFragmentPacket(Stream* stream) {
     }
 
     //uint8_t data[200];
-    if (!ProcessFragment(&packetBuffer, (uint8_t*)stream->data + 9/*PacketFragmentHeaderBytes*/, fragmentPacket.fragmentSize, fragmentPacket.sequence, fragmentPacket.fragmentId, fragmentPacket.numFragments)) {
+    if (!ProcessFragment(p_buffer, (uint8_t*)stream->data + 9/*PacketFragmentHeaderBytes*/, fragmentPacket.fragmentSize, fragmentPacket.sequence, fragmentPacket.fragmentId, fragmentPacket.numFragments)) {
         printf("error: failed to process fragment\n");
         return false;
     }
@@ -349,7 +333,7 @@ bool ProcessFragmentPacket(Stream* stream) {
     int numPackets = 0;
     PacketData packets[PacketBufferSize];
     // Check to see if any packets have been completed
-    packet_buffer_recieve_packets(&packetBuffer, &numPackets, packets);
+    packet_buffer_recieve_packets(p_buffer, &numPackets, packets);
 
     for (int j = 0; j < numPackets; ++j) {
 
@@ -364,6 +348,8 @@ bool ProcessFragmentPacket(Stream* stream) {
 
         //packet_switch(packet_type, readStream);
     }
+
+    return true;
 }
 
 #endif
@@ -3,6 +3,23 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HASH_HAS_CLMUL 1
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HASH_TARGET_CLMUL
+#else
+#include <cpuid.h>
+#define HASH_TARGET_CLMUL __attribute__((target("sse2,pclmul")))
+#endif
+#else
+#define HASH_HAS_CLMUL 0
+#endif
 
 const uint32_t ProtocolId = 0x55667788;
 
@@ -41,7 +58,25 @@ static const uint32_t crc32_table[256] = {
     0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
 };
 
-uint32_t calculate_crc32(const uint8_t* buffer, size_t length, uint32_t crc32)
+/*
+    CRC32 (the zlib/ethernet polynomial, reflected).
+
+    calculate_crc32 runs over every byte of every datagram sent and received, so there are three
+    implementations with bit-identical output and the fastest one the CPU supports is picked at startup:
+
+        bytewise  one table lookup per byte. the reference
+        slice8    eight table lookups per 8 bytes (slicing-by-8)
+        clmul     folds 64 bytes per step with carry-less multiplies (PCLMULQDQ, x86 only). tails use slice8
+
+    r_crc32_initialize builds the slicing tables and picks the implementation. r_sockets_initialize calls it;
+    calculate_crc32 also calls it on first use if nobody has.
+*/
+
+typedef uint32_t (*Crc32Function)(const uint8_t* buffer, size_t length, uint32_t crc32);
+
+static uint32_t crc32_slice_table[8][256];
+
+uint32_t calculate_crc32_bytewise(const uint8_t* buffer, size_t length, uint32_t crc32)
 {
     crc32 ^= 0xFFFFFFFF;
     for (size_t i = 0; i < length; ++i)
@@ -49,6 +84,190 @@ uint32_t calculate_crc32(const uint8_t* buffer, size_t length, uint32_t crc32)
     return crc32 ^ 0xFFFFFFFF;
 }
 
+// slicing-by-8 on the inverted crc. shared by slice8 and the clmul tails
+static uint32_t crc32_slice8_update(const uint8_t* buffer, size_t length, uint32_t crc)
+{
+    while (length >= 8) {
+        const uint32_t one = crc ^ ((uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24));
+        const uint32_t two = (uint32_t)buffer[4] | ((uint32_t)buffer[5] << 8) | ((uint32_t)buffer[6] << 16) | ((uint32_t)buffer[7] << 24);
+
+        crc = crc32_slice_table[7][one & 0xFF] ^ crc32_slice_table[6][(one >> 8) & 0xFF] ^ crc32_slice_table[5][(one >> 16) & 0xFF] ^ crc32_slice_table[4][one >> 24]
+            ^ crc32_slice_table[3][two & 0xFF] ^ crc32_slice_table[2][(two >> 8) & 0xFF] ^ crc32_slice_table[1][(two >> 16) & 0xFF] ^ crc32_slice_table[0][two >> 24];
+
+        buffer += 8;
+        length -= 8;
+    }
+
+    while (length--)
+        crc = (crc >> 8) ^ crc32_table[(crc ^ *buffer++) & 0xFF];
+
+    return crc;
+}
+
+uint32_t calculate_crc32_slice8(const uint8_t* buffer, size_t length, uint32_t crc32)
+{
+    return crc32_slice8_update(buffer, length, crc32 ^ 0xFFFFFFFF) ^ 0xFFFFFFFF;
+}
+
+#if HASH_HAS_CLMUL
+
+/*
+    Folding with carry-less multiplies, after Intel's "Fast CRC Computation for Generic Polynomials Using
+    PCLMULQDQ Instruction". Four 128 bit lanes are folded 64 bytes at a time, folded down to one lane, then
+    reduced to 32 bits with a Barrett reduction. The constants are x^n mod P for the reflected polynomial.
+
+    Takes and returns the inverted crc. length must be at least 64 and a multiple of 16.
+*/
+HASH_TARGET_CLMUL static uint32_t crc32_clmul_update(const uint8_t* buffer, size_t length, uint32_t crc)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(buffer + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(buffer + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(buffer + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(buffer + 0x30));
+    __m128i x5;
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+
+    buffer += 64;
+    length -= 64;
+
+    // fold four lanes 64 bytes at a time
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(buffer + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buffer + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buffer + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buffer + 0x30)));
+
+        buffer += 64;
+        length -= 64;
+    }
+
+    // fold the four lanes into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // fold in what is left 16 bytes at a time
+    while (length >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buffer)), x5);
+
+        buffer += 16;
+        length -= 16;
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+uint32_t calculate_crc32_clmul(const uint8_t* buffer, size_t length, uint32_t crc32)
+{
+    uint32_t crc = crc32 ^ 0xFFFFFFFF;
+
+    if (length >= 64) {
+        const size_t folded = length & ~(size_t)15;
+        crc = crc32_clmul_update(buffer, folded, crc);
+        buffer += folded;
+        length -= folded;
+    }
+
+    return crc32_slice8_update(buffer, length, crc) ^ 0xFFFFFFFF;
+}
+
+bool r_crc32_cpu_has_clmul()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 1)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_PCLMUL) != 0;
+#endif
+}
+
+#endif // #if HASH_HAS_CLMUL
+
+uint32_t calculate_crc32_resolve(const uint8_t* buffer, size_t length, uint32_t crc32);
+
+static Crc32Function crc32_function = calculate_crc32_resolve;
+static const char* crc32_function_name = "bytewise";
+
+void r_crc32_initialize()
+{
+    for (int i = 0; i < 256; ++i)
+        crc32_slice_table[0][i] = crc32_table[i];
+
+    for (int i = 0; i < 256; ++i) {
+        for (int slice = 1; slice < 8; ++slice)
+            crc32_slice_table[slice][i] = (crc32_slice_table[slice - 1][i] >> 8) ^ crc32_table[crc32_slice_table[slice - 1][i] & 0xFF];
+    }
+
+    crc32_function = calculate_crc32_slice8;
+    crc32_function_name = "slice8";
+
+#if HASH_HAS_CLMUL
+    if (r_crc32_cpu_has_clmul()) {
+        crc32_function = calculate_crc32_clmul;
+        crc32_function_name = "clmul";
+    }
+#endif
+}
+
+uint32_t calculate_crc32_resolve(const uint8_t* buffer, size_t length, uint32_t crc32)
+{
+    r_crc32_initialize();
+    return crc32_function(buffer, length, crc32);
+}
+
+// crc32 continues from a previous call: pass 0 to start, or the result over the bytes before buffer
+uint32_t calculate_crc32(const uint8_t* buffer, size_t length, uint32_t crc32)
+{
+    return crc32_function(buffer, length, crc32);
+}
+
 uint32_t hash_data(const uint8_t* data, uint32_t length, uint32_t hash)
 {
     assert(data);
@@ -140,4 +359,100 @@ uint64_t murmur_hash_64(const void* key, uint32_t length, uint64_t seed)
     return h;
 }
 
+/*
+    Keyed hash for small fixed width keys, in the style of wyhash: each pair of 64 bit words goes through one
+    64x64->128 bit multiply whose halves are xored together. A few nanoseconds for a 32 byte key.
+
+    The seed is the key. With a secret seed an attacker cannot pick inputs that collide.
+*/
+
+static const uint64_t hash_secret[4] = { 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull };
+
+static inline uint64_t hash_mum(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    const __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t high;
+    const uint64_t low = _umul128(a, b, &high);
+    return low ^ high;
+#else
+    const uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+    const uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+    const uint64_t lowLow = aLow * bLow, lowHigh = aLow * bHigh, highLow = aHigh * bLow, highHigh = aHigh * bHigh;
+    const uint64_t middle = (lowLow >> 32) + (uint32_t)lowHigh + (uint32_t)highLow;
+    const uint64_t low = (middle << 32) | (uint32_t)lowLow;
+    const uint64_t high = highHigh + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+    return low ^ high;
+#endif
+}
+
+uint64_t hash_words_64(const uint64_t* words, int numWords, uint64_t seed)
+{
+    assert(words);
+    assert(numWords >= 0);
+
+    uint64_t h = seed ^ hash_secret[0];
+
+    int i = 0;
+    for (; i + 1 < numWords; i += 2)
+        h = hash_mum(words[i] ^ hash_secret[1], words[i + 1] ^ h);
+
+    if (i < numWords)
+        h = hash_mum(words[i] ^ hash_secret[2], h ^ hash_secret[1]);
+
+    return hash_mum(h ^ hash_secret[3], ((uint64_t)numWords * 8) ^ hash_secret[1]);
+}
+
+/*
+    SipHash-2-4 over 64 bit words, with a 128 bit key. Unlike hash_words_64 it is a MAC: without the key, an
+    attacker who sees any number of outputs cannot produce the output for another input.
+
+    Words are absorbed as they are, so the result matches reference SipHash over their little endian bytes.
+*/
+
+#define SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND(v0, v1, v2, v3)                                                   \
+    do {                                                                                 \
+        v0 += v1; v1 = SIPHASH_ROTL(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTL(v0, 32);       \
+        v2 += v3; v3 = SIPHASH_ROTL(v3, 16); v3 ^= v2;                                  \
+        v0 += v3; v3 = SIPHASH_ROTL(v3, 21); v3 ^= v0;                                  \
+        v2 += v1; v1 = SIPHASH_ROTL(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTL(v2, 32);       \
+    } while (0)
+
+uint64_t siphash_words_64(const uint64_t* words, int numWords, uint64_t k0, uint64_t k1)
+{
+    assert(words);
+    assert(numWords >= 0);
+
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+    uint64_t v3 = k1 ^ 0x7465646279746573ull;
+
+    for (int i = 0; i < numWords; ++i) {
+        v3 ^= words[i];
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        v0 ^= words[i];
+    }
+
+    // final block: no tail bytes, just the message length in the top byte
+    const uint64_t b = ((uint64_t)numWords * 8) << 56;
+    v3 ^= b;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "hash.h"
 #include "serializer.h"
+#include "bitpack.h"
 #include "utils.h"
 
 #define PacketBufferSize 256 // size of packet buffer, eg. number of historical packets for which we can buffer fragments
@@ -16,10 +17,11 @@ typedef unsigned int uint;
 typedef struct PacketInfo {
     bool rawFormat; // if true packets are written in "raw" format without crc32 (useful for encrypted packets).
     int prefixBytes; // prefix this number of bytes when reading and writing packets. stick your own data there.
-    uint32_t protocolId; // protocol id that distinguishes your protocol from other packets sent over UDP.
+    uint32_t protocolId; // protocol id that distinguishes your protocol from other packets sent over UDP. set with r_packet_info_set_protocol_id.
     // PacketFactory* packetFactory; // create packets and determine information about packet types. required.
     const uint8_t* allowedPacketTypes; // array of allowed packet types. if a packet type is not allowed the serialize read or write will fail.
     void* context; // context for the packet serialization (optional, pass in NULL)
+    uint32_t prefixCrc32; // crc32 of the protocol id and a zero crc32 field, the first 8 bytes DatagramCrc32 hashes
 } PacketInfo;
 
 enum TestPacketTypes {
@@ -32,7 +34,34 @@ enum TestPacketTypes {
     TEST_PACKET_NUM_TYPES
 };
 
-PacketInfo packetInfo;
+PacketInfo packetInfo = { false, 0, 0, NULL, NULL, 0x6522DF69 }; // 0x6522DF69: crc32 of protocol id 0 and a zero crc32 field
+
+// set the protocol id and the crc32 prefix that goes with it. call before any thread sends or receives
+void r_packet_info_set_protocol_id(PacketInfo* info, uint32_t protocolId)
+{
+    uint32_t prefix[2] = { host_to_network(protocolId), 0 };
+    info->protocolId = protocolId;
+    info->prefixCrc32 = calculate_crc32_bytewise((const uint8_t*)prefix, sizeof(prefix), 0);
+}
+
+/*
+    crc32 of a datagram: the protocol id, then the datagram with its crc32 field taken as zero.
+
+    The first 8 bytes hashed are the same for every datagram, so their crc32 is kept in packetInfo and only the body
+    after the crc32 field is hashed per call. packetInfo is only read here, so every thread can call this at once.
+*/
+uint32_t DatagramCrc32(const uint8_t* datagram, int numBytes)
+{
+    assert(numBytes >= 4);
+
+    return calculate_crc32(datagram + 4, numBytes - 4, packetInfo.prefixCrc32);
+}
+
+// patch the crc32 into the first word of a serialized datagram
+void WriteDatagramCrc32(uint8_t* datagram, int numBytes)
+{
+    *((uint32_t*)datagram) = host_to_network(DatagramCrc32(datagram, numBytes));
+}
 
 typedef struct {
     int x, y, z;
@@ -70,11 +99,10 @@ typedef struct TestPacketB {
 
 bool r_serialize_test_packet_b(Stream* stream, TestPacketB* packet)
 {
-    r_serialize_int(stream, &packet->numItems, 0, MaxItems);
-    for (int i = 0; i < packet->numItems; ++i) {
-        r_serialize_int(stream, &packet->items[i], -100, +100);
-    }
-    return true;
+    if (!r_serialize_int(stream, &packet->numItems, 0, MaxItems))
+        return false;
+
+    return r_serialize_int_array(stream, packet->items, packet->numItems, -100, +100);
 }
 
 void r_test_packet_b_fill(TestPacketB* packet)
@@ -125,7 +153,8 @@ bool r_serialize_fragment(Stream* stream, FragmentPacket* packet)
     r_serialize_bits(stream, &packet->fragmentId, 8);
     r_serialize_bits(stream, &packet->numFragments, 8);
 
-    serialize_align(stream);
+    if (!SerializeAlign(stream))
+        return false;
 
     if (stream->type == READ) {
         assert((GetBitsRemaining(stream) % 8) == 0);
@@ -139,7 +168,8 @@ bool r_serialize_fragment(Stream* stream, FragmentPacket* packet)
     assert(packet->fragmentSize > 0);
     assert(packet->fragmentSize <= MaxFragmentSize);
 
-    serialize_bytes(stream, packet->fragmentData, packet->fragmentSize);
+    if (!SerializeBytes(stream, packet->fragmentData, packet->fragmentSize))
+        return false;
 
     return true;
 }
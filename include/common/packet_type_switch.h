@@ -8,12 +8,12 @@
 #include "fragment.h"
 
 
-void packet_switch(int packet_type, Stream* readStream) {
+void packet_switch(PacketBuffer* p_buffer, int packet_type, Stream* readStream) {
 
 	switch (packet_type) {
     case 0:
         printf("Fragmented packet recieved.\n");
-        ProcessFragmentPacket(readStream);
+        ProcessFragmentPacket(p_buffer, readStream);
         break;
     case 1:
         printf("Packet Type A recieved\n");
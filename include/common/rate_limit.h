@@ -0,0 +1,225 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "address.h"
+#include "hash.h"
+
+/*
+    Per-source rate limiting.
+
+    Every source IP address gets a token bucket, checked before anything else looks at the datagram (crc32,
+    deserialization), so a source over its budget costs a hash and a cache line read.
+
+    Sources with connected clients get RateLimitConnectedRate per client. Everything else is handshake traffic and
+    gets RateLimitHandshakeRate. All handshake traffic together also has to fit in one shared bucket, so a flood from
+    many (spoofed) sources is capped as a whole and cannot crowd out connected clients.
+
+    The table is set associative: four 16 byte entries to a set, one cache line. A new source takes a free way or
+    evicts the handshake source in its set that was seen least recently. Sources with connected clients are never
+    evicted. The key is a keyed hash of the address, and only 16 bits of it are stored, so two sources can share a
+    bucket now and then. Nobody outside can choose to collide with a given source.
+*/
+
+#define RateLimitWays 4 // entries per set
+#define RateLimitMinEntries 4096 // smallest table
+
+#define RateLimitHandshakeRate 20.0 // packets per second from a source with no connected client
+#define RateLimitHandshakeBurst 40.0
+#define RateLimitHandshakeTotalRate 4000.0 // packets per second of handshake traffic from all sources together
+#define RateLimitHandshakeTotalBurst 8000.0
+#define RateLimitConnectedRate 500.0 // packets per second per connected client at a source
+#define RateLimitConnectedBurst 1000.0
+
+typedef struct RateLimitEntry {
+    double lastTime; // time tokens was last topped up
+    float tokens; // packets the source may still send
+    uint16_t tag; // 16 bits of the source's hash. 0 when the entry is free
+    uint16_t numConnected; // connected clients at this source
+} RateLimitEntry;
+
+typedef struct RateLimiterStats {
+    uint64_t numAllowed; // datagrams let through
+    uint64_t numDroppedSource; // datagrams dropped because their source was over its budget
+    uint64_t numDroppedHandshake; // datagrams dropped because handshake traffic as a whole was over its budget
+    uint64_t numEvicted; // sources pushed out of the table by a new one
+    uint64_t numUntracked; // datagrams from a new source whose set was full of connected sources
+} RateLimiterStats;
+
+typedef struct RateLimiter {
+    int m_numSets; // power of two
+    uint64_t m_seed; // key for the source hash
+    RateLimitEntry* m_entries; // RateLimitWays entries per set
+
+    double m_handshakeTokens; // shared bucket for all handshake traffic
+    double m_handshakeTime; // time m_handshakeTokens was last topped up
+
+    RateLimiterStats m_stats;
+} RateLimiter;
+
+// room for at least numSources sources
+bool r_rate_limiter_create(RateLimiter* limiter, int numSources, uint64_t seed)
+{
+    memset(limiter, 0, sizeof(RateLimiter));
+
+    int numEntries = RateLimitMinEntries;
+    while (numEntries < numSources)
+        numEntries *= 2;
+
+    limiter->m_entries = (RateLimitEntry*)calloc(numEntries, sizeof(RateLimitEntry));
+    if (!limiter->m_entries) {
+        printf("failed to allocate rate limiter for %d sources\n", numEntries);
+        return false;
+    }
+
+    limiter->m_numSets = numEntries / RateLimitWays;
+    limiter->m_seed = seed;
+    limiter->m_handshakeTokens = RateLimitHandshakeTotalBurst;
+
+    return true;
+}
+
+void r_rate_limiter_destroy(RateLimiter* limiter)
+{
+    free(limiter->m_entries);
+    memset(limiter, 0, sizeof(RateLimiter));
+}
+
+// the IP address only, so every port on a host shares a bucket
+uint64_t r_rate_limiter_hash(const RateLimiter* limiter, Address address)
+{
+    const uint64_t word = address.m_address_ipv4;
+    return hash_words_64(&word, 1, limiter->m_seed);
+}
+
+/*
+    Find the entry for a source. If it has none and insert is set, take a free way or evict the least recently seen
+    handshake source in the set. The new entry starts with a full handshake bucket. Returns NULL if there is no entry
+    and none could be made.
+*/
+RateLimitEntry* r_rate_limiter_find(RateLimiter* limiter, uint64_t hash, bool insert, double time)
+{
+    RateLimitEntry* set = &limiter->m_entries[(hash & (limiter->m_numSets - 1)) * RateLimitWays];
+
+    uint16_t tag = (uint16_t)(hash >> 48);
+    if (tag == 0)
+        tag = 1;
+
+    RateLimitEntry* victim = NULL;
+
+    for (int i = 0; i < RateLimitWays; ++i) {
+        if (set[i].tag == tag)
+            return &set[i];
+
+        if (set[i].numConnected != 0)
+            continue;
+
+        if (!victim || (victim->tag != 0 && (set[i].tag == 0 || set[i].lastTime < victim->lastTime)))
+            victim = &set[i];
+    }
+
+    if (!insert || !victim)
+        return NULL;
+
+    if (victim->tag != 0)
+        limiter->m_stats.numEvicted++;
+
+    victim->tag = tag;
+    victim->numConnected = 0;
+    victim->tokens = (float)RateLimitHandshakeBurst;
+    victim->lastTime = time;
+
+    return victim;
+}
+
+// top up a bucket for the time since it was last topped up. time going backwards adds nothing
+double r_rate_limiter_refill(double tokens, double lastTime, double time, double rate, double burst)
+{
+    if (time > lastTime)
+        tokens += (time - lastTime) * rate;
+    return tokens < burst ? tokens : burst;
+}
+
+// take one token for a datagram from address. false if the datagram should be dropped
+bool r_rate_limiter_allow(RateLimiter* limiter, Address address, double time)
+{
+    RateLimitEntry* entry = r_rate_limiter_find(limiter, r_rate_limiter_hash(limiter, address), true, time);
+
+    if (entry && entry->numConnected != 0) {
+        const double tokens = r_rate_limiter_refill(entry->tokens, entry->lastTime, time, RateLimitConnectedRate * entry->numConnected, RateLimitConnectedBurst * entry->numConnected);
+        entry->lastTime = time;
+
+        if (tokens < 1.0) {
+            entry->tokens = (float)tokens;
+            limiter->m_stats.numDroppedSource++;
+            return false;
+        }
+
+        entry->tokens = (float)(tokens - 1.0);
+        limiter->m_stats.numAllowed++;
+        return true;
+    }
+
+    if (entry) {
+        const double tokens = r_rate_limiter_refill(entry->tokens, entry->lastTime, time, RateLimitHandshakeRate, RateLimitHandshakeBurst);
+        entry->lastTime = time;
+        entry->tokens = (float)tokens;
+
+        if (tokens < 1.0) {
+            limiter->m_stats.numDroppedSource++;
+            return false;
+        }
+    } else {
+        limiter->m_stats.numUntracked++;
+    }
+
+    limiter->m_handshakeTokens = r_rate_limiter_refill(limiter->m_handshakeTokens, limiter->m_handshakeTime, time, RateLimitHandshakeTotalRate, RateLimitHandshakeTotalBurst);
+    limiter->m_handshakeTime = time;
+
+    if (limiter->m_handshakeTokens < 1.0) {
+        limiter->m_stats.numDroppedHandshake++;
+        return false;
+    }
+
+    limiter->m_handshakeTokens -= 1.0;
+    if (entry)
+        entry->tokens -= 1.0f;
+
+    limiter->m_stats.numAllowed++;
+    return true;
+}
+
+// a client at address connected. its source moves to the connected budget and stays in the table
+void r_rate_limiter_connect(RateLimiter* limiter, Address address, double time)
+{
+    RateLimitEntry* entry = r_rate_limiter_find(limiter, r_rate_limiter_hash(limiter, address), true, time);
+    if (!entry) {
+        printf("rate limiter has no room for a connected source\n");
+        return;
+    }
+
+    if (entry->numConnected == 0)
+        entry->tokens = (float)RateLimitConnectedBurst;
+
+    entry->numConnected++;
+    entry->lastTime = time;
+}
+
+void r_rate_limiter_disconnect(RateLimiter* limiter, Address address, double time)
+{
+    RateLimitEntry* entry = r_rate_limiter_find(limiter, r_rate_limiter_hash(limiter, address), false, time);
+    if (!entry || entry->numConnected == 0)
+        return;
+
+    entry->numConnected--;
+
+    if (entry->numConnected == 0 && entry->tokens > RateLimitHandshakeBurst)
+        entry->tokens = (float)RateLimitHandshakeBurst;
+}
+
+#endif
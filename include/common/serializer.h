@@ -291,12 +291,6 @@ bool SerializeAlign(Stream* stream)
     }
 }
 
-    #define serialize_align(stream)       \
-    do {                              \
-        if (!SerializeAlign(stream)) \
-            return false;             \
-    } while (0)
-
 
 
 
@@ -397,60 +391,159 @@ bool SerializeBytes(Stream* stream, uint8_t* data, int bytes)
             return false;
         }
         ReadBytes(stream, data, bytes);
-        stream->bits_processed += bytes * 8;
         return true;
     }
 }
 
 
-bool serialize_bytes_internal(Stream* stream, uint8_t* data, int bytes)
+bool r_serialize_uint64(Stream* stream, uint64_t* value)
 {
-    return SerializeBytes(stream, data, bytes);
+    uint32_t hi = 0, lo = 0;
+    if (stream->type == WRITE) {
+        lo = *value & 0xFFFFFFFF;
+        hi = *value >> 32;
+    }
+
+    if (!r_serialize_bits(stream, &lo, 32) || !r_serialize_bits(stream, &hi, 32))
+        return false;
+
+    if (stream->type == READ)
+        *value = ((uint64_t)(hi) << 32) | lo;
+
+    return true;
 }
 
-#define serialize_bytes(stream, data, bytes)                \
-    do {                                                    \
-        if (!serialize_bytes_internal(stream, data, bytes)) \
-            return false;                                   \
-    } while (0)
+/*
+    Variable length integers.
 
+    r_serialize_varint64 is LEB128: 7 bits of the value per group, least significant first, and the eighth bit of
+    a group set while more follow. Values below 128 take 8 bits, a full 64 bit value takes 80. The groups go
+    through the bit packer, so they do not have to be byte aligned; when they are, the bytes are plain LEB128.
 
-bool serialize_uint64_internal(Stream* stream, uint64_t* value)
+    r_serialize_gamma is the Elias gamma code of value + 1: floor(log2(value + 1)) zero bits, a one, then that many
+    low bits of value + 1. 0 takes one bit, 1 and 2 three, and it grows by two bits for every doubling, so it wins
+    for small counts that are usually tiny but have no useful upper bound.
+
+    r_serialize_relative sends current as its difference from previous, gamma coded. For sequence numbers and
+    counters that only go up, where the other side already has previous. The difference wraps at 32 bits, so a
+    sequence number wrapping around is still a small step.
+
+    Gamma cannot code 0xFFFFFFFF (value + 1 needs 33 bits), so writing it fails, and so does writing a relative value
+    one behind previous. Reads fail on a code that runs past the end of the stream or decodes to more bits than the
+    value has.
+*/
+
+bool r_serialize_varint64(Stream* stream, uint64_t* value)
 {
-    uint32_t hi, lo;
-    if (stream->type == WRITE) {
-        lo = *value & 0xFFFFFFFF;
-        hi = *value >> 32;
+    uint64_t remaining = stream->type == WRITE ? *value : 0;
+    uint64_t result = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint32_t group = 0;
+        if (stream->type == WRITE)
+            group = (uint32_t)(remaining & 0x7F) | (remaining >= 0x80 ? 0x80 : 0);
+
+        if (!r_serialize_bits(stream, &group, 8))
+            return false;
+
+        result |= (uint64_t)(group & 0x7F) << shift;
+        remaining >>= 7;
+
+        if ((group & 0x80) == 0) {
+            // the tenth group only has one bit of the value left
+            if (shift == 63 && group > 1)
+                return false;
+
+            if (stream->type == READ)
+                *value = result;
+            return true;
+        }
     }
 
-    r_serialize_bits(stream, &lo, 32);
-    r_serialize_bits(stream, &hi, 32);
+    return false;
+}
+
+bool r_serialize_varint32(Stream* stream, uint32_t* value)
+{
+    uint64_t uint64_value = 0;
+    if (stream->type == WRITE)
+        uint64_value = *value;
+
+    if (!r_serialize_varint64(stream, &uint64_value) || uint64_value > 0xFFFFFFFF)
+        return false;
 
     if (stream->type == READ)
-        *value = ((uint64_t)(hi) << 32) | lo;
+        *value = (uint32_t)uint64_value;
 
     return true;
 }
 
-bool serialize_uint64(Stream* stream, uint64_t* value)
+// fails to write 0xFFFFFFFF
+bool r_serialize_gamma(Stream* stream, uint32_t* value)
 {
-    do {
-        if (!serialize_uint64_internal(stream, value))
+    uint64_t coded = 0;
+    int numBits = 0;
+
+    if (stream->type == WRITE) {
+        if (*value == 0xFFFFFFFF)
             return false;
-    } while (0);
+
+        coded = (uint64_t)*value + 1;
+        while (coded >> (numBits + 1))
+            numBits++;
+
+        // numBits zeros, then the leading one
+        uint32_t prefix = 1u << numBits;
+        r_stream_write_bits(stream, prefix, numBits + 1);
+    }
+
+    if (stream->type == READ) {
+        for (;;) {
+            uint32_t bit = 0;
+            if (!r_serialize_bits(stream, &bit, 1))
+                return false;
+            if (bit)
+                break;
+            if (++numBits > 31)
+                return false;
+        }
+    }
+
+    uint32_t low = (uint32_t)coded & ((1u << numBits) - 1);
+    if (numBits > 0 && !r_serialize_bits(stream, &low, numBits))
+        return false;
+
+    if (stream->type == READ)
+        *value = (uint32_t)((((uint64_t)1 << numBits) | low) - 1);
+
+    return true;
 }
-    
 
+// fails to write current one behind previous: that difference is the one value gamma cannot code
+bool r_serialize_relative(Stream* stream, uint32_t previous, uint32_t* current)
+{
+    uint32_t difference = 0;
+    if (stream->type == WRITE)
+        difference = *current - previous;
+
+    if (!r_serialize_gamma(stream, &difference))
+        return false;
+
+    if (stream->type == READ)
+        *current = previous + difference;
 
-#define serialize_enum(stream, value, enum_type, num_entries)           \
+    return true;
+}
+
+#define r_serialize_enum(stream, value, enum_type, num_entries)         \
     do {                                                                \
-        int32_t int_value;                                              \
-        if (stream->type == WRITE)                                       \
+        int32_t int_value = 0;                                          \
+        if (stream->type == WRITE)                                      \
             int_value = value;                                          \
         r_serialize_int(stream, &int_value, 0, num_entries - 1);        \
-        if (stream->type == READ)                                        \
-            value = (enum_type)value;                                   \
-    } while (0) 
+        if (stream->type == READ)                                       \
+            value = (enum_type)int_value;                               \
+    } while (0)
 
 
 
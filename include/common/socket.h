@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <assert.h>
+#include <string.h>
 
 #include "address.h"
 #include "packet.h"
@@ -11,13 +13,21 @@
 
 typedef int SocketHandle;
 
+struct UringSocket;
+
 typedef struct Socket {
     uint16_t m_port;
     SocketHandle m_socket;
+    struct UringSocket* m_uring; // io_uring attached with r_uring_create. NULL uses plain socket calls
+    bool m_gso; // kernel accepts UDP_SEGMENT on this socket. set by r_socket_init, cleared if a segmented send fails
+    bool m_gro; // UDP_GRO enabled with r_socket_enable_gro. one receive may hold several coalesced datagrams
 } Socket;
 
 bool r_sockets_initialize()
 {
+    // pick the crc32 implementation before any thread starts hashing datagrams
+    r_crc32_initialize();
+
 #if PLATFORM == PLATFORM_WINDOWS
     WSADATA WsaData;
     return WSAStartup(MAKEWORD(2, 2),
@@ -35,7 +45,22 @@ void r_sockets_shutdown()
 #endif
 }
 
-bool r_socket_create(SocketHandle* handle, unsigned short port)
+void r_socket_destroy(SocketHandle* socket)
+{
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+    close(*socket);
+#elif PLATFORM == PLATFORM_WINDOWS
+    closesocket(*socket);
+#endif
+}
+
+typedef enum {
+    SOCKET_OPTION_NONE = 0,
+    SOCKET_OPTION_REUSE_PORT = 1 // share the port with other sockets (SO_REUSEPORT). the kernel spreads flows across them by 4-tuple hash
+} SocketOption;
+
+// create a non-blocking UDP socket bound to port. options is a mask of SocketOption flags
+bool r_socket_create_ex(SocketHandle* handle, unsigned short port, int options)
 {
     *handle = socket(AF_INET,
         SOCK_DGRAM,
@@ -46,6 +71,26 @@ bool r_socket_create(SocketHandle* handle, unsigned short port)
         return false;
     }
 
+    if (options & SOCKET_OPTION_REUSE_PORT) {
+#if defined(SO_REUSEPORT)
+        int reusePort = 1;
+        if (setsockopt(*handle,
+                SOL_SOCKET,
+                SO_REUSEPORT,
+                (const char*)&reusePort,
+                sizeof(reusePort))
+            < 0) {
+            printf("failed to set SO_REUSEPORT\n");
+            r_socket_destroy(handle);
+            return false;
+        }
+#else
+        printf("SO_REUSEPORT is not supported on this platform\n");
+        r_socket_destroy(handle);
+        return false;
+#endif
+    }
+
     SOCKADDR_IN address;
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -61,12 +106,12 @@ bool r_socket_create(SocketHandle* handle, unsigned short port)
 
 #if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
 
-    int nonBlocking = 1;
-    if (fcntl(handle,
-            F_SETFL,
-            O_NONBLOCK,
-            nonBlocking)
-        == -1) {
+    int flags = fcntl(*handle, F_GETFL, 0);
+    if (flags == -1
+        || fcntl(*handle,
+               F_SETFL,
+               flags | O_NONBLOCK)
+            == -1) {
         printf("failed to set non-blocking\n");
         return false;
     }
@@ -87,92 +132,216 @@ bool r_socket_create(SocketHandle* handle, unsigned short port)
     return true;
 }
 
-void r_socket_destroy(SocketHandle* socket)
+bool r_socket_create(SocketHandle* handle, unsigned short port)
 {
-#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
-    close(socket);
-#elif PLATFORM == PLATFORM_WINDOWS
-    closesocket(*socket);
+    return r_socket_create_ex(handle, port, SOCKET_OPTION_NONE);
+}
+
+// batched send and receive with sendmmsg/recvmmsg (Linux)
+#if PLATFORM == PLATFORM_UNIX && defined(__linux__) && defined(MSG_WAITFORONE)
+#define SOCKET_HAS_MMSG 1
+#else
+#define SOCKET_HAS_MMSG 0
+#endif
+
+// io_uring backend (uring.h). needs headers new enough for multishot recvmsg
+#if SOCKET_HAS_MMSG && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
 #endif
+#endif
+
+#if SOCKET_HAS_MMSG && defined(IORING_RECV_MULTISHOT)
+#define SOCKET_HAS_IO_URING 1
+#else
+#define SOCKET_HAS_IO_URING 0
+#endif
+
+/*
+    UDP generic segmentation offload (Linux 4.18+).
+
+    A train of datagrams to one address, all the same size except a shorter last one, goes to the kernel as one
+    buffer plus a segment size (UDP_SEGMENT). The kernel splits it back into datagrams below the socket layer,
+    so the whole train costs one trip through the stack instead of one per datagram.
+*/
+#if SOCKET_HAS_MMSG
+#include <netinet/udp.h>
+#endif
+
+#if SOCKET_HAS_MMSG && defined(UDP_SEGMENT)
+#define SOCKET_HAS_GSO 1
+#else
+#define SOCKET_HAS_GSO 0
+#endif
+
+#define SocketMaxSegments 64 // UDP_MAX_SEGMENTS on older kernels
+#define SocketMaxSegmentBytes 65507 // largest IPv4 UDP payload, the limit for a whole train
+
+#if SOCKET_HAS_GSO
+
+typedef union SocketSegmentControl {
+    char buffer[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+} SocketSegmentControl;
+
+bool r_socket_probe_gso(SocketHandle handle)
+{
+    int segmentSize = 0;
+    socklen_t length = sizeof(segmentSize);
+    return getsockopt(handle, IPPROTO_UDP, UDP_SEGMENT, &segmentSize, &length) == 0;
 }
 
-const int MAX_PACKET_SIZE = 256;
-const int HEADER_SIZE = 4;
+// attach a UDP_SEGMENT control message to message. control must live until the send
+void r_socket_set_segment_size(struct msghdr* message, SocketSegmentControl* control, int segmentSize)
+{
+    memset(control, 0, sizeof(SocketSegmentControl));
+    message->msg_control = control->buffer;
+    message->msg_controllen = sizeof(control->buffer);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(message);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+    const uint16_t size = (uint16_t)segmentSize;
+    memcpy(CMSG_DATA(cmsg), &size, sizeof(uint16_t));
+}
 
-// SEND packets on socket TO address
-bool SendPacket(Socket socket, const Address destination, const void* packetData, int size)
+// errors meaning the kernel or the route cannot segment, as opposed to a bad destination
+bool r_socket_is_gso_error(int error)
 {
-    uint8_t buffer[2000];
+    return error == EIO || error == EINVAL || error == ENOPROTOOPT || error == EOPNOTSUPP || error == EMSGSIZE;
+}
 
-    SOCKADDR_IN socket_address;
-    memset(&socket_address, 0, sizeof(socket_address));
-    socket_address.sin_family = AF_INET;
-    socket_address.sin_addr.s_addr = destination.m_address_ipv4;
-    socket_address.sin_port = htons((unsigned short)destination.m_port);
-    
-    if (size > MaxFragmentSize) {
+// most datagrams of segmentSize bytes that fit in one segmented send
+int r_socket_max_segments(int segmentSize)
+{
+    const int maxSegments = SocketMaxSegmentBytes / segmentSize;
+    return maxSegments < SocketMaxSegments ? maxSegments : SocketMaxSegments;
+}
+
+#endif
+
+/*
+    UDP generic receive offload (Linux 5.0+).
+
+    With UDP_GRO on, the kernel coalesces a burst of same-size datagrams from one flow (eg. the fragments of a
+    large packet) into one receive and reports the segment size in a control message. Receivers split the
+    buffer back into datagrams. Receive buffers must hold SocketMaxCoalescedSize bytes.
+*/
+#if SOCKET_HAS_MMSG && defined(UDP_GRO)
+#define SOCKET_HAS_GRO 1
+#else
+#define SOCKET_HAS_GRO 0
+#endif
 
-        int numFragments;
-        PacketData fragmentPackets[MaxFragmentsPerPacket];
-        int sequence = 0;
-        SplitPacketIntoFragments(sequence, (uint8_t*)packetData, size, &numFragments, fragmentPackets);
+#define SocketMaxCoalescedSize 65535 // largest receive UDP_GRO can produce
 
-        for (int j = 0; j < numFragments; ++j) {
+#if SOCKET_HAS_GRO
 
-            int sent_bytes = sendto(socket.m_socket,
-                (const char*)fragmentPackets[j].data,
-                fragmentPackets[j].size,
-                0,
-                (SOCKADDR*)&socket_address,
-                sizeof(SOCKADDR_IN));
+typedef union SocketGroControl {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} SocketGroControl;
 
+// segment size from the control data of a received message. 0 if the kernel did not coalesce it
+int r_socket_read_segment_size(struct msghdr* message)
+{
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(message); cmsg; cmsg = CMSG_NXTHDR(message, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segmentSize;
+            memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(int));
+            return segmentSize;
         }
-            
-    } else {
-         printf("sending packet as a regular packet\n");
+    }
 
-         int remainder = size % 4;
-         if (remainder != 0) {
-            size = size + (4 - remainder);
-         }
+    return 0;
+}
 
-         int size_plus_crc = size + 4;
+#endif
 
-         Stream writeStream;
-         r_stream_write_init(&writeStream, buffer, size_plus_crc);
+// turn on UDP_GRO. slots passed to ReceivePacketBatch must then be SocketMaxCoalescedSize bytes
+bool r_socket_enable_gro(Socket* socket)
+{
+#if SOCKET_HAS_GRO
+    int enable = 1;
+    if (setsockopt(socket->m_socket, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable)) < 0)
+        return false;
 
-         uint32_t crc32 = 0;
-         r_serialize_bits(&writeStream, &crc32, 32);
-         serialize_bytes(&writeStream, (uint8_t*)packetData, size);
+    socket->m_gro = true;
+    return true;
+#else
+    return false;
+#endif
+}
 
-         FlushBits(&writeStream);
+// fill in a Socket for a handle from r_socket_create and probe which offloads the kernel supports for it
+void r_socket_init(Socket* socket, SocketHandle handle, unsigned short port)
+{
+    socket->m_port = port;
+    socket->m_socket = handle;
+    socket->m_uring = NULL;
+    socket->m_gro = false;
+#if SOCKET_HAS_GSO
+    socket->m_gso = r_socket_probe_gso(handle);
+#else
+    socket->m_gso = false;
+#endif
+}
 
-         int align_bits = GetAlignBits(&writeStream);
+const int MAX_PACKET_SIZE = 256;
+const int HEADER_SIZE = 4;
 
-         int numBytes = (writeStream.bits_processed + align_bits) / 8;
+/*
+    Write a regular (non-fragmented) packet into buffer as a datagram: [crc32][packet data padded to 4 bytes].
+    The crc32 covers the protocol id followed by the datagram with the crc32 field zeroed.
 
-         printf("numBytes: %d\n", numBytes);
+    This copies the packet. Use SendQueueBeginPacket to serialize straight into a send queue slot instead.
 
-         // do crc32 after the fact to include data
-         uint32_t network_protocolId = host_to_network(packetInfo.protocolId);
-         crc32 = calculate_crc32((uint8_t*)&network_protocolId, 4, 0);
-         crc32 = calculate_crc32(buffer, numBytes, crc32);
-         *((uint32_t*)(buffer)) = host_to_network(crc32);
+    Returns the number of bytes in the datagram.
+*/
+int WritePacketDatagram(uint8_t* buffer, const void* packetData, int size)
+{
+    const int paddedSize = (size + 3) & ~3;
 
-         int sent_bytes = sendto(socket.m_socket,
-            (const char*)buffer,
-            numBytes,
-            0,
-             (SOCKADDR*)&socket_address,
-            sizeof(SOCKADDR_IN));
-    }
+    *((uint32_t*)buffer) = 0;
+    memcpy(buffer + HEADER_SIZE, packetData, size);
+    memset(buffer + HEADER_SIZE + size, 0, paddedSize - size);
 
-    /*
-    if (sent_bytes != 256) {
-        printf("failed to send packet\n");
-        return false;
-    }
-    */
+    const int numBytes = HEADER_SIZE + paddedSize;
+
+    WriteDatagramCrc32(buffer, numBytes);
+
+    return numBytes;
+}
+
+/*
+    Serialize a packet straight into a datagram buffer: BeginPacketDatagram points stream just past the crc32,
+    FinishPacketDatagram flushes it, pads it to 4 bytes and writes the crc32.
+
+    Returns the number of bytes in the datagram.
+*/
+void BeginPacketDatagram(uint8_t* datagram, int capacity, Stream* stream)
+{
+    assert(capacity > HEADER_SIZE);
+
+    *((uint32_t*)datagram) = 0;
+    r_stream_write_init(stream, datagram + HEADER_SIZE, capacity - HEADER_SIZE);
+}
+
+int FinishPacketDatagram(uint8_t* datagram, Stream* stream)
+{
+    assert(stream->type == WRITE);
+    assert((uint8_t*)stream->data == datagram + HEADER_SIZE);
+
+    FlushBits(stream);
+
+    // the flushed stream ends on a whole word, so the padding is already zero
+    const int numBytes = HEADER_SIZE + ((GetBytesProcessed(stream) + 3) & ~3);
+
+    WriteDatagramCrc32(datagram, numBytes);
+
+    return numBytes;
 }
 
 // RECEIVE packets on socket FROM address
@@ -205,4 +374,639 @@ int ReceivePackets(Socket socket, Address* sender, void* packetData, int size)
     // process received packet
 }
 
-#endif
\ No newline at end of file
+/*
+    Batched receive.
+
+    Fills up to numSlots slots with one datagram each. On Linux this is a single recvmmsg call,
+    elsewhere it falls back to calling recvfrom until the socket would block or the slots run out.
+
+    Returns the number of slots filled. Zero means there was nothing to read. With UDP_GRO on a slot can
+    hold several datagrams, see ReceiveSlot::segmentSize.
+*/
+#define MaxReceiveBatch 64
+#define MaxDatagramSize (MaxFragmentSize + PacketFragmentHeaderBytes)
+
+typedef struct ReceiveSlot {
+    Address sender; // address the datagram came from. set on receive
+    uint8_t* data; // buffer to receive into. owned by the caller. with io_uring attached, set on receive to the ring buffer holding the datagram, valid until the next receive
+    int capacity; // size of the data buffer in bytes
+    int size; // number of bytes received. set on receive
+    int segmentSize; // size of each datagram in data. less than size when UDP_GRO coalesced several, the last may be shorter
+} ReceiveSlot;
+
+#if SOCKET_HAS_IO_URING
+int UringReceiveBatch(struct UringSocket* uring, ReceiveSlot slots[], int numSlots);
+#endif
+
+int ReceivePacketBatch(Socket socket, ReceiveSlot slots[], int numSlots)
+{
+    assert(numSlots > 0);
+    assert(numSlots <= MaxReceiveBatch);
+
+#if SOCKET_HAS_IO_URING
+    if (socket.m_uring)
+        return UringReceiveBatch(socket.m_uring, slots, numSlots);
+#endif
+
+#if SOCKET_HAS_MMSG
+
+    struct mmsghdr messages[MaxReceiveBatch];
+    struct iovec iovecs[MaxReceiveBatch];
+    SOCKADDR_IN addresses[MaxReceiveBatch];
+#if SOCKET_HAS_GRO
+    SocketGroControl controls[MaxReceiveBatch];
+#endif
+
+    memset(messages, 0, sizeof(struct mmsghdr) * numSlots);
+
+    for (int i = 0; i < numSlots; ++i) {
+        iovecs[i].iov_base = slots[i].data;
+        iovecs[i].iov_len = slots[i].capacity;
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(SOCKADDR_IN);
+#if SOCKET_HAS_GRO
+        if (socket.m_gro) {
+            messages[i].msg_hdr.msg_control = controls[i].buffer;
+            messages[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+        }
+#endif
+    }
+
+    int numReceived = recvmmsg(socket.m_socket, messages, numSlots, MSG_DONTWAIT, NULL);
+
+    if (numReceived <= 0)
+        return 0;
+
+    for (int i = 0; i < numReceived; ++i) {
+        slots[i].sender.m_address_ipv4 = addresses[i].sin_addr.s_addr;
+        slots[i].sender.m_port = ntohs(addresses[i].sin_port);
+        slots[i].size = (int)messages[i].msg_len;
+        slots[i].segmentSize = slots[i].size;
+#if SOCKET_HAS_GRO
+        if (socket.m_gro) {
+            const int segmentSize = r_socket_read_segment_size(&messages[i].msg_hdr);
+            if (segmentSize > 0)
+                slots[i].segmentSize = segmentSize;
+        }
+#endif
+    }
+
+    return numReceived;
+
+#else
+
+    int numReceived = 0;
+
+    while (numReceived < numSlots) {
+        ReceiveSlot* slot = &slots[numReceived];
+
+        int bytes = ReceivePackets(socket, &slot->sender, slot->data, slot->capacity);
+        if (bytes <= 0)
+            break;
+
+        slot->size = bytes;
+        slot->segmentSize = bytes;
+        numReceived++;
+    }
+
+    return numReceived;
+
+#endif
+}
+
+/*
+    Batched send.
+
+    Datagrams are collected in a send queue over the course of a tick and sent with
+    a single sendmmsg call when the queue is flushed. Other platforms fall back to one sendto per datagram.
+
+    If the kernel takes only part of the batch the rest is retried. If the socket buffer is full (would block)
+    the unsent datagrams stay queued for the next flush.
+
+    Where the kernel supports UDP GSO, consecutive datagrams to the same address with the same size (eg. the
+    fragments of a large packet) are merged into one segmented message within the batch.
+
+    Queued datagrams are packed back to back in one byte arena, each taking its own size rounded up to 4 rather
+    than a worst case MaxDatagramSize slot. Keep-alives and other control packets are a few dozen bytes, so many more
+    of them fit in a flush. The queue is flushed early when either the arena or the datagram count runs out.
+*/
+#define MaxSendQueuePackets 256
+#define SendQueueArenaSize (64 * MaxDatagramSize)
+
+typedef struct SendQueueStats {
+    uint64_t numFlushes; // number of flushes that had something to send
+    uint64_t numSyscalls; // number of sendmmsg/sendto calls made across all flushes
+    uint64_t numDatagramsSent; // datagrams accepted by the kernel
+    uint64_t numBytesSent; // bytes accepted by the kernel
+    uint64_t numPartialSends; // send calls where the kernel took fewer datagrams than asked
+    uint64_t numDropped; // datagrams dropped because of a send error or a full queue
+    uint64_t numSegmentedSends; // messages that carried a train of datagrams with UDP GSO
+
+    int lastFlushDatagrams; // datagrams sent by the most recent flush
+    int lastFlushSyscalls; // send calls made by the most recent flush
+    int lastFlushPending; // datagrams left queued by the most recent flush (socket would block)
+} SendQueueStats;
+
+typedef struct SendQueue {
+    Socket* m_socket; // socket the queue is flushed to
+
+    int m_numPackets; // number of queued datagrams
+
+    int m_arenaUsed; // bytes of m_arena taken by queued datagrams
+
+    int m_reserved; // bytes held for the datagram being written, by the last SendQueueReserve
+
+    Address m_address[MaxSendQueuePackets]; // destination of datagram n
+
+    int m_size[MaxSendQueuePackets]; // size of datagram n in bytes
+
+    int m_offset[MaxSendQueuePackets]; // where datagram n starts in m_arena. always a multiple of 4
+
+    uint8_t m_arena[SendQueueArenaSize]; // serialized datagrams, crc32 included
+
+    SendQueueStats m_stats;
+} SendQueue;
+
+int SendQueueFlush(SendQueue* queue);
+
+#if SOCKET_HAS_IO_URING
+int UringSendQueue(struct UringSocket* uring, SendQueue* queue);
+#endif
+
+void SendQueueInit(SendQueue* queue, Socket* socket)
+{
+    memset(queue, 0, sizeof(SendQueue));
+    queue->m_socket = socket;
+}
+
+uint8_t* SendQueueDatagramData(SendQueue* queue, int index)
+{
+    assert(index >= 0);
+    assert(index < queue->m_numPackets || (index == queue->m_numPackets && queue->m_reserved > 0));
+
+    return queue->m_arena + queue->m_offset[index];
+}
+
+bool SendQueueHasRoom(const SendQueue* queue, int numBytes)
+{
+    return queue->m_numPackets < MaxSendQueuePackets && queue->m_arenaUsed + numBytes <= SendQueueArenaSize;
+}
+
+// reserve numBytes for the next datagram. flushes first if the queue is full. the commit may use less
+uint8_t* SendQueueReserve(SendQueue* queue, Address address, int numBytes)
+{
+    assert(numBytes > 0);
+    assert(numBytes <= MaxDatagramSize);
+
+    numBytes = (numBytes + 3) & ~3;
+
+    if (!SendQueueHasRoom(queue, numBytes)) {
+        SendQueueFlush(queue);
+
+        if (!SendQueueHasRoom(queue, numBytes)) {
+            queue->m_stats.numDropped++;
+            queue->m_reserved = 0;
+            return NULL;
+        }
+    }
+
+    queue->m_address[queue->m_numPackets] = address;
+    queue->m_offset[queue->m_numPackets] = queue->m_arenaUsed;
+    queue->m_reserved = numBytes;
+
+    return queue->m_arena + queue->m_arenaUsed;
+}
+
+void SendQueueCommit(SendQueue* queue, int size)
+{
+    assert(size > 0);
+    assert(size <= queue->m_reserved);
+    assert(queue->m_numPackets < MaxSendQueuePackets);
+
+    queue->m_size[queue->m_numPackets] = size;
+    queue->m_arenaUsed += (size + 3) & ~3;
+    queue->m_reserved = 0;
+    queue->m_numPackets++;
+}
+
+// bytes in the datagram for a packet of numBits bits: the crc32 word, then the packet padded to 4 bytes
+int PacketDatagramSize(int numBits)
+{
+    assert(numBits >= 0);
+
+    return HEADER_SIZE + ((numBits + 31) / 32) * 4;
+}
+
+// bytes in the datagram for a fragment carrying fragmentSize bytes, rounded up to the words the stream flushes
+int FragmentDatagramSize(int fragmentSize)
+{
+    return (PacketFragmentHeaderBytes + fragmentSize + 3) & ~3;
+}
+
+// queue an already serialized packet. large packets are split into fragments written straight into the queue
+bool SendQueuePacket(SendQueue* queue, Address address, const void* packetData, int size)
+{
+    if (size > MaxFragmentSize) {
+
+        assert(size < MaxPacketSize);
+
+        const int numFragments = (size / MaxFragmentSize) + ((size % MaxFragmentSize) != 0 ? 1 : 0);
+        const uint16_t sequence = 0;
+
+        bool result = true;
+
+        for (int i = 0; i < numFragments; ++i) {
+            const int offset = i * MaxFragmentSize;
+            const int fragmentSize = (i == numFragments - 1) ? size - offset : MaxFragmentSize;
+
+            uint8_t* slot = SendQueueReserve(queue, address, FragmentDatagramSize(fragmentSize));
+            if (!slot) {
+                result = false;
+                continue;
+            }
+
+            SendQueueCommit(queue, WriteFragmentDatagram(slot, sequence, i, numFragments, (const uint8_t*)packetData + offset, fragmentSize));
+        }
+
+        return result;
+    }
+
+    uint8_t* slot = SendQueueReserve(queue, address, PacketDatagramSize(size * 8));
+    if (!slot)
+        return false;
+
+    SendQueueCommit(queue, WritePacketDatagram(slot, packetData, size));
+
+    return true;
+}
+
+/*
+    Serialize a packet straight into the send queue.
+
+    Measure the packet first (MeasureStream in stream.hpp gives the exact bit count without writing anything), then
+    SendQueueBeginPacket reserves exactly the datagram that many bits need and points stream just past the crc32
+    word. Serialize the packet into stream, then call SendQueueFinishPacket to flush the stream, patch the crc32 in
+    place and queue the datagram. Nothing is copied. A packet that is begun but never finished is not sent.
+
+    Packets written this way must fit in MaxFragmentSize bytes. The measured size says up front whether a packet
+    does; bigger ones go through SendQueuePacket.
+*/
+bool SendQueueBeginPacket(SendQueue* queue, Address address, int numBits, Stream* stream)
+{
+    assert(numBits <= MaxFragmentSize * 8);
+
+    const int numBytes = PacketDatagramSize(numBits);
+
+    uint8_t* slot = SendQueueReserve(queue, address, numBytes);
+    if (!slot)
+        return false;
+
+    BeginPacketDatagram(slot, numBytes, stream);
+
+    return true;
+}
+
+void SendQueueFinishPacket(SendQueue* queue, Stream* stream)
+{
+    assert(queue->m_numPackets < MaxSendQueuePackets);
+
+    SendQueueCommit(queue, FinishPacketDatagram(SendQueueDatagramData(queue, queue->m_numPackets), stream));
+}
+
+// queue a datagram that is already complete, crc32 and all. eg. a cached control packet
+bool SendQueueDatagram(SendQueue* queue, Address address, const uint8_t* datagram, int numBytes)
+{
+    uint8_t* slot = SendQueueReserve(queue, address, numBytes);
+    if (!slot)
+        return false;
+
+    memcpy(slot, datagram, numBytes);
+    SendQueueCommit(queue, numBytes);
+
+    return true;
+}
+
+#if SOCKET_HAS_GSO
+
+// length of the run of queued datagrams starting at first that can go out as one GSO train: same destination,
+// all the size of the first except a shorter last one, within the kernel's segment and byte limits
+int SendQueueSegmentRun(const SendQueue* queue, int first)
+{
+    const int segmentSize = queue->m_size[first];
+    const int maxSegments = r_socket_max_segments(segmentSize);
+    const Address address = queue->m_address[first];
+
+    int count = 1;
+
+    while (first + count < queue->m_numPackets && count < maxSegments) {
+        const int next = first + count;
+
+        if (queue->m_address[next].m_address_ipv4 != address.m_address_ipv4 || queue->m_address[next].m_port != address.m_port)
+            break;
+
+        if (queue->m_size[next] > segmentSize)
+            break;
+
+        count++;
+
+        // a shorter datagram can only be the last segment
+        if (queue->m_size[next] < segmentSize)
+            break;
+    }
+
+    return count;
+}
+
+#endif
+
+int SendQueueFlush(SendQueue* queue)
+{
+    assert(queue->m_socket);
+
+    SendQueueStats* stats = &queue->m_stats;
+
+    stats->lastFlushDatagrams = 0;
+    stats->lastFlushSyscalls = 0;
+    stats->lastFlushPending = 0;
+
+    if (queue->m_numPackets == 0)
+        return 0;
+
+    stats->numFlushes++;
+
+#if SOCKET_HAS_IO_URING
+    if (queue->m_socket->m_uring)
+        return UringSendQueue(queue->m_socket->m_uring, queue);
+#endif
+
+    int numSent = 0;
+
+#if SOCKET_HAS_MMSG
+
+    struct mmsghdr messages[MaxSendQueuePackets];
+    struct iovec iovecs[MaxSendQueuePackets];
+    SOCKADDR_IN addresses[MaxSendQueuePackets];
+    int messageDatagrams[MaxSendQueuePackets]; // datagrams carried by message n. more than one is a GSO train
+#if SOCKET_HAS_GSO
+    SocketSegmentControl controls[MaxSendQueuePackets];
+#endif
+
+    memset(addresses, 0, sizeof(SOCKADDR_IN) * queue->m_numPackets);
+
+    for (int i = 0; i < queue->m_numPackets; ++i) {
+        addresses[i].sin_family = AF_INET;
+        addresses[i].sin_addr.s_addr = queue->m_address[i].m_address_ipv4;
+        addresses[i].sin_port = htons((unsigned short)queue->m_address[i].m_port);
+
+        iovecs[i].iov_base = queue->m_arena + queue->m_offset[i];
+        iovecs[i].iov_len = queue->m_size[i];
+    }
+
+    while (numSent < queue->m_numPackets) {
+
+        // one message per datagram, except trains of same size datagrams to one address which share a message
+        int numMessages = 0;
+        for (int i = numSent; i < queue->m_numPackets; i += messageDatagrams[numMessages++]) {
+            struct msghdr* message = &messages[numMessages].msg_hdr;
+            memset(message, 0, sizeof(struct msghdr));
+            message->msg_name = &addresses[i];
+            message->msg_namelen = sizeof(SOCKADDR_IN);
+            message->msg_iov = &iovecs[i];
+            message->msg_iovlen = 1;
+            messageDatagrams[numMessages] = 1;
+
+#if SOCKET_HAS_GSO
+            if (queue->m_socket->m_gso) {
+                const int count = SendQueueSegmentRun(queue, i);
+                if (count > 1) {
+                    message->msg_iovlen = count;
+                    r_socket_set_segment_size(message, &controls[numMessages], queue->m_size[i]);
+                    messageDatagrams[numMessages] = count;
+                }
+            }
+#endif
+        }
+
+        int result = sendmmsg(queue->m_socket->m_socket, messages, numMessages, MSG_DONTWAIT);
+
+        stats->numSyscalls++;
+        stats->lastFlushSyscalls++;
+
+        if (result < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+
+#if SOCKET_HAS_GSO
+            // the kernel or the route cannot segment. stop using GSO on this socket and resend the train as plain datagrams
+            if (messageDatagrams[0] > 1 && r_socket_is_gso_error(errno)) {
+                printf("segmented send failed (errno = %d). disabling UDP GSO on this socket\n", errno);
+                queue->m_socket->m_gso = false;
+                continue;
+            }
+#endif
+
+            // the message at the head of the batch is bad (eg. unreachable). drop it and carry on
+            printf("sendmmsg failed (errno = %d). dropping datagram\n", errno);
+            stats->numDropped += messageDatagrams[0];
+            numSent += messageDatagrams[0];
+            continue;
+        }
+
+        if (result < numMessages)
+            stats->numPartialSends++;
+
+        for (int i = 0; i < result; ++i) {
+            stats->numBytesSent += messages[i].msg_len;
+            stats->numDatagramsSent += messageDatagrams[i];
+            stats->lastFlushDatagrams += messageDatagrams[i];
+            if (messageDatagrams[i] > 1)
+                stats->numSegmentedSends++;
+            numSent += messageDatagrams[i];
+        }
+    }
+
+#else
+
+    SOCKADDR_IN socket_address;
+    memset(&socket_address, 0, sizeof(socket_address));
+    socket_address.sin_family = AF_INET;
+
+    while (numSent < queue->m_numPackets) {
+        socket_address.sin_addr.s_addr = queue->m_address[numSent].m_address_ipv4;
+        socket_address.sin_port = htons((unsigned short)queue->m_address[numSent].m_port);
+
+        int sent_bytes = sendto(queue->m_socket->m_socket,
+            (const char*)(queue->m_arena + queue->m_offset[numSent]),
+            queue->m_size[numSent],
+            0,
+            (SOCKADDR*)&socket_address,
+            sizeof(SOCKADDR_IN));
+
+        stats->numSyscalls++;
+        stats->lastFlushSyscalls++;
+
+        if (sent_bytes < 0) {
+#if PLATFORM == PLATFORM_WINDOWS
+            if (WSAGetLastError() == WSAEWOULDBLOCK)
+                break;
+#else
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+#endif
+            stats->numDropped++;
+            numSent++;
+            continue;
+        }
+
+        stats->numBytesSent += sent_bytes;
+        stats->numDatagramsSent++;
+        stats->lastFlushDatagrams++;
+        numSent++;
+    }
+
+#endif
+
+    // anything the kernel would not take yet moves to the front of the queue for the next flush
+    const int numPending = queue->m_numPackets - numSent;
+    if (numPending > 0 && numSent > 0) {
+        memmove(queue->m_address, queue->m_address + numSent, numPending * sizeof(Address));
+        memmove(queue->m_size, queue->m_size + numSent, numPending * sizeof(int));
+
+        const int start = queue->m_offset[numSent];
+        memmove(queue->m_arena, queue->m_arena + start, queue->m_arenaUsed - start);
+        for (int i = 0; i < numPending; ++i)
+            queue->m_offset[i] = queue->m_offset[numSent + i] - start;
+        queue->m_arenaUsed -= start;
+    } else if (numPending == 0) {
+        queue->m_arenaUsed = 0;
+    }
+
+    queue->m_numPackets = numPending;
+    stats->lastFlushPending = numPending;
+
+    return stats->lastFlushDatagrams;
+}
+
+// SEND one datagram on socket TO address right away. false if it was not sent whole
+bool SendDatagram(Socket* socket, const Address destination, const uint8_t* datagram, int numBytes)
+{
+    SOCKADDR_IN socket_address;
+    memset(&socket_address, 0, sizeof(socket_address));
+    socket_address.sin_family = AF_INET;
+    socket_address.sin_addr.s_addr = destination.m_address_ipv4;
+    socket_address.sin_port = htons((unsigned short)destination.m_port);
+
+    int sent_bytes = sendto(socket->m_socket, (const char*)datagram, numBytes, 0, (SOCKADDR*)&socket_address, sizeof(SOCKADDR_IN));
+
+    return sent_bytes == numBytes;
+}
+
+/*
+    SEND a run of datagrams from one buffer on socket TO address. Datagram n starts at train + n * MaxDatagramSize
+    and is sizes[n] bytes. Every size but the last must be the same. With GSO the run is one segmented sendmsg,
+    otherwise one sendto per datagram. A segmented send the kernel or the route cannot take turns GSO off for the
+    socket and the run goes again as plain datagrams.
+*/
+bool SendDatagramTrain(Socket* socket, const Address destination, const uint8_t* train, const int sizes[], int count)
+{
+    assert(count > 0);
+    assert(count <= SocketMaxSegments);
+
+#if SOCKET_HAS_GSO
+    if (count > 1 && socket->m_gso) {
+        struct iovec iovecs[SocketMaxSegments];
+        for (int i = 0; i < count; ++i) {
+            assert(i == count - 1 || sizes[i] == sizes[0]);
+            iovecs[i].iov_base = (void*)(train + i * MaxDatagramSize);
+            iovecs[i].iov_len = sizes[i];
+        }
+
+        SOCKADDR_IN socket_address;
+        memset(&socket_address, 0, sizeof(socket_address));
+        socket_address.sin_family = AF_INET;
+        socket_address.sin_addr.s_addr = destination.m_address_ipv4;
+        socket_address.sin_port = htons((unsigned short)destination.m_port);
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_name = &socket_address;
+        message.msg_namelen = sizeof(SOCKADDR_IN);
+        message.msg_iov = iovecs;
+        message.msg_iovlen = count;
+
+        SocketSegmentControl control;
+        r_socket_set_segment_size(&message, &control, sizes[0]);
+
+        if (sendmsg(socket->m_socket, &message, 0) >= 0)
+            return true;
+
+        if (!r_socket_is_gso_error(errno))
+            return false;
+
+        printf("segmented send failed (errno = %d). disabling UDP GSO on this socket\n", errno);
+        socket->m_gso = false;
+    }
+#endif
+
+    bool result = true;
+
+    for (int i = 0; i < count; ++i) {
+        if (!SendDatagram(socket, destination, train + i * MaxDatagramSize, sizes[i]))
+            result = false;
+    }
+
+    return result;
+}
+
+/*
+    SEND a packet on socket TO address right away. Frames and fragments it exactly like SendQueuePacket, without a
+    send queue. The fragments of a large packet are all MaxFragmentSize but the last, so they are written side by
+    side into one buffer and go out as trains of up to r_socket_max_segments fragments: one syscall per train with
+    GSO, one per fragment without it.
+*/
+bool SendPacket(Socket* socket, const Address destination, const void* packetData, int size)
+{
+    if (size <= MaxFragmentSize) {
+        uint8_t datagram[MaxDatagramSize];
+        return SendDatagram(socket, destination, datagram, WritePacketDatagram(datagram, packetData, size));
+    }
+
+    assert(size < MaxPacketSize);
+
+    const int numFragments = (size / MaxFragmentSize) + ((size % MaxFragmentSize) != 0 ? 1 : 0);
+    const uint16_t sequence = 0;
+
+#if SOCKET_HAS_GSO
+    const int maxTrain = r_socket_max_segments(MaxDatagramSize);
+#else
+    const int maxTrain = SocketMaxSegments;
+#endif
+
+    // each fragment gets a whole MaxDatagramSize slot, so it starts word aligned for the stream writing it
+    uint8_t train[SocketMaxSegments * MaxDatagramSize];
+    int sizes[SocketMaxSegments];
+
+    bool result = true;
+
+    for (int first = 0; first < numFragments; first += maxTrain) {
+        const int count = numFragments - first < maxTrain ? numFragments - first : maxTrain;
+
+        for (int i = 0; i < count; ++i) {
+            const int offset = (first + i) * MaxFragmentSize;
+            const int fragmentSize = (first + i == numFragments - 1) ? size - offset : MaxFragmentSize;
+
+            sizes[i] = WriteFragmentDatagram(train + i * MaxDatagramSize, sequence, first + i, numFragments, (const uint8_t*)packetData + offset, fragmentSize);
+        }
+
+        if (!SendDatagramTrain(socket, destination, train, sizes, count))
+            result = false;
+    }
+
+    return result;
+}
+
+#include "uring.h"
+
+#endif
@@ -1,15 +1,39 @@
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
-#include <algorithm>
 
-typedef struct Buffer {
-    uint8_t* data; // pointer to buffer data
-    int size;      // size of buffer data (bytes)
-    int index;     // index of next byte to be read/written
-} Buffer;
+#include "serializer.h"
+#include "bitpack.h"
+
+/*
+    Compile-time streams.
+
+    The r_serialize_* functions in serializer.h check stream->type on every field. WriteStream, ReadStream and
+    MeasureStream give each direction its own class instead, and a packet's serialize function is a template over
+    the stream:
 
+        template <typename Stream>
+        bool SerializeFoo(Stream& stream, Foo* foo)
+        {
+            serialize_int(stream, foo->count, 0, 100);
+            serialize_uint64(stream, foo->salt);
+            return true;
+        }
 
+    The same function body is then compiled once per stream class, and each copy has the direction fixed, so the
+    compiler drops the branches and inlines the bit packing.
+
+    WriteStream and ReadStream wrap a Stream set up by r_stream_write_init / r_stream_read_init (or
+    BeginPacketDatagram) and put the same bits on the wire as the r_serialize_* functions. MeasureStream writes
+    nothing and only counts the bits a write would take, so a packet can be sized exactly (MeasureBits) before a
+    buffer is reserved for it.
+
+    The serialize_* macros below return false from the enclosing function when a field does not fit. They expect the
+    stream template parameter to be called Stream.
+*/
 
 template <uint32_t x>
 struct PopCount {
@@ -39,280 +63,473 @@ struct BitsRequired {
 
 #define BITS_REQUIRED(min, max) BitsRequired<min, max>::result
 
+// bits_required without the floating point log2. folds to a constant when min and max are
+inline int StreamBitsRequired(int32_t min, int32_t max)
+{
+    uint32_t range = (uint32_t)max - (uint32_t)min;
+    int bits = 0;
+    while (range) {
+        bits++;
+        range >>= 1;
+    }
+    return bits;
+}
 
-const int MaxElements = 32;
-
-class BitWriter {
+class WriteStream {
 public:
-    BitWriter(uint8_t* buffer, int bytes)
-        : buffer(buffer)
-        , m_bytes(bytes)
-        , word_index(0)
-        , scratch(0)
-        , scratch_bits(0)
+    enum { IsWriting = 1 };
+    enum { IsReading = 0 };
+
+    explicit WriteStream(Stream* stream)
+        : m_stream(stream)
     {
+        assert(stream->type == WRITE);
     }
-    
 
-    void WriteBits(uint32_t value, int bits)
+    bool SerializeBits(uint32_t value, int bits)
     {
-        scratch |= (uint64_t)value << scratch_bits;
-        scratch_bits += bits;
+        assert(bits > 0);
+        assert(bits <= 32);
+        assert(bits == 32 || value < (1u << bits));
 
-        while (scratch_bits >= 32) {
-            buffer[word_index++] = (uint32_t)scratch;
-            scratch >>= 32;
-            scratch_bits -= 32;
-        }
+        r_stream_write_bits(m_stream, value, bits);
+        return true;
     }
 
-    void Flush()
+    bool SerializeInteger(int32_t value, int32_t min, int32_t max)
     {
-        if (scratch_bits != 0) {
-            assert(word_index < m_bytes / 4);
-            buffer[word_index] = uint32_t(scratch & 0xFFFFFFFF);
-            word_index++;
-        }
+        assert(min < max);
+        assert(value >= min);
+        assert(value <= max);
+
+        r_stream_write_bits(m_stream, (uint32_t)value - (uint32_t)min, StreamBitsRequired(min, max));
+        return true;
+    }
+
+    bool SerializeUint64(uint64_t value)
+    {
+        r_stream_write_bits(m_stream, (uint32_t)(value & 0xFFFFFFFF), 32);
+        r_stream_write_bits(m_stream, (uint32_t)(value >> 32), 32);
+        return true;
+    }
+
+    bool SerializeAlign()
+    {
+        WriteAlign(m_stream);
+        return true;
+    }
+
+    bool SerializeBytes(const uint8_t* data, int bytes)
+    {
+        assert(data);
+        assert(bytes >= 0);
+
+        WriteAlign(m_stream);
+        WriteBytes(m_stream, data, bytes);
+        return true;
+    }
+
+    // count values in [min, max], packed by the kernels in bitpack.h. same bits as count SerializeInteger calls
+    bool SerializeIntArray(const int32_t* values, int count, int32_t min, int32_t max)
+    {
+        assert(min < max);
+        assert(count >= 0);
+
+        if (count > 0)
+            r_bitpack_write(m_stream, values, count, min, StreamBitsRequired(min, max));
+        return true;
     }
-    
+
+    int GetBitsProcessed() const { return m_stream->bits_processed; }
+
+    int GetBytesProcessed() const { return (m_stream->bits_processed + 7) / 8; }
+
+    int GetBitsRemaining() const { return m_stream->num_bits - m_stream->bits_processed; }
 
 private:
-    uint8_t* buffer;
-    int m_bytes;
-    int word_index = 0;
-    uint64_t scratch;
-    int scratch_bits;
+    Stream* m_stream;
 };
 
-class BitReader {
+class ReadStream {
 public:
-    BitReader(const uint8_t* buffer, int bytes)
-        : m_buffer(buffer)
-        , m_bytes(bytes)
-        , total_bits(bytes * 8)
-        , num_bits_read(0)
-        , word_index(0)
-        , scratch(0)
-        , scratch_bits(0)
+    enum { IsWriting = 0 };
+    enum { IsReading = 1 };
+
+    explicit ReadStream(Stream* stream)
+        : m_stream(stream)
     {
+        assert(stream->type == READ);
     }
 
-    uint32_t ReadBits(int bits)
+    bool SerializeBits(uint32_t& value, int bits)
     {
-        uint32_t result = 0;
+        assert(bits > 0);
+        assert(bits <= 32);
 
-        while (bits > 0) {
-            if (scratch_bits == 0 || bits > scratch_bits) {
-                // Read the next word into scratch
-                uint32_t word = m_buffer[word_index];
-                scratch |= (uint64_t)word << scratch_bits;
-                scratch_bits += 32;
-                word_index++;
-            }
+        if (WouldReadPastEnd(bits))
+            return false;
 
-            // Calculate the number of bits to read from scratch
-            int bits_to_read = (bits < scratch_bits) ? bits : scratch_bits;
+        value = r_stream_read_bits(m_stream, bits);
+        return true;
+    }
 
-            // Extract the bits from scratch
-            uint32_t extracted_bits = scratch & ((1ULL << bits_to_read) - 1);
+    bool SerializeInteger(int32_t& value, int32_t min, int32_t max)
+    {
+        assert(min < max);
 
-            // Update scratch and scratch_bits
-            scratch >>= bits_to_read;
-            scratch_bits -= bits_to_read;
+        const int bits = StreamBitsRequired(min, max);
 
-            // Update the result with the extracted bits
-            result |= (extracted_bits << (bits - bits_to_read));
+        if (WouldReadPastEnd(bits))
+            return false;
 
-            // Update the number of bits left to read
-            bits -= bits_to_read;
-        }
+        value = (int32_t)(r_stream_read_bits(m_stream, bits) + (uint32_t)min);
 
-        num_bits_read += bits;
-        return result;
+        return value >= min && value <= max;
     }
 
-    bool WouldReadPastEnd(int bits) {
-        if (num_bits_read + bits > total_bits) {
-            return true;
-        }
-        return false;
+    bool SerializeUint64(uint64_t& value)
+    {
+        if (WouldReadPastEnd(64))
+            return false;
+
+        const uint32_t lo = r_stream_read_bits(m_stream, 32);
+        const uint32_t hi = r_stream_read_bits(m_stream, 32);
+        value = ((uint64_t)hi << 32) | lo;
+        return true;
     }
 
-public:
-    const uint8_t* m_buffer;
-    int m_bytes;
-    int total_bits;
-    int num_bits_read;
-    int word_index;
-    uint64_t scratch;
-    int scratch_bits;
-};
+    // the padding has to be zero, like ReadAlign
+    bool SerializeAlign()
+    {
+        const int alignBits = GetAlignBits(m_stream);
+        if (alignBits == 0)
+            return true;
 
-class WriteStream {
-public:
-    enum { IsWriting = 1 };
-    enum { IsReading = 0 };
+        if (WouldReadPastEnd(alignBits))
+            return false;
 
-    WriteStream(uint8_t* buffer, int bytes)
-        : m_writer(buffer, bytes)
-    {
+        return r_stream_read_bits(m_stream, alignBits) == 0;
     }
 
-    bool SerializeInteger(int32_t value, int32_t min, int32_t max)
+    bool SerializeBytes(uint8_t* data, int bytes)
     {
-        assert(min < max);
-        assert(value >= min);
-        assert(value <= max);
+        assert(data);
+        assert(bytes >= 0);
 
-        const int bits = BITS_REQUIRED(0, MaxElements);
-        uint32_t unsigned_value = value - min;
+        if (!SerializeAlign())
+            return false;
 
-        m_writer.WriteBits(unsigned_value, bits);
+        if (WouldReadPastEnd(bytes * 8))
+            return false;
 
+        ReadBytes(m_stream, data, bytes);
         return true;
     }
 
-    bool SerializeBits(int32_t value, int bits)
+    bool SerializeIntArray(int32_t* values, int count, int32_t min, int32_t max)
     {
-        assert(bits > 0);
-        assert(value >= 0);
-        //assert(value < INT32_MAX);
+        assert(min < max);
+        assert(count >= 0);
 
-        m_writer.WriteBits(value, bits);
-        return true;
+        const int bits = StreamBitsRequired(min, max);
+
+        if (count == 0)
+            return true;
+
+        if (WouldReadPastEnd(count * bits))
+            return false;
+
+        return r_bitpack_read(m_stream, values, count, min, max, bits);
     }
 
+    int GetBitsProcessed() const { return m_stream->bits_processed; }
+
+    int GetBytesProcessed() const { return (m_stream->bits_processed + 7) / 8; }
+
+    int GetBitsRemaining() const { return m_stream->num_bits - m_stream->bits_processed; }
+
 private:
-    BitWriter m_writer;
+    bool WouldReadPastEnd(int bits) const { return m_stream->bits_processed + bits > m_stream->num_bits; }
+
+    Stream* m_stream;
 };
 
-class ReadStream {
+class MeasureStream {
 public:
-    enum { IsWriting = 0 };
-    enum { IsReading = 1 };
+    enum { IsWriting = 1 };
+    enum { IsReading = 0 };
 
-    ReadStream(const uint8_t* buffer, int bytes)
-        : m_reader(buffer, bytes)
+    MeasureStream()
+        : m_bitsProcessed(0)
     {
     }
 
-    bool SerializeInteger(int32_t& value, int32_t min, int32_t max)
+    bool SerializeBits(uint32_t value, int bits)
     {
-        assert(min < max);
+        assert(bits > 0);
+        assert(bits <= 32);
+        (void)value;
 
-        const int bits = BITS_REQUIRED(0, MaxElements);
+        m_bitsProcessed += bits;
+        return true;
+    }
 
+    bool SerializeInteger(int32_t value, int32_t min, int32_t max)
+    {
+        assert(min < max);
+        assert(value >= min);
+        assert(value <= max);
+        (void)value;
 
-        if (m_reader.WouldReadPastEnd(bits)) {
+        m_bitsProcessed += StreamBitsRequired(min, max);
+        return true;
+    }
 
-            return false;
-        }
+    bool SerializeUint64(uint64_t value)
+    {
+        (void)value;
 
+        m_bitsProcessed += 64;
+        return true;
+    }
 
-        uint32_t unsigned_value = m_reader.ReadBits(bits);
-        value = (int32_t)unsigned_value + min;
+    bool SerializeAlign()
+    {
+        m_bitsProcessed += (8 - m_bitsProcessed % 8) % 8;
         return true;
     }
 
-    bool SerializeBits(int32_t& value, int bits)
+    bool SerializeBytes(const uint8_t* data, int bytes)
     {
-        assert(bits > 0);
+        assert(bytes >= 0);
+        (void)data;
 
-        if (m_reader.WouldReadPastEnd(bits))
-            return false;
+        SerializeAlign();
+        m_bitsProcessed += bytes * 8;
+        return true;
+    }
 
-        value = m_reader.ReadBits(bits);
+    bool SerializeIntArray(const int32_t* values, int count, int32_t min, int32_t max)
+    {
+        assert(min < max);
+        assert(count >= 0);
+        (void)values;
 
+        m_bitsProcessed += count * StreamBitsRequired(min, max);
         return true;
     }
 
+    int GetBitsProcessed() const { return m_bitsProcessed; }
+
+    int GetBytesProcessed() const { return (m_bitsProcessed + 7) / 8; }
+
 private:
-    BitReader m_reader;
+    int m_bitsProcessed;
 };
 
-#define serialize_int(stream, value, min, max)                 \
-    do {                                                       \
-        assert(min < max);                                     \
-        int32_t int32_value;                                   \
-        if (Stream::IsWriting) {                               \
-            assert(value >= min);                              \
-            assert(value <= max);                              \
-            int32_value = (int32_t)value;                      \
-        }                                                      \
-        if (!stream.SerializeInteger(int32_value, min, max)) { \
-            return false;                                      \
-        }                                                      \
-        if (Stream::IsReading) {                               \
-            value = int32_value;                               \
-            if (value < min || value > max) {                  \
-                return false;                                  \
-            }                                                  \
-        }                                                      \
+// bits serialize writes for object, from a dry run on a MeasureStream. use it to size a buffer before writing
+template <typename T>
+int MeasureBits(bool (*serialize)(MeasureStream&, T*), T* object)
+{
+    MeasureStream stream;
+    const bool result = serialize(stream, object);
+    assert(result);
+    (void)result;
+    return stream.GetBitsProcessed();
+}
+
+#define serialize_bits(stream, value, bits)                      \
+    do {                                                         \
+        uint32_t uint32_value = 0;                               \
+        if (Stream::IsWriting)                                   \
+            uint32_value = (uint32_t)(value);                    \
+        if (!(stream).SerializeBits(uint32_value, bits))         \
+            return false;                                        \
+        if (Stream::IsReading)                                   \
+            (value) = uint32_value;                              \
     } while (0)
 
-/*
-#define serialize_bits(stream, value, bits)             \
-    do {                                                \
-        assert(bits > 0);                               \
-        int32_t int32_value;                            \
-        if (Stream::IsWriting) {                        \
-            assert(value >= 0);                         \
-            assert(value < UINT32_MAX);                 \
-            int32_value = (int32_t)value;               \
-        }                                               \
-        if (!stream.SerializeBits(int32_value, bits)) { \
-            return false;                               \
-        }                                               \
-        if (Stream::IsReading) {                        \
-            value = int32_value;                        \
-            if (value < 0 || value >= (1 << bits)) {    \
-                return false;                           \
-            }                                           \
-        }                                               \
+#define serialize_int(stream, value, min, max)                   \
+    do {                                                         \
+        int32_t int32_value = 0;                                 \
+        if (Stream::IsWriting)                                   \
+            int32_value = (int32_t)(value);                      \
+        if (!(stream).SerializeInteger(int32_value, min, max))   \
+            return false;                                        \
+        if (Stream::IsReading)                                   \
+            (value) = int32_value;                               \
     } while (0)
-*/
 
-/*
-#define serialize_bits(stream, value, bits)         \
-    do {                                            \
-        if (Stream::IsWriting) {                    \
-            WriteBits(stream.m_writer, value, bits); \
-        } else if (Stream::IsReading) {             \
-            value = ReadBits(stream.m_reader, bits); \
-        }                                           \
+#define serialize_enum(stream, value, enum_type, num_entries)         \
+    do {                                                              \
+        int32_t int32_value = 0;                                      \
+        if (Stream::IsWriting)                                        \
+            int32_value = (int32_t)(value);                           \
+        if (!(stream).SerializeInteger(int32_value, 0, num_entries - 1)) \
+            return false;                                             \
+        if (Stream::IsReading)                                        \
+            (value) = (enum_type)int32_value;                         \
+    } while (0)
+
+#define serialize_uint64(stream, value)                          \
+    do {                                                         \
+        uint64_t uint64_value = 0;                               \
+        if (Stream::IsWriting)                                   \
+            uint64_value = (uint64_t)(value);                    \
+        if (!(stream).SerializeUint64(uint64_value))             \
+            return false;                                        \
+        if (Stream::IsReading)                                   \
+            (value) = uint64_value;                              \
+    } while (0)
+
+#define serialize_int_array(stream, values, count, min, max)      \
+    do {                                                          \
+        if (!(stream).SerializeIntArray(values, count, min, max)) \
+            return false;                                         \
+    } while (0)
+
+#define serialize_varint32(stream, value)                                        \
+    do {                                                                         \
+        uint64_t uint64_value = 0;                                               \
+        if (Stream::IsWriting)                                                   \
+            uint64_value = (uint32_t)(value);                                    \
+        if (!SerializeVarint(stream, uint64_value) || uint64_value > 0xFFFFFFFF) \
+            return false;                                                        \
+        if (Stream::IsReading)                                                   \
+            (value) = (uint32_t)uint64_value;                                    \
+    } while (0)
+
+#define serialize_varint64(stream, value)                        \
+    do {                                                         \
+        uint64_t uint64_value = 0;                               \
+        if (Stream::IsWriting)                                   \
+            uint64_value = (uint64_t)(value);                    \
+        if (!SerializeVarint(stream, uint64_value))              \
+            return false;                                        \
+        if (Stream::IsReading)                                   \
+            (value) = uint64_value;                              \
+    } while (0)
+
+#define serialize_gamma(stream, value)                           \
+    do {                                                         \
+        uint32_t uint32_value = 0;                               \
+        if (Stream::IsWriting)                                   \
+            uint32_value = (uint32_t)(value);                    \
+        if (!SerializeGamma(stream, uint32_value))               \
+            return false;                                        \
+        if (Stream::IsReading)                                   \
+            (value) = uint32_value;                              \
+    } while (0)
+
+#define serialize_relative(stream, previous, current)                       \
+    do {                                                                    \
+        uint32_t uint32_value = 0;                                          \
+        if (Stream::IsWriting)                                              \
+            uint32_value = (uint32_t)(current);                             \
+        if (!SerializeRelative(stream, (uint32_t)(previous), uint32_value)) \
+            return false;                                                   \
+        if (Stream::IsReading)                                              \
+            (current) = uint32_value;                                       \
+    } while (0)
+
+#define serialize_align(stream)                                  \
+    do {                                                         \
+        if (!(stream).SerializeAlign())                          \
+            return false;                                        \
+    } while (0)
+
+#define serialize_bytes(stream, data, bytes)                     \
+    do {                                                         \
+        if (!(stream).SerializeBytes(data, bytes))               \
+            return false;                                        \
     } while (0)
 
-    */
-    
 /*
-#define serialize_bits(stream, value, bits)                           \
-    if (Stream::IsWriting) {                                           \
-        stream.SerializeBits(value, bits); \
-    } else {                                                          \
-        stream.SerializeBits(value, bits);  \
+    Variable length integers for any stream: the same codes as r_serialize_varint64, r_serialize_gamma and
+    r_serialize_relative in serializer.h, bit for bit. They are built on serialize_bits, so they work with every
+    stream class.
+*/
+
+template <typename Stream>
+bool SerializeVarint(Stream& stream, uint64_t& value)
+{
+    uint64_t remaining = Stream::IsWriting ? value : 0;
+    uint64_t result = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint32_t group = 0;
+        if (Stream::IsWriting)
+            group = (uint32_t)(remaining & 0x7F) | (remaining >= 0x80 ? 0x80 : 0);
+
+        serialize_bits(stream, group, 8);
+
+        result |= (uint64_t)(group & 0x7F) << shift;
+        remaining >>= 7;
+
+        if ((group & 0x80) == 0) {
+            if (shift == 63 && group > 1)
+                return false;
+
+            if (Stream::IsReading)
+                value = result;
+            return true;
+        }
     }
-    */
 
-#define serialize_bits(stream, value, bits)                 \
-    do {                                                       \
-        if (!stream.SerializeBits(value, bits)) {           \
-            return false;                                      \
-        }                                                      \
-    } while (0)
+    return false;
+}
 
+template <typename Stream>
+bool SerializeGamma(Stream& stream, uint32_t& value)
+{
+    uint64_t coded = 0;
+    int numBits = 0;
 
-struct PacketB {
-    int numElements;
-    int elements[MaxElements];
+    if (Stream::IsWriting) {
+        if (value == 0xFFFFFFFF)
+            return false;
 
-    template <typename Stream>
-    bool Serialize(Stream& stream)
-    {
-        serialize_int(stream, numElements, 0, MaxElements);
-        for (int i = 0; i < numElements; ++i) {
-            serialize_bits(stream, elements[i], 32);
+        coded = (uint64_t)value + 1;
+        while (coded >> (numBits + 1))
+            numBits++;
+
+        uint32_t prefix = 1u << numBits;
+        serialize_bits(stream, prefix, numBits + 1);
+    } else {
+        for (;;) {
+            uint32_t bit = 0;
+            serialize_bits(stream, bit, 1);
+            if (bit)
+                break;
+            if (++numBits > 31)
+                return false;
         }
-        return true;
     }
-};
 
+    uint32_t low = (uint32_t)coded & ((1u << numBits) - 1);
+    if (numBits > 0)
+        serialize_bits(stream, low, numBits);
+
+    if (Stream::IsReading)
+        value = (uint32_t)((((uint64_t)1 << numBits) | low) - 1);
+
+    return true;
+}
+
+template <typename Stream>
+bool SerializeRelative(Stream& stream, uint32_t previous, uint32_t& current)
+{
+    uint32_t difference = 0;
+    if (Stream::IsWriting)
+        difference = current - previous;
+
+    if (!SerializeGamma(stream, difference))
+        return false;
+
+    if (Stream::IsReading)
+        current = previous + difference;
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef TICK_SCHEDULER_H
+#define TICK_SCHEDULER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "clock.h"
+
+/*
+    Fixed timestep tick scheduler.
+
+    Ticks are due every 1 / rate seconds on the monotonic clock. r_tick_scheduler_begin sleeps until the next deadline
+    and returns it as the tick's time, r_tick_scheduler_end records how long the tick took and moves the deadline on
+    by one interval. Each tick sees its own scheduled time, not the time it happened to start.
+
+    A tick that runs past the next deadline is an overrun. The ticks that fell due meanwhile run back to back without
+    sleeping, so a short stall is caught up. At most m_maxCatchUp ticks run late in a row; deadlines missed beyond
+    that are dropped, and the schedule carries on from the most recent one.
+
+    Deadlines are absolute, so waking late for one tick does not push the next one back.
+*/
+
+#define TickSchedulerMaxCatchUp 4 // ticks run back to back after a stall before the rest are dropped
+
+typedef struct TickSchedulerStats {
+    uint64_t numTicks; // ticks run
+    uint64_t numOverruns; // ticks that ended after the next deadline
+    uint64_t numDropped; // deadlines skipped after falling more than m_maxCatchUp ticks behind
+    ClockTime lastDuration; // nanoseconds the last tick took
+    ClockTime maxDuration; // nanoseconds the longest tick took
+    ClockTime totalDuration; // nanoseconds spent in ticks
+    ClockTime maxLateness; // nanoseconds the latest tick started after its deadline
+} TickSchedulerStats;
+
+typedef struct TickScheduler {
+    ClockTime m_interval; // nanoseconds between ticks
+    ClockTime m_deadline; // when the next tick is due
+    ClockTime m_tickStart; // when the current tick started
+    int m_maxCatchUp; // ticks that may run back to back after a stall
+    TickSchedulerStats m_stats;
+} TickScheduler;
+
+bool r_tick_scheduler_create(TickScheduler* scheduler, double rate, int maxCatchUp)
+{
+    assert(maxCatchUp > 0);
+
+    memset(scheduler, 0, sizeof(TickScheduler));
+
+    if (rate <= 0.0 || rate > 10000.0) {
+        printf("tick rate %.1f is out of range\n", rate);
+        return false;
+    }
+
+    scheduler->m_interval = (ClockTime)((double)ClockNanosecondsPerSecond / rate);
+    scheduler->m_maxCatchUp = maxCatchUp;
+    scheduler->m_deadline = r_clock_now();
+
+    return true;
+}
+
+// wait for the next tick and start it. returns the tick's scheduled time
+ClockTime r_tick_scheduler_begin(TickScheduler* scheduler)
+{
+    ClockTime now = r_clock_now();
+
+    if (now < scheduler->m_deadline) {
+        r_clock_sleep_until(scheduler->m_deadline);
+        now = r_clock_now();
+    } else {
+        // deadlines already passed besides this one. keep the last m_maxCatchUp - 1 of them to run back to back
+        const int64_t behind = (now - scheduler->m_deadline) / scheduler->m_interval;
+        if (behind >= scheduler->m_maxCatchUp) {
+            const int64_t numDropped = behind - scheduler->m_maxCatchUp + 1;
+            scheduler->m_stats.numDropped += (uint64_t)numDropped;
+            scheduler->m_deadline += numDropped * scheduler->m_interval;
+        }
+    }
+
+    const ClockTime lateness = now - scheduler->m_deadline;
+    if (lateness > scheduler->m_stats.maxLateness)
+        scheduler->m_stats.maxLateness = lateness;
+
+    scheduler->m_tickStart = now;
+
+    return scheduler->m_deadline;
+}
+
+void r_tick_scheduler_end(TickScheduler* scheduler)
+{
+    const ClockTime now = r_clock_now();
+    const ClockTime duration = now - scheduler->m_tickStart;
+
+    TickSchedulerStats* stats = &scheduler->m_stats;
+    stats->numTicks++;
+    stats->lastDuration = duration;
+    stats->totalDuration += duration;
+    if (duration > stats->maxDuration)
+        stats->maxDuration = duration;
+
+    scheduler->m_deadline += scheduler->m_interval;
+
+    if (now > scheduler->m_deadline)
+        stats->numOverruns++;
+}
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+/*
+    Hierarchical timer wheel.
+
+    Time is cut into ticks of m_resolution seconds. Level 0 has one slot per tick for the next 64 ticks, level 1 one
+    slot per 64 ticks for the next 64 * 64 and level 2 one slot per 64 * 64 ticks beyond that. When level 0 wraps, the
+    next level 1 slot is cascaded down into level 0, and likewise from level 2 into level 1.
+
+    Scheduling and cancelling are O(1). Advancing costs one slot check per tick passed plus the work for the timers
+    that expire or cascade, so it does not grow with the number of timers that are armed but not due.
+
+    Timers are numbered 0 to numTimers - 1 and linked into slots by index. The wheel allocates their storage once
+    in r_timer_wheel_create. A callback may schedule or cancel any timer, including the one that is firing.
+*/
+
+#define TimerWheelSlotBits 6
+#define TimerWheelSlots (1 << TimerWheelSlotBits) // slots per level
+#define TimerWheelLevels 3
+#define TimerWheelMaxTicks ((uint64_t)1 << (TimerWheelSlotBits * TimerWheelLevels)) // furthest a timer can be placed. later deadlines are re-placed when they come around
+
+typedef void (*TimerWheelCallback)(void* context, int timer, double time);
+
+typedef struct TimerWheelTimer {
+    uint64_t expires; // tick the timer is due
+    int next; // next timer in the same slot. -1 at the end
+    int prev; // previous timer in the same slot. -1 at the head
+    int slot; // slot the timer is linked into. -1 when it is not armed
+} TimerWheelTimer;
+
+typedef struct TimerWheel {
+    double m_resolution; // seconds per tick
+    uint64_t m_currentTick; // last tick processed
+
+    int m_numTimers;
+    int m_numArmed; // timers linked into a slot
+    int m_numArmedLevel[TimerWheelLevels]; // timers linked into each level
+    TimerWheelTimer* m_timers;
+
+    int m_slots[TimerWheelLevels * TimerWheelSlots]; // first timer in each slot. -1 when empty
+
+    TimerWheelCallback m_callback; // called for each timer that expires
+    void* m_context; // passed to m_callback
+} TimerWheel;
+
+bool r_timer_wheel_create(TimerWheel* wheel, int numTimers, double resolution, TimerWheelCallback callback, void* context)
+{
+    assert(numTimers > 0);
+    assert(resolution > 0.0);
+    assert(callback);
+
+    memset(wheel, 0, sizeof(TimerWheel));
+
+    wheel->m_timers = (TimerWheelTimer*)calloc(numTimers, sizeof(TimerWheelTimer));
+    if (!wheel->m_timers) {
+        printf("failed to allocate %d timers\n", numTimers);
+        return false;
+    }
+
+    wheel->m_resolution = resolution;
+    wheel->m_numTimers = numTimers;
+    wheel->m_callback = callback;
+    wheel->m_context = context;
+
+    for (int i = 0; i < numTimers; ++i)
+        wheel->m_timers[i].slot = -1;
+
+    for (int i = 0; i < TimerWheelLevels * TimerWheelSlots; ++i)
+        wheel->m_slots[i] = -1;
+
+    return true;
+}
+
+void r_timer_wheel_destroy(TimerWheel* wheel)
+{
+    free(wheel->m_timers);
+    memset(wheel, 0, sizeof(TimerWheel));
+}
+
+void r_timer_wheel_unlink(TimerWheel* wheel, int timer)
+{
+    TimerWheelTimer* t = &wheel->m_timers[timer];
+
+    assert(t->slot != -1);
+
+    if (t->prev != -1)
+        wheel->m_timers[t->prev].next = t->next;
+    else
+        wheel->m_slots[t->slot] = t->next;
+
+    if (t->next != -1)
+        wheel->m_timers[t->next].prev = t->prev;
+
+    wheel->m_numArmedLevel[t->slot / TimerWheelSlots]--;
+    wheel->m_numArmed--;
+    t->slot = -1;
+}
+
+/*
+    Link a timer into the slot for its expiry relative to the current tick. Timers already due go in the slot for
+    earliest: the next tick when scheduling, since the current tick's slot may be firing right now, but the current
+    tick itself when cascading, since that slot is processed straight after the cascade.
+*/
+void r_timer_wheel_link(TimerWheel* wheel, int timer, uint64_t earliest)
+{
+    TimerWheelTimer* t = &wheel->m_timers[timer];
+
+    assert(t->slot == -1);
+    assert(earliest == wheel->m_currentTick || earliest == wheel->m_currentTick + 1);
+
+    uint64_t expires = t->expires > earliest ? t->expires : earliest;
+
+    // too far out for the top level: park it as far as the wheel reaches. it is re-placed when that slot comes around
+    if (expires - wheel->m_currentTick >= TimerWheelMaxTicks)
+        expires = wheel->m_currentTick + TimerWheelMaxTicks - 1;
+
+    const uint64_t delta = expires - wheel->m_currentTick;
+
+    int level = 0;
+    while (level < TimerWheelLevels - 1 && delta >= ((uint64_t)1 << (TimerWheelSlotBits * (level + 1))))
+        level++;
+
+    const int slot = level * TimerWheelSlots + (int)((expires >> (TimerWheelSlotBits * level)) & (TimerWheelSlots - 1));
+
+    t->slot = slot;
+    t->prev = -1;
+    t->next = wheel->m_slots[slot];
+    if (t->next != -1)
+        wheel->m_timers[t->next].prev = timer;
+    wheel->m_slots[slot] = timer;
+
+    wheel->m_numArmedLevel[level]++;
+    wheel->m_numArmed++;
+}
+
+bool r_timer_wheel_is_armed(const TimerWheel* wheel, int timer)
+{
+    assert(timer >= 0 && timer < wheel->m_numTimers);
+    return wheel->m_timers[timer].slot != -1;
+}
+
+// arm a timer to fire at the first tick at or after deadline (seconds). re-arms it if it is already armed
+void r_timer_wheel_schedule(TimerWheel* wheel, int timer, double deadline)
+{
+    assert(timer >= 0 && timer < wheel->m_numTimers);
+
+    if (wheel->m_timers[timer].slot != -1)
+        r_timer_wheel_unlink(wheel, timer);
+
+    // the small bias keeps deadlines that land on a tick boundary from rounding up to the tick after
+    const double ticks = ceil(deadline / wheel->m_resolution - 1e-6);
+    wheel->m_timers[timer].expires = ticks > 0.0 ? (uint64_t)ticks : 0;
+
+    r_timer_wheel_link(wheel, timer, wheel->m_currentTick + 1);
+}
+
+void r_timer_wheel_cancel(TimerWheel* wheel, int timer)
+{
+    assert(timer >= 0 && timer < wheel->m_numTimers);
+
+    if (wheel->m_timers[timer].slot != -1)
+        r_timer_wheel_unlink(wheel, timer);
+}
+
+// move every timer in a slot down to where it now belongs
+void r_timer_wheel_cascade(TimerWheel* wheel, int slot)
+{
+    while (wheel->m_slots[slot] != -1) {
+        const int timer = wheel->m_slots[slot];
+        r_timer_wheel_unlink(wheel, timer);
+        r_timer_wheel_link(wheel, timer, wheel->m_currentTick);
+    }
+}
+
+/*
+    Process every tick up to time and fire the timers that are due. Returns the number of timers fired.
+
+    Ticks where nothing can happen are skipped: with nothing armed the wheel jumps straight to time, and while the
+    lower levels are empty it jumps to the next tick that cascades the lowest level that has timers.
+*/
+int r_timer_wheel_advance(TimerWheel* wheel, double time)
+{
+    const double targetTicks = floor(time / wheel->m_resolution + 1e-6);
+    const uint64_t target = targetTicks > 0.0 ? (uint64_t)targetTicks : 0;
+
+    int numFired = 0;
+
+    while (wheel->m_currentTick < target) {
+
+        if (wheel->m_numArmed == 0) {
+            wheel->m_currentTick = target;
+            break;
+        }
+
+        int lowestLevel = 0;
+        while (wheel->m_numArmedLevel[lowestLevel] == 0)
+            lowestLevel++;
+
+        if (lowestLevel > 0) {
+            const uint64_t lowerMask = ((uint64_t)1 << (TimerWheelSlotBits * lowestLevel)) - 1;
+            const uint64_t skipTo = wheel->m_currentTick | lowerMask;
+            if (skipTo > wheel->m_currentTick) {
+                wheel->m_currentTick = skipTo < target ? skipTo : target;
+                continue;
+            }
+        }
+
+        const uint64_t tick = ++wheel->m_currentTick;
+
+        // on wrap, pull the next slot of each higher level down. highest first so its timers can land in the level below
+        for (int level = TimerWheelLevels - 1; level > 0; --level) {
+            const uint64_t lowerMask = ((uint64_t)1 << (TimerWheelSlotBits * level)) - 1;
+            if ((tick & lowerMask) == 0)
+                r_timer_wheel_cascade(wheel, level * TimerWheelSlots + (int)((tick >> (TimerWheelSlotBits * level)) & (TimerWheelSlots - 1)));
+        }
+
+        const int slot = (int)(tick & (TimerWheelSlots - 1));
+
+        // take timers off one at a time. the callback may cancel or schedule others, including ones in this slot
+        while (wheel->m_slots[slot] != -1) {
+            const int timer = wheel->m_slots[slot];
+            r_timer_wheel_unlink(wheel, timer);
+
+            // parked because it was beyond the wheel's reach. put it back where it now belongs
+            if (wheel->m_timers[timer].expires > tick) {
+                r_timer_wheel_link(wheel, timer, tick + 1);
+                continue;
+            }
+
+            wheel->m_callback(wheel->m_context, timer, time);
+            numFired++;
+        }
+    }
+
+    return numFired;
+}
+
+#endif
@@ -0,0 +1,590 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "socket.h"
+
+#if SOCKET_HAS_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+    io_uring backend for the socket layer.
+
+    Receives use a single multishot recvmsg that stays armed across ticks and picks buffers
+    from a provided buffer ring, so the kernel fills buffers as datagrams arrive without any
+    per-packet submission. ReceivePacketBatch points each slot at the provided buffer the datagram landed in rather
+    than copying it out, and the buffers go back to the kernel on the next ReceivePacketBatch call.
+
+    Sends are a batch of sendmsg operations whose iovecs point straight into the send queue's arena. With UDP GSO a
+    train of datagrams to one address (SendQueueSegmentRun) is one sendmsg with a UDP_SEGMENT control message, as on
+    the sendmmsg path. The queue reuses its arena as soon as the flush returns, so the flush waits for its sends to
+    complete; UDP sends complete as the kernel issues them, so that is normally the same io_uring_enter call that
+    submits them. That call also collects receive completions.
+
+    Attach with r_uring_create. After that ReceivePacketBatch and SendQueueFlush on the socket
+    go through the ring, so the server loop does not change. Turn on UDP_GRO first if wanted, the ring sizes its
+    receive buffers for it.
+*/
+
+#define UringQueueDepth 256 // submission queue entries
+#define UringNumRecvBuffers 256 // provided buffers for multishot recvmsg. must be a power of two
+#define UringRecvBufferSize 2048 // io_uring_recvmsg_out header + source address + MaxDatagramSize
+#define UringNumGroRecvBuffers 64 // provided buffers when the socket has UDP_GRO on. must be a power of two
+#define UringGroRecvBufferSize (SocketMaxCoalescedSize + 256) // header + source address + control + coalesced payload
+#define UringNumSendSlots 128 // sends that can be in flight at once
+#define UringBufferGroup 0 // provided buffer group id used for receives
+
+#define UringRecvUserData 0xFFFFFFFFFFFFFFFFull // user data tagging the multishot receive. sends use their slot index
+
+typedef struct UringSendSlot {
+    struct msghdr msg;
+    struct iovec iov[SocketMaxSegments]; // point into the send queue's arena while the send is in flight
+    SOCKADDR_IN address;
+    int first; // queue index of the first datagram sent
+    int count; // datagrams sent. more than one is a GSO train
+#if SOCKET_HAS_GSO
+    SocketSegmentControl control; // UDP_SEGMENT for a train. last, it ends in a flexible array
+#endif
+} UringSendSlot;
+
+typedef struct UringPendingRecv {
+    uint16_t bufferId; // provided buffer holding the datagram
+    int bytes; // bytes written into the buffer, header included
+} UringPendingRecv;
+
+typedef struct UringSocket {
+    Socket* m_socket; // socket this ring is attached to
+
+    int m_ringFd; // io_uring instance
+
+    // submission queue, shared with the kernel
+    unsigned* m_sqHead;
+    unsigned* m_sqTail;
+    unsigned* m_sqArray;
+    unsigned m_sqMask;
+    unsigned m_sqEntries;
+    struct io_uring_sqe* m_sqes;
+    unsigned m_sqTailLocal; // tail including entries not yet published to the kernel
+    unsigned m_numToSubmit; // entries prepared since the last io_uring_enter
+
+    // completion queue, shared with the kernel
+    unsigned* m_cqHead;
+    unsigned* m_cqTail;
+    unsigned m_cqMask;
+    struct io_uring_cqe* m_cqes;
+
+    void* m_sqRing;
+    size_t m_sqRingSize;
+    void* m_cqRing;
+    size_t m_cqRingSize;
+    size_t m_sqesSize;
+
+    // provided buffer ring for receives. the ring tail overlays m_bufRing[0].resv
+    struct io_uring_buf* m_bufRing;
+    size_t m_bufRingSize;
+    uint8_t* m_bufData;
+    uint16_t m_bufTail;
+    int m_numRecvBuffers; // UringNumRecvBuffers, or UringNumGroRecvBuffers with UDP_GRO
+    int m_recvBufferSize; // UringRecvBufferSize, or UringGroRecvBufferSize with UDP_GRO
+
+    struct msghdr m_recvMsg; // template for the multishot recvmsg. only the name and control sizes are used
+    bool m_recvArmed; // true while the multishot receive is live in the kernel
+
+    UringPendingRecv m_pendingRecv[UringNumRecvBuffers]; // receive completions reaped but not yet handed out
+    int m_pendingHead;
+    int m_numPendingRecv;
+
+    uint16_t m_heldRecv[UringNumRecvBuffers]; // buffers the last ReceivePacketBatch pointed slots at
+    int m_numHeldRecv;
+
+    UringSendSlot* m_sendSlots;
+    int m_freeSendSlots[UringNumSendSlots]; // stack of send slots not in flight
+    int m_numFreeSendSlots;
+
+    int m_retryFirst[MaxSendQueuePackets]; // GSO trains the kernel or the route could not segment, to send again plainly
+    int m_retryCount[MaxSendQueuePackets];
+    int m_numRetry;
+
+    uint64_t m_numEnters; // io_uring_enter calls made
+    uint64_t m_numSendErrors; // sends the kernel completed with an error
+    uint64_t m_numRecvDropped; // datagrams dropped because they were truncated or did not fit the slot
+} UringSocket;
+
+int r_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int r_uring_enter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+int r_uring_register(int ringFd, unsigned opcode, void* arg, unsigned numArgs)
+{
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, numArgs);
+}
+
+// hand a receive buffer (back) to the kernel
+void r_uring_recycle_buffer(UringSocket* uring, uint16_t bufferId)
+{
+    // indexed as a plain io_uring_buf array. io_uring_buf_ring::bufs sits 8 bytes late when old kernel headers are compiled as C++
+    struct io_uring_buf* buf = &uring->m_bufRing[uring->m_bufTail & (uring->m_numRecvBuffers - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(uring->m_bufData + (size_t)bufferId * uring->m_recvBufferSize);
+    buf->len = uring->m_recvBufferSize;
+    buf->bid = bufferId;
+    uring->m_bufTail++;
+
+    __atomic_store_n(&uring->m_bufRing[0].resv, uring->m_bufTail, __ATOMIC_RELEASE);
+}
+
+// next free submission entry, or NULL if the submission queue is full
+struct io_uring_sqe* r_uring_get_sqe(UringSocket* uring)
+{
+    const unsigned head = __atomic_load_n(uring->m_sqHead, __ATOMIC_ACQUIRE);
+    if (uring->m_sqTailLocal - head >= uring->m_sqEntries)
+        return NULL;
+
+    const unsigned index = uring->m_sqTailLocal & uring->m_sqMask;
+    struct io_uring_sqe* sqe = &uring->m_sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    uring->m_sqArray[index] = index;
+    uring->m_sqTailLocal++;
+    uring->m_numToSubmit++;
+
+    return sqe;
+}
+
+// move completions out of the completion queue. receives go to the pending list, sends free their slot
+void r_uring_reap(UringSocket* uring)
+{
+    unsigned head = *uring->m_cqHead;
+    const unsigned tail = __atomic_load_n(uring->m_cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        const struct io_uring_cqe* cqe = &uring->m_cqes[head & uring->m_cqMask];
+
+        if (cqe->user_data == UringRecvUserData) {
+
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                uring->m_recvArmed = false;
+
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                assert(uring->m_numPendingRecv < UringNumRecvBuffers);
+                const int index = (uring->m_pendingHead + uring->m_numPendingRecv) % UringNumRecvBuffers;
+                uring->m_pendingRecv[index].bufferId = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                uring->m_pendingRecv[index].bytes = cqe->res;
+                uring->m_numPendingRecv++;
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                printf("io_uring recvmsg failed (%d)\n", -cqe->res);
+            }
+
+        } else {
+
+            assert(cqe->user_data < UringNumSendSlots);
+            assert(uring->m_numFreeSendSlots < UringNumSendSlots);
+            uring->m_freeSendSlots[uring->m_numFreeSendSlots++] = (int)cqe->user_data;
+
+            const UringSendSlot* slot = &uring->m_sendSlots[cqe->user_data];
+
+            if (cqe->res < 0 && slot->count > 1 && r_socket_is_gso_error(-cqe->res)) {
+                assert(uring->m_numRetry < MaxSendQueuePackets);
+                uring->m_retryFirst[uring->m_numRetry] = slot->first;
+                uring->m_retryCount[uring->m_numRetry] = slot->count;
+                uring->m_numRetry++;
+            } else if (cqe->res < 0) {
+                uring->m_numSendErrors++;
+            }
+        }
+
+        head++;
+    }
+
+    __atomic_store_n(uring->m_cqHead, head, __ATOMIC_RELEASE);
+}
+
+// publish prepared entries and let the kernel post completions. waits for at least minComplete completions
+void r_uring_submit(UringSocket* uring, unsigned minComplete)
+{
+    __atomic_store_n(uring->m_sqTail, uring->m_sqTailLocal, __ATOMIC_RELEASE);
+
+    int result = r_uring_enter(uring->m_ringFd, uring->m_numToSubmit, minComplete, IORING_ENTER_GETEVENTS);
+    uring->m_numEnters++;
+
+    if (result >= 0) {
+        assert((unsigned)result <= uring->m_numToSubmit);
+        uring->m_numToSubmit -= result;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        printf("io_uring_enter failed (errno = %d)\n", errno);
+    }
+
+    r_uring_reap(uring);
+}
+
+// queue the multishot receive. it stays armed until the kernel runs out of buffers or hits an error
+bool r_uring_arm_recv(UringSocket* uring)
+{
+    struct io_uring_sqe* sqe = r_uring_get_sqe(uring);
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = uring->m_socket->m_socket;
+    sqe->addr = (uint64_t)(uintptr_t)&uring->m_recvMsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UringBufferGroup;
+    sqe->user_data = UringRecvUserData;
+
+    uring->m_recvArmed = true;
+
+    return true;
+}
+
+void r_uring_destroy(UringSocket* uring)
+{
+    if (uring->m_socket)
+        uring->m_socket->m_uring = NULL;
+
+    if (uring->m_ringFd > 0)
+        close(uring->m_ringFd);
+
+    if (uring->m_sqes)
+        munmap(uring->m_sqes, uring->m_sqesSize);
+    if (uring->m_cqRing && uring->m_cqRing != uring->m_sqRing)
+        munmap(uring->m_cqRing, uring->m_cqRingSize);
+    if (uring->m_sqRing)
+        munmap(uring->m_sqRing, uring->m_sqRingSize);
+    if (uring->m_bufRing)
+        munmap(uring->m_bufRing, uring->m_bufRingSize);
+
+    free(uring->m_bufData);
+    free(uring->m_sendSlots);
+
+    memset(uring, 0, sizeof(UringSocket));
+}
+
+// attach an io_uring to a socket created with r_socket_create. fails on kernels without multishot recvmsg (< 6.0)
+bool r_uring_create(UringSocket* uring, Socket* socket)
+{
+    assert(socket);
+
+    memset(uring, 0, sizeof(UringSocket));
+    uring->m_socket = socket;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    uring->m_ringFd = r_uring_setup(UringQueueDepth, &params);
+    if (uring->m_ringFd < 0) {
+        printf("failed to create io_uring (errno = %d)\n", errno);
+        uring->m_ringFd = 0;
+        return false;
+    }
+
+    uring->m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->m_cqRingSize > uring->m_sqRingSize)
+            uring->m_sqRingSize = uring->m_cqRingSize;
+        uring->m_cqRingSize = uring->m_sqRingSize;
+    }
+
+    uring->m_sqRing = mmap(NULL, uring->m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->m_ringFd, IORING_OFF_SQ_RING);
+    if (uring->m_sqRing == MAP_FAILED) {
+        uring->m_sqRing = NULL;
+        printf("failed to map io_uring submission queue\n");
+        r_uring_destroy(uring);
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->m_cqRing = uring->m_sqRing;
+    } else {
+        uring->m_cqRing = mmap(NULL, uring->m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->m_ringFd, IORING_OFF_CQ_RING);
+        if (uring->m_cqRing == MAP_FAILED) {
+            uring->m_cqRing = NULL;
+            printf("failed to map io_uring completion queue\n");
+            r_uring_destroy(uring);
+            return false;
+        }
+    }
+
+    uring->m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->m_sqes = (struct io_uring_sqe*)mmap(NULL, uring->m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->m_ringFd, IORING_OFF_SQES);
+    if (uring->m_sqes == MAP_FAILED) {
+        uring->m_sqes = NULL;
+        printf("failed to map io_uring submission entries\n");
+        r_uring_destroy(uring);
+        return false;
+    }
+
+    uint8_t* sq = (uint8_t*)uring->m_sqRing;
+    uring->m_sqHead = (unsigned*)(sq + params.sq_off.head);
+    uring->m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+    uring->m_sqArray = (unsigned*)(sq + params.sq_off.array);
+    uring->m_sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    uring->m_sqEntries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    uring->m_sqTailLocal = *uring->m_sqTail;
+
+    uint8_t* cq = (uint8_t*)uring->m_cqRing;
+    uring->m_cqHead = (unsigned*)(cq + params.cq_off.head);
+    uring->m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+    uring->m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    uring->m_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // provided buffer ring. the kernel picks a buffer per received datagram. coalesced receives need far bigger buffers, so fewer of them
+    uring->m_numRecvBuffers = socket->m_gro ? UringNumGroRecvBuffers : UringNumRecvBuffers;
+    uring->m_recvBufferSize = socket->m_gro ? UringGroRecvBufferSize : UringRecvBufferSize;
+
+    uring->m_bufRingSize = uring->m_numRecvBuffers * sizeof(struct io_uring_buf);
+    uring->m_bufRing = (struct io_uring_buf*)mmap(NULL, uring->m_bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->m_bufRing == MAP_FAILED) {
+        uring->m_bufRing = NULL;
+        printf("failed to allocate io_uring buffer ring\n");
+        r_uring_destroy(uring);
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring->m_bufRing;
+    reg.ring_entries = uring->m_numRecvBuffers;
+    reg.bgid = UringBufferGroup;
+
+    if (r_uring_register(uring->m_ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        printf("failed to register io_uring buffer ring (errno = %d)\n", errno);
+        r_uring_destroy(uring);
+        return false;
+    }
+
+    uring->m_bufData = (uint8_t*)malloc((size_t)uring->m_numRecvBuffers * uring->m_recvBufferSize);
+    uring->m_sendSlots = (UringSendSlot*)malloc(UringNumSendSlots * sizeof(UringSendSlot));
+    if (!uring->m_bufData || !uring->m_sendSlots) {
+        printf("failed to allocate io_uring buffers\n");
+        r_uring_destroy(uring);
+        return false;
+    }
+
+    for (int i = 0; i < uring->m_numRecvBuffers; ++i)
+        r_uring_recycle_buffer(uring, (uint16_t)i);
+
+    for (int i = 0; i < UringNumSendSlots; ++i) {
+        UringSendSlot* slot = &uring->m_sendSlots[i];
+        memset(&slot->msg, 0, sizeof(slot->msg));
+        slot->msg.msg_name = &slot->address;
+        slot->msg.msg_namelen = sizeof(SOCKADDR_IN);
+        slot->msg.msg_iov = slot->iov;
+        slot->msg.msg_iovlen = 1;
+        slot->count = 0;
+        uring->m_freeSendSlots[i] = UringNumSendSlots - 1 - i;
+    }
+    uring->m_numFreeSendSlots = UringNumSendSlots;
+
+    uring->m_recvMsg.msg_namelen = sizeof(SOCKADDR_IN);
+#if SOCKET_HAS_GRO
+    uring->m_recvMsg.msg_controllen = socket->m_gro ? sizeof(SocketGroControl) : 0;
+#else
+    uring->m_recvMsg.msg_controllen = 0;
+#endif
+
+    r_uring_arm_recv(uring);
+    r_uring_submit(uring, 0);
+
+    if (!uring->m_recvArmed) {
+        printf("io_uring multishot recvmsg is not supported by this kernel\n");
+        r_uring_destroy(uring);
+        return false;
+    }
+
+    socket->m_uring = uring;
+
+    return true;
+}
+
+int UringReceiveBatch(UringSocket* uring, ReceiveSlot slots[], int numSlots)
+{
+    // the caller is done with the buffers handed out last time
+    for (int i = 0; i < uring->m_numHeldRecv; ++i)
+        r_uring_recycle_buffer(uring, uring->m_heldRecv[i]);
+    uring->m_numHeldRecv = 0;
+
+    // leave the kernel at least half the buffers to receive into while the caller holds the rest
+    if (numSlots > uring->m_numRecvBuffers / 2)
+        numSlots = uring->m_numRecvBuffers / 2;
+
+    if (uring->m_numPendingRecv < numSlots)
+        r_uring_submit(uring, 0);
+
+    int numReceived = 0;
+
+    while (numReceived < numSlots && uring->m_numPendingRecv > 0) {
+        const UringPendingRecv pending = uring->m_pendingRecv[uring->m_pendingHead];
+        uring->m_pendingHead = (uring->m_pendingHead + 1) % UringNumRecvBuffers;
+        uring->m_numPendingRecv--;
+
+        // buffer layout: [io_uring_recvmsg_out][source address][control][payload]
+        const uint8_t* buffer = uring->m_bufData + (size_t)pending.bufferId * uring->m_recvBufferSize;
+        const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*)buffer;
+        const SOCKADDR_IN* name = (const SOCKADDR_IN*)(buffer + sizeof(struct io_uring_recvmsg_out));
+        const uint8_t* payload = buffer + sizeof(struct io_uring_recvmsg_out) + uring->m_recvMsg.msg_namelen + uring->m_recvMsg.msg_controllen;
+
+        ReceiveSlot* slot = &slots[numReceived];
+
+        if ((out->flags & MSG_TRUNC) || (int)out->payloadlen > slot->capacity || pending.bytes < (int)(payload - buffer)) {
+            uring->m_numRecvDropped++;
+            r_uring_recycle_buffer(uring, pending.bufferId);
+        } else {
+            slot->data = (uint8_t*)payload;
+            slot->size = (int)out->payloadlen;
+            slot->segmentSize = slot->size;
+            slot->sender.m_address_ipv4 = name->sin_addr.s_addr;
+            slot->sender.m_port = ntohs(name->sin_port);
+
+#if SOCKET_HAS_GRO
+            if (out->controllen > 0) {
+                struct msghdr control;
+                memset(&control, 0, sizeof(control));
+                control.msg_control = (void*)(buffer + sizeof(struct io_uring_recvmsg_out) + uring->m_recvMsg.msg_namelen);
+                control.msg_controllen = out->controllen;
+
+                const int segmentSize = r_socket_read_segment_size(&control);
+                if (segmentSize > 0)
+                    slot->segmentSize = segmentSize;
+            }
+#endif
+
+            uring->m_heldRecv[uring->m_numHeldRecv++] = pending.bufferId;
+            numReceived++;
+        }
+    }
+
+    // the kernel ends the multishot receive when it runs dry of buffers. now that some are back, re-arm it
+    if (!uring->m_recvArmed)
+        r_uring_arm_recv(uring);
+
+    return numReceived;
+}
+
+// queue one sendmsg for count datagrams of the send queue starting at first. more than one goes as a GSO train
+void r_uring_send_datagrams(UringSocket* uring, SendQueue* queue, int first, int count)
+{
+    // every slot in flight. push what we have and wait for some sends to finish
+    while (uring->m_numFreeSendSlots == 0)
+        r_uring_submit(uring, 1);
+
+    struct io_uring_sqe* sqe = r_uring_get_sqe(uring);
+    while (!sqe) {
+        r_uring_submit(uring, 0);
+        sqe = r_uring_get_sqe(uring);
+    }
+
+    const int slotIndex = uring->m_freeSendSlots[--uring->m_numFreeSendSlots];
+    UringSendSlot* slot = &uring->m_sendSlots[slotIndex];
+
+    memset(&slot->address, 0, sizeof(SOCKADDR_IN));
+    slot->address.sin_family = AF_INET;
+    slot->address.sin_addr.s_addr = queue->m_address[first].m_address_ipv4;
+    slot->address.sin_port = htons((unsigned short)queue->m_address[first].m_port);
+
+    for (int i = 0; i < count; ++i) {
+        slot->iov[i].iov_base = queue->m_arena + queue->m_offset[first + i];
+        slot->iov[i].iov_len = queue->m_size[first + i];
+    }
+
+    slot->msg.msg_iovlen = count;
+    slot->msg.msg_control = NULL;
+    slot->msg.msg_controllen = 0;
+#if SOCKET_HAS_GSO
+    if (count > 1)
+        r_socket_set_segment_size(&slot->msg, &slot->control, queue->m_size[first]);
+#endif
+
+    slot->first = first;
+    slot->count = count;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = uring->m_socket->m_socket;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)slotIndex;
+}
+
+// submit and wait until no send is in flight, so nothing points into the queue's arena any more
+void r_uring_wait_sends(UringSocket* uring)
+{
+    while (uring->m_numFreeSendSlots < UringNumSendSlots)
+        r_uring_submit(uring, UringNumSendSlots - uring->m_numFreeSendSlots);
+}
+
+int UringSendQueue(UringSocket* uring, SendQueue* queue)
+{
+    SendQueueStats* stats = &queue->m_stats;
+
+    const uint64_t entersBefore = uring->m_numEnters;
+
+    uring->m_numRetry = 0;
+
+    int numTrains = 0;
+
+    for (int i = 0; i < queue->m_numPackets;) {
+        int count = 1;
+#if SOCKET_HAS_GSO
+        if (uring->m_socket->m_gso)
+            count = SendQueueSegmentRun(queue, i);
+#endif
+        r_uring_send_datagrams(uring, queue, i, count);
+
+        if (count > 1)
+            numTrains++;
+
+        for (int j = i; j < i + count; ++j)
+            stats->numBytesSent += queue->m_size[j];
+
+        i += count;
+    }
+
+    r_uring_wait_sends(uring);
+
+    stats->numSegmentedSends += numTrains - uring->m_numRetry;
+
+    // the kernel or the route cannot segment. stop using GSO on this socket and resend the trains as plain datagrams
+    if (uring->m_numRetry > 0) {
+        printf("segmented send failed. disabling UDP GSO on this socket\n");
+        uring->m_socket->m_gso = false;
+
+        for (int i = 0; i < uring->m_numRetry; ++i) {
+            for (int j = 0; j < uring->m_retryCount[i]; ++j)
+                r_uring_send_datagrams(uring, queue, uring->m_retryFirst[i] + j, 1);
+        }
+
+        uring->m_numRetry = 0;
+
+        r_uring_wait_sends(uring);
+    }
+
+    const int numSent = queue->m_numPackets;
+
+    stats->numDatagramsSent += numSent;
+    stats->lastFlushDatagrams = numSent;
+    stats->lastFlushSyscalls = (int)(uring->m_numEnters - entersBefore);
+    stats->numSyscalls += uring->m_numEnters - entersBefore;
+
+    queue->m_numPackets = 0;
+    queue->m_arenaUsed = 0;
+
+    return numSent;
+}
+
+#endif // #if SOCKET_HAS_IO_URING
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef WIDE_STREAM_HPP
+#define WIDE_STREAM_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "serializer.h"
+#include "stream.hpp"
+
+/*
+    64 bit word streams.
+
+    The wire format is a run of bits, LSB first, stored as little endian 32 bit words. Read as little endian 64 bit
+    words it is the same run of bits, so WideWriteStream and WideReadStream move 8 bytes at a time with unaligned
+    loads and stores and put exactly the same bits on the wire as WriteStream and ReadStream. They work with the
+    same serialize functions and macros.
+
+    WideWriteStream keeps up to 63 bits in its scratch and stores a whole 64 bit word each time it fills. A uint64
+    goes in with one shift and one store rather than as two 32 bit halves. Flush writes what is left out to the
+    next 4 byte boundary, so a flushed stream is the same size as a flushed WriteStream.
+
+    WideReadStream keeps no scratch at all. Each field is one unaligned 64 bit load at the byte the field starts
+    in, a shift and a mask: the refill is the load, so there is no branch on how many bits are buffered. Loads are
+    clamped to the last 8 bytes of the data, so whatever the data says no read leaves the buffer. Reading past the
+    end returns garbage but is safe.
+
+    Neither stream checks bounds per field. Instead:
+
+        writing     measure the packet first (MeasureBits) and give the stream a buffer that holds it
+        reading     check once per packet that the data holds the packet's known maximum size (HasBits), or for a
+                    packet without one, read it and check IsOverflowed once at the end
+
+    Range checks on read values (SerializeInteger, padding in SerializeAlign) are validation, not bounds, and stay.
+*/
+
+inline uint64_t wide_load(const uint8_t* data)
+{
+    uint64_t value;
+    memcpy(&value, data, 8);
+#if PROTOCOL2_BIG_ENDIAN
+    value = ((uint64_t)bswap((uint32_t)value) << 32) | bswap((uint32_t)(value >> 32));
+#endif
+    return value;
+}
+
+inline void wide_store(uint8_t* data, uint64_t value)
+{
+#if PROTOCOL2_BIG_ENDIAN
+    value = ((uint64_t)bswap((uint32_t)value) << 32) | bswap((uint32_t)(value >> 32));
+#endif
+    memcpy(data, &value, 8);
+}
+
+class WideWriteStream {
+public:
+    enum { IsWriting = 1 };
+    enum { IsReading = 0 };
+
+    WideWriteStream(uint8_t* data, int bytes)
+        : m_data(data)
+        , m_numBits(bytes * 8)
+        , m_bitsProcessed(0)
+        , m_wordIndex(0)
+        , m_scratchBits(0)
+        , m_scratch(0)
+    {
+        assert(data);
+        assert((bytes % 4) == 0);
+    }
+
+    bool SerializeBits(uint32_t value, int bits)
+    {
+        assert(bits > 0);
+        assert(bits <= 32);
+        assert(bits == 32 || value < (1u << bits));
+
+        m_scratch |= (uint64_t)value << m_scratchBits;
+        m_scratchBits += bits;
+        m_bitsProcessed += bits;
+
+        if (m_scratchBits >= 64) {
+            StoreWord();
+            m_scratchBits -= 64;
+            // the bits of value that did not fit. all of them shifted out (0) when it fit exactly
+            m_scratch = (uint64_t)value >> (bits - m_scratchBits);
+        }
+
+        return true;
+    }
+
+    bool SerializeInteger(int32_t value, int32_t min, int32_t max)
+    {
+        assert(min < max);
+        assert(value >= min);
+        assert(value <= max);
+
+        return SerializeBits((uint32_t)value - (uint32_t)min, StreamBitsRequired(min, max));
+    }
+
+    // always fills the scratch, so always one store
+    bool SerializeUint64(uint64_t value)
+    {
+        m_scratch |= value << m_scratchBits;
+        StoreWord();
+        m_scratch = (value >> 1) >> (63 - m_scratchBits);
+        m_bitsProcessed += 64;
+        return true;
+    }
+
+    bool SerializeAlign()
+    {
+        const int alignBits = (8 - m_bitsProcessed % 8) % 8;
+        if (alignBits)
+            SerializeBits(0, alignBits);
+        return true;
+    }
+
+    // whole words go straight to the buffer once the scratch is on a word boundary
+    bool SerializeBytes(const uint8_t* data, int bytes)
+    {
+        assert(data);
+        assert(bytes >= 0);
+
+        SerializeAlign();
+
+        int i = 0;
+        while (i < bytes && m_scratchBits != 0)
+            SerializeBits(data[i++], 8);
+
+        for (; i + 8 <= bytes; i += 8) {
+            memcpy(m_data + m_wordIndex * 8, data + i, 8);
+            m_wordIndex++;
+            m_bitsProcessed += 64;
+        }
+
+        while (i < bytes)
+            SerializeBits(data[i++], 8);
+
+        return true;
+    }
+
+    bool SerializeIntArray(const int32_t* values, int count, int32_t min, int32_t max)
+    {
+        assert(min < max);
+        assert(count >= 0);
+
+        const int bits = StreamBitsRequired(min, max);
+        for (int i = 0; i < count; ++i)
+            SerializeBits((uint32_t)values[i] - (uint32_t)min, bits);
+        return true;
+    }
+
+    // write the bits left in the scratch, zero padded to a 4 byte boundary
+    void Flush()
+    {
+        assert(m_bitsProcessed <= m_numBits);
+
+        uint8_t* data = m_data + m_wordIndex * 8;
+
+        uint32_t word = host_to_network((uint32_t)m_scratch);
+        if (m_scratchBits > 0)
+            memcpy(data, &word, 4);
+
+        word = host_to_network((uint32_t)(m_scratch >> 32));
+        if (m_scratchBits > 32)
+            memcpy(data + 4, &word, 4);
+    }
+
+    int GetBitsProcessed() const { return m_bitsProcessed; }
+
+    int GetBytesProcessed() const { return (m_bitsProcessed + 7) / 8; }
+
+    int GetBitsRemaining() const { return m_numBits - m_bitsProcessed; }
+
+private:
+    void StoreWord()
+    {
+        assert((m_wordIndex + 1) * 64 <= m_numBits);
+
+        wide_store(m_data + m_wordIndex * 8, m_scratch);
+        m_wordIndex++;
+    }
+
+    uint8_t* m_data;
+    int m_numBits;
+    int m_bitsProcessed;
+    int m_wordIndex; // next 64 bit word to store
+    int m_scratchBits;
+    uint64_t m_scratch;
+};
+
+class WideReadStream {
+public:
+    enum { IsWriting = 0 };
+    enum { IsReading = 1 };
+
+    WideReadStream(const uint8_t* data, int bytes)
+        : m_data(data)
+        , m_numBits(bytes * 8)
+        , m_bitsProcessed(0)
+        , m_lastLoad(bytes - 8)
+    {
+        assert(data);
+        assert(bytes >= 0);
+
+        // too short to load 8 bytes from. read a zero padded copy instead
+        if (bytes < 8) {
+            memset(m_small, 0, sizeof(m_small));
+            memcpy(m_small, data, bytes);
+            m_data = m_small;
+            m_lastLoad = 0;
+        }
+    }
+
+    // true if the data holds at least bits more bits. call once per packet with its maximum size
+    bool HasBits(int bits) const { return m_bitsProcessed + bits <= m_numBits; }
+
+    // true if something was read past the end of the data. the values read are garbage
+    bool IsOverflowed() const { return m_bitsProcessed > m_numBits; }
+
+    bool SerializeBits(uint32_t& value, int bits)
+    {
+        assert(bits > 0);
+        assert(bits <= 32);
+
+        value = (uint32_t)(Peek() & (((uint64_t)1 << bits) - 1));
+        m_bitsProcessed += bits;
+        return true;
+    }
+
+    bool SerializeInteger(int32_t& value, int32_t min, int32_t max)
+    {
+        assert(min < max);
+
+        uint32_t unsignedValue;
+        SerializeBits(unsignedValue, StreamBitsRequired(min, max));
+        value = (int32_t)(unsignedValue + (uint32_t)min);
+
+        return unsignedValue <= (uint32_t)max - (uint32_t)min;
+    }
+
+    // the 8 bytes the value starts in plus the one after, for the bits a byte offset pushes out
+    bool SerializeUint64(uint64_t& value)
+    {
+        const int byteIndex = m_bitsProcessed >> 3;
+        const int shift = m_bitsProcessed & 7;
+
+        const int loadIndex = byteIndex < m_lastLoad ? byteIndex : m_lastLoad;
+        const int nextIndex = byteIndex + 8 < m_lastLoad + 7 ? byteIndex + 8 : m_lastLoad + 7;
+
+        value = (wide_load(m_data + loadIndex) >> shift) | (((uint64_t)m_data[nextIndex] << 1) << (63 - shift));
+        m_bitsProcessed += 64;
+        return true;
+    }
+
+    // the padding has to be zero, like ReadAlign
+    bool SerializeAlign()
+    {
+        const int alignBits = (8 - m_bitsProcessed % 8) % 8;
+        if (alignBits == 0)
+            return true;
+
+        uint32_t padding;
+        SerializeBits(padding, alignBits);
+        return padding == 0;
+    }
+
+    // aligned, so a straight copy. checked here since the length is not part of a fixed layout
+    bool SerializeBytes(uint8_t* data, int bytes)
+    {
+        assert(data);
+        assert(bytes >= 0);
+
+        if (!SerializeAlign())
+            return false;
+
+        if (!HasBits(bytes * 8))
+            return false;
+
+        memcpy(data, m_data + (m_bitsProcessed >> 3), bytes);
+        m_bitsProcessed += bytes * 8;
+        return true;
+    }
+
+    bool SerializeIntArray(int32_t* values, int count, int32_t min, int32_t max)
+    {
+        assert(min < max);
+        assert(count >= 0);
+
+        const int bits = StreamBitsRequired(min, max);
+        const uint32_t range = (uint32_t)max - (uint32_t)min;
+
+        if (!HasBits(count * bits))
+            return false;
+
+        uint32_t bad = 0;
+        for (int i = 0; i < count; ++i) {
+            uint32_t value;
+            SerializeBits(value, bits);
+            bad |= value > range;
+            values[i] = (int32_t)(value + (uint32_t)min);
+        }
+
+        return bad == 0;
+    }
+
+    int GetBitsProcessed() const { return m_bitsProcessed; }
+
+    int GetBytesProcessed() const { return (m_bitsProcessed + 7) / 8; }
+
+    int GetBitsRemaining() const { return m_numBits - m_bitsProcessed; }
+
+private:
+    // the next bits of the stream, at least 57 of them. the load is clamped to the buffer, and near the end the
+    // shift takes the bytes before the position back out. past the end the result is garbage
+    uint64_t Peek() const
+    {
+        const int byteIndex = m_bitsProcessed >> 3;
+        const int loadIndex = byteIndex < m_lastLoad ? byteIndex : m_lastLoad;
+        const int shift = ((byteIndex - loadIndex) * 8 + (m_bitsProcessed & 7)) & 63;
+
+        return wide_load(m_data + loadIndex) >> shift;
+    }
+
+    const uint8_t* m_data;
+    int m_numBits;
+    int m_bitsProcessed;
+    int m_lastLoad; // last byte an 8 byte load may start at
+    uint8_t m_small[8]; // copy of data shorter than 8 bytes
+};
+
+#endif
@@ -1,94 +1,218 @@
 
 #include <iostream>
 #include <map>
-#include <time.h>
-
 #include "client_server.h"
 #include "packet_type_switch.h"
+#include "tick_scheduler.h"
+
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+#include <pthread.h>
+#define SERVER_HAS_THREADS 1
+#else
+#define SERVER_HAS_THREADS 0
+#endif
+
+/*
+    Sharded server.
+
+    With more than one shard the server opens one socket per shard on the same port with SO_REUSEPORT
+    and runs each shard on its own thread. The kernel picks the socket for an incoming datagram from a hash
+    of its source and destination address and port, so a client stays on the same shard for the lifetime
+    of its connection as long as the set of sockets does not change.
+
+    Each shard owns its socket, Server (client slots, challenge hash, rate limiter, fragment buffer, send queue), receive
+    buffers and tick scheduler. Shards share no mutable state, so nothing on the packet path takes a lock.
+
+    A shard runs fixed timestep ticks. It sleeps until a tick is due, then receives everything waiting on its socket,
+    runs the keep-alive and timeout timers and flushes what it queued. Datagrams wait in the socket buffer for at
+    most one tick.
+
+    The receive phase drains the socket until it is empty, up to m_receiveBudget datagrams or
+    ServerReceiveTimeShare of the tick. Whatever is left when a budget runs out, in the receive slots or the socket,
+    is picked up first thing next tick.
+
+    usage: server [num_shards] [max_clients] [tick_rate] [receive_budget] [io_uring]. Defaults to one shard per core.
+    Sharding is Linux only, elsewhere there is one shard. max_clients is per shard and defaults to DefaultMaxClients.
+    Client storage is allocated up front. tick_rate is ticks per second and defaults to DefaultServerTickRate.
+    receive_budget is datagrams per shard per tick and defaults to DefaultReceiveBudget. io_uring 1 puts the shard
+    sockets on the io_uring backend where the kernel supports it; the default 0 keeps them on recvmmsg/sendmmsg,
+    which is faster on the loopback benchmark.
+*/
+
+#define ServerListenPort 30001
+#define MaxServerShards 64
+#define DefaultServerTickRate 60.0 // ticks per second
+#define ServerTickStatsInterval 10.0 // seconds between tick statistics lines
+#define DefaultReceiveBudget 8192 // datagrams a shard handles per tick
+#define ServerReceiveTimeShare 0.5 // share of the tick interval the receive phase may take
+#define ServerReceiveTimeCheck 32 // datagrams between clock reads against the time budget
+
+typedef struct ServerReceiveStats {
+    uint64_t numDatagrams; // datagrams handed to the rate limiter and on
+    uint64_t numBatches; // ReceivePacketBatch calls
+    uint64_t numPacketBudgetExhausted; // ticks that stopped receiving at m_receiveBudget datagrams
+    uint64_t numTimeBudgetExhausted; // ticks that stopped receiving at the time budget
+} ServerReceiveStats;
+
+typedef struct ServerShard {
+    int m_index; // shard number
+
+    Socket m_socket; // this shard's socket on ServerListenPort
+
+    Server m_server; // client slots, challenge hash, fragment buffer and send queue for clients hashed to this shard
 
+    TickScheduler m_scheduler; // when the shard's ticks are due, and how long they take
 
-SocketHandle socketHandle;
+    double m_nextStatsTime; // when to print the next tick statistics line
 
-struct tm* timeInfo;
-time_t currentTime;
-char timeString[20];
+    int m_receiveBudget; // datagrams handled per tick at most
 
-uint16_t sequence = 0;
-PacketData packets[PacketBufferSize];
-uint8_t buffer[MaxPacketSize];
+    ClockTime m_receiveTimeBudget; // nanoseconds the receive phase may take per tick
 
-Socket socket_s;
-Server server;
+    int m_numReceived; // receive slots filled by the last batch
 
-int r_server_init()
+    int m_receiveSlot; // next receive slot to handle. m_numReceived when the batch is done
+
+    int m_receiveOffset; // offset of the next datagram in that slot, for coalesced receives
+
+    ServerReceiveStats m_receiveStats;
+
+#if SOCKET_HAS_IO_URING
+    UringSocket m_uring; // io_uring backend for m_socket, if the kernel supports it
+#endif
+
+    ReceiveSlot m_receiveSlots[MaxReceiveBatch];
+
+    uint8_t m_receiveBuffers[MaxReceiveBatch][SocketMaxCoalescedSize]; // big enough for a UDP_GRO receive
+
+#if SERVER_HAS_THREADS
+    pthread_t m_thread; // thread running the shard. shard 0 runs on the main thread
+#endif
+} ServerShard;
+
+ServerShard* shards;
+int numShards;
+
+int r_server_num_cores()
 {
-    r_sockets_initialize();
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+    long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+    return numCores > 0 ? (int)numCores : 1;
+#else
+    return 1;
+#endif
+}
 
-    const int port = 30001;
+int r_server_shard_init(ServerShard* shard, int index, int socketOptions, int maxClients, double tickRate, int receiveBudget, bool useUring)
+{
+    SocketHandle socketHandle = 0;
 
-    if (!r_socket_create(&socketHandle, port)) {
+    if (!r_socket_create_ex(&socketHandle, ServerListenPort, socketOptions)) {
         printf("[SERVER] Failed to create socket!\n");
-        return false;
+        return 0;
     }
 
-    time(&currentTime);
-    timeInfo = localtime(&currentTime);
-    strftime(timeString, 20, "%H:%M:%S", timeInfo);
+    shard->m_index = index;
+
+    r_socket_init(&shard->m_socket, socketHandle, ServerListenPort);
+
+    for (int i = 0; i < MaxReceiveBatch; ++i) {
+        shard->m_receiveSlots[i].data = shard->m_receiveBuffers[i];
+        shard->m_receiveSlots[i].capacity = SocketMaxCoalescedSize;
+        shard->m_receiveSlots[i].size = 0;
+    }
+
+    // let the kernel coalesce fragment bursts into one receive. must happen before io_uring sizes its buffers
+    r_socket_enable_gro(&shard->m_socket);
+
+#if SOCKET_HAS_IO_URING
+    // receive and send through io_uring when asked to and the kernel supports it. otherwise stay on recvmmsg/sendmmsg
+    if (useUring && r_uring_create(&shard->m_uring, &shard->m_socket))
+        printf("[SERVER] Shard %d using io_uring socket backend\n", index);
+#endif
 
-    socket_s.m_port = port;
-    socket_s.m_socket = socketHandle;
+    if (!CreateServer(&shard->m_server, &shard->m_socket, maxClients)) {
+        printf("[SERVER] Failed to create server for %d clients!\n", maxClients);
+        return 0;
+    }
+
+    if (!r_tick_scheduler_create(&shard->m_scheduler, tickRate, TickSchedulerMaxCatchUp)) {
+        printf("[SERVER] Failed to create tick scheduler!\n");
+        return 0;
+    }
+
+    shard->m_nextStatsTime = r_clock_seconds(r_clock_now()) + ServerTickStatsInterval;
 
-    CreateServer(&server, &socket_s);
+    shard->m_receiveBudget = receiveBudget;
+    shard->m_receiveTimeBudget = (ClockTime)((double)shard->m_scheduler.m_interval * ServerReceiveTimeShare);
+
+    return 1;
 }
 
-int r_server_loop()
+int r_server_init(int requestedShards, int maxClients, double tickRate, int receiveBudget, bool useUring)
 {
-    time(&currentTime);
-    timeInfo = localtime(&currentTime);
-    strftime(timeString, 20, "%H:%M:%S", timeInfo);
+    r_sockets_initialize();
 
-    ServerSendPacketsAll(&server, currentTime);
+    numShards = requestedShards;
+    if (numShards < 1)
+        numShards = 1;
+    if (numShards > MaxServerShards)
+        numShards = MaxServerShards;
+
+    // only Linux load balances unicast UDP across SO_REUSEPORT sockets. BSD and macOS deliver to a single socket
+#if !SERVER_HAS_THREADS || !defined(__linux__)
+    numShards = 1;
+#endif
+
+    shards = (ServerShard*)calloc(numShards, sizeof(ServerShard));
+    if (!shards) {
+        printf("[SERVER] Failed to allocate shards!\n");
+        return 0;
+    }
 
-    Address sender;
+    const int socketOptions = numShards > 1 ? SOCKET_OPTION_REUSE_PORT : SOCKET_OPTION_NONE;
 
-    int bytes_read = ReceivePackets(socket_s, &sender,
-        buffer,
-        sizeof(buffer));
+    for (int i = 0; i < numShards; ++i) {
+        if (!r_server_shard_init(&shards[i], i, socketOptions, maxClients, tickRate, receiveBudget, useUring))
+            return 0;
+    }
 
-    if (!bytes_read)
-        return 1;
+    char timeString[20];
+    printf("[SERVER %s] Listening on port %d with %d shard(s) of %d clients at %.0f ticks per second\n", r_clock_wall_string(timeString, sizeof(timeString)), ServerListenPort, numShards, maxClients, tickRate);
 
+    return 1;
+}
+
+void r_server_process_packet(Server* server, double time, Address sender, uint8_t* buffer, int bytes_read)
+{
     // Unique message recieve
     if (sender.m_address_ipv4 <= 0 || sender.m_address_ipv4 != -858993460) {
 
         if (bytes_read <= 0) {
             printf("bytes_read <= 0\n");
-            return 1;
+            return;
         }
 
         printf("bytes_read: %d\n", bytes_read);
 
+        if (bytes_read < 4) {
+            printf("datagram too small for a crc32\n");
+            return;
+        }
+
         Stream readStream;
         r_stream_read_init(&readStream, buffer, bytes_read);
 
         uint32_t read_crc32 = 0;
         r_serialize_bits(&readStream, &read_crc32, 32);
 
-        uint32_t network_protocolId = host_to_network(packetInfo.protocolId);
-        uint32_t crc32 = calculate_crc32((const uint8_t*)&network_protocolId, 4, 0);
-        uint32_t zero = 0;
-
-        crc32 = calculate_crc32((const uint8_t*)&zero, 4, crc32);
-        // important to offset buffer as to not include og crc32
-        crc32 = calculate_crc32(buffer + 4, bytes_read - 4, crc32);
+        uint32_t crc32 = DatagramCrc32(buffer, bytes_read);
 
         if (crc32 != read_crc32) {
             printf("corrupt packet. expected crc32 %x, got %x\n", crc32, read_crc32);
-            return 1;
+            return;
         }
 
-
-
         int32_t packet_type = 0;
         r_serialize_int(&readStream, &packet_type, 0, 3);
 
@@ -97,22 +221,164 @@ int r_server_loop()
             int32_t client_server_type = 0;
             r_serialize_int(&readStream, &client_server_type, 0, CLIENT_SERVER_NUM_PACKETS);
 
-            ServerReceivePackets(&server, currentTime, sender, &readStream, client_server_type);
+            ServerReceivePackets(server, time, sender, buffer + HEADER_SIZE, bytes_read - HEADER_SIZE, client_server_type);
         }
 
-        // packet_switch(packet_type, readStream);
+        // packet_switch(&server->m_packetBuffer, packet_type, readStream);
     }
+}
+
+void r_server_print_tick_stats(ServerShard* shard)
+{
+    const TickSchedulerStats* stats = &shard->m_scheduler.m_stats;
+    if (stats->numTicks == 0)
+        return;
+
+    const ServerReceiveStats* receiveStats = &shard->m_receiveStats;
 
-    ServerCheckForTimeOut(&server, currentTime);
+    char timeString[20];
+    printf("[SERVER %s] Shard %d: %llu ticks, %.1f us avg, %.1f us max, %llu overruns, %llu dropped, %.1f us max late, "
+           "%llu datagrams in %llu batches, receive budget hit %llu times (packets) %llu times (time)\n",
+        r_clock_wall_string(timeString, sizeof(timeString)),
+        shard->m_index,
+        (unsigned long long)stats->numTicks,
+        (double)stats->totalDuration / (double)stats->numTicks * 1e-3,
+        (double)stats->maxDuration * 1e-3,
+        (unsigned long long)stats->numOverruns,
+        (unsigned long long)stats->numDropped,
+        (double)stats->maxLateness * 1e-3,
+        (unsigned long long)receiveStats->numDatagrams,
+        (unsigned long long)receiveStats->numBatches,
+        (unsigned long long)receiveStats->numPacketBudgetExhausted,
+        (unsigned long long)receiveStats->numTimeBudgetExhausted);
 }
 
-int main()
+/*
+    Receive phase. Handle what is left in the receive slots from last tick, then read batches until one comes back
+    short (the socket is empty) or a budget runs out. The cursor (m_receiveSlot, m_receiveOffset) keeps the place in
+    the current batch, so a tick that stops early leaves the rest for the next one.
+*/
+void r_server_receive(ServerShard* shard, double currentTime)
 {
-    r_server_init();
+    Server* server = &shard->m_server;
+    ServerReceiveStats* stats = &shard->m_receiveStats;
+
+    const ClockTime timeLimit = shard->m_scheduler.m_tickStart + shard->m_receiveTimeBudget;
+
+    int numHandled = 0;
+    bool socketEmpty = false;
 
     while (1) {
-        r_server_loop();
+        if (shard->m_receiveSlot == shard->m_numReceived) {
+            if (socketEmpty)
+                return;
+
+            shard->m_numReceived = ReceivePacketBatch(shard->m_socket, shard->m_receiveSlots, MaxReceiveBatch);
+            shard->m_receiveSlot = 0;
+            shard->m_receiveOffset = 0;
+            stats->numBatches++;
+
+            socketEmpty = shard->m_numReceived < MaxReceiveBatch;
+            if (shard->m_numReceived == 0)
+                return;
+        }
+
+        const ReceiveSlot* slot = &shard->m_receiveSlots[shard->m_receiveSlot];
+
+        // a coalesced receive holds several datagrams back to back. each gets its own crc check and dispatch
+        while (shard->m_receiveOffset < slot->size) {
+            if (numHandled == shard->m_receiveBudget) {
+                stats->numPacketBudgetExhausted++;
+                return;
+            }
+
+            if (numHandled % ServerReceiveTimeCheck == ServerReceiveTimeCheck - 1 && r_clock_now() >= timeLimit) {
+                stats->numTimeBudgetExhausted++;
+                return;
+            }
+
+            const int offset = shard->m_receiveOffset;
+            const int remaining = slot->size - offset;
+            shard->m_receiveOffset += slot->segmentSize;
+            numHandled++;
+            stats->numDatagrams++;
+
+            // sources over their budget are dropped here, before the crc32 or anything else reads the datagram
+            if (!r_rate_limiter_allow(&server->m_rateLimiter, slot->sender, currentTime))
+                continue;
+
+            r_server_process_packet(server, currentTime, slot->sender, slot->data + offset, remaining < slot->segmentSize ? remaining : slot->segmentSize);
+        }
+
+        shard->m_receiveSlot++;
+        shard->m_receiveOffset = 0;
+    }
+}
+
+// run one tick: receive, then keep-alives and timeouts, then send
+int r_server_loop(ServerShard* shard)
+{
+    const double currentTime = r_clock_seconds(r_tick_scheduler_begin(&shard->m_scheduler));
+
+    Server* server = &shard->m_server;
+
+    r_server_receive(shard, currentTime);
+
+    ServerSendPacketsAll(server, currentTime);
+
+    ServerCheckForTimeOut(server, currentTime);
+
+    // everything queued this tick goes out in one batch
+    SendQueueFlush(&server->m_sendQueue);
+
+    r_tick_scheduler_end(&shard->m_scheduler);
+
+    if (currentTime >= shard->m_nextStatsTime) {
+        r_server_print_tick_stats(shard);
+        shard->m_nextStatsTime = currentTime + ServerTickStatsInterval;
     }
+
+    return 1;
+}
+
+void* r_server_shard_run(void* data)
+{
+    ServerShard* shard = (ServerShard*)data;
+
+    while (1)
+        r_server_loop(shard);
+
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    const int requestedShards = argc > 1 ? atoi(argv[1]) : r_server_num_cores();
+    const int maxClients = argc > 2 ? atoi(argv[2]) : DefaultMaxClients;
+    const double tickRate = argc > 3 ? atof(argv[3]) : DefaultServerTickRate;
+    const int receiveBudget = argc > 4 ? atoi(argv[4]) : DefaultReceiveBudget;
+    const bool useUring = argc > 5 ? atoi(argv[5]) != 0 : false;
+
+    if (maxClients <= 0 || tickRate <= 0.0 || receiveBudget <= 0) {
+        printf("usage: server [num_shards] [max_clients] [tick_rate] [receive_budget] [io_uring]\n");
+        return 1;
+    }
+
+    if (!r_server_init(requestedShards, maxClients, tickRate, receiveBudget, useUring))
+        return 1;
+
+#if SERVER_HAS_THREADS
+    for (int i = 1; i < numShards; ++i) {
+        if (pthread_create(&shards[i].m_thread, NULL, r_server_shard_run, &shards[i]) != 0) {
+            printf("[SERVER] Failed to start shard %d!\n", i);
+            return 1;
+        }
+    }
+#endif
+
+    r_server_shard_run(&shards[0]);
+
+    return 0;
 }
 
 /*